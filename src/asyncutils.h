@@ -20,6 +20,7 @@
 #include <glib.h>
 #include <gio/gio.h>
 #include <functional>
+#include <memory>
 
 typedef std::function<void(GAsyncResult *result)> GlibAsyncFunction;
 typedef std::function<bool(void)> GlibSourceFunction;
@@ -52,6 +53,34 @@ private:
 	GlibSourceFunction mFunc;
 };
 
+// Keeps track of a number of operations running concurrently and calls
+// the completion function once the last of them finished. Share it through
+// a std::shared_ptr between the callbacks of all operations.
+class AsyncOperationCounter
+{
+public:
+	AsyncOperationCounter(unsigned int pending, std::function<void(bool success)> done) :
+		mPending(pending),
+		mSuccess(true),
+		mDone(done)
+	{
+	}
+
+	void finish(bool success)
+	{
+		if (!success)
+			mSuccess = false;
+
+		if (mPending > 0 && --mPending == 0)
+			mDone(mSuccess);
+	}
+
+private:
+	unsigned int mPending;
+	bool mSuccess;
+	std::function<void(bool success)> mDone;
+};
+
 void glibAsyncMethodWrapper(GObject *sourceObject, GAsyncResult *result, gpointer user_data);
 gboolean glibSourceMethodWrapper(gpointer user_data);
 
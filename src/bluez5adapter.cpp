@@ -24,9 +24,18 @@
 #include "utils.h"
 #include "bluez5profilegatt.h"
 #include "bluez5profilespp.h"
+#include "propertydecoder.h"
+#include "bluez5sil.h"
+#include "bluez5connectionmanager.h"
 
-Bluez5Adapter::Bluez5Adapter(const std::string &objectPath) :
+#define BLUEZ5_DEFAULT_DEVICE_CAPACITY    512
+#define BLUEZ5_DEFAULT_MAX_PAIRING_SESSIONS    4
+#define BLUEZ5_DISCOVERY_RETRY_MIN_DELAY       500
+#define BLUEZ5_DISCOVERY_RETRY_MAX_DELAY       30000
+
+Bluez5Adapter::Bluez5Adapter(const std::string &objectPath, Bluez5SIL *sil) :
 	mObjectPath(objectPath),
+	mSIL(sil),
 	mAdapterProxy(0),
 	mGattManagerProxy(0),
 	mPropertiesProxy(0),
@@ -37,15 +46,25 @@ Bluez5Adapter::Bluez5Adapter(const std::string &objectPath) :
 	mAgent(0),
 	mAdvertise(0),
 	mProfileManager(0),
-	mPairing(false),
-	mCurrentPairingDevice(0),
-	mCurrentPairingCallback(0),
+	mMaxPairingSessions(BLUEZ5_DEFAULT_MAX_PAIRING_SESSIONS),
 	mObexClient(0),
-	mCancelDiscCallback(0),
-	mAdvertising(false)
+	mConnectionManager(0),
+	mDiscoveryRequested(false),
+	mDiscoveryTarget(false),
+	mDiscoveryCallPending(false),
+	mDiscoveryStopping(false),
+	mDiscoveryRetrySource(0),
+	mDiscoveryRetryDelay(BLUEZ5_DISCOVERY_RETRY_MIN_DELAY),
+	mAdvertising(false),
+	mDeviceCapacity(BLUEZ5_DEFAULT_DEVICE_CAPACITY),
+	mRemoveEvictedDevices(true),
+	mEvictionStats(),
+	mPropertyCacheValid(false)
 {
 	GError *error = 0;
 
+	mConnectionManager = new Bluez5ConnectionManager(this);
+
 	mAdapterProxy = bluez_adapter1_proxy_new_for_bus_sync(G_BUS_TYPE_SYSTEM, G_DBUS_PROXY_FLAGS_NONE,
 													"org.bluez", objectPath.c_str(), NULL, &error);
 	if (error)
@@ -70,11 +89,18 @@ Bluez5Adapter::Bluez5Adapter(const std::string &objectPath) :
 
 	g_signal_connect(G_OBJECT(mPropertiesProxy), "properties-changed", G_CALLBACK(handleAdapterPropertiesChanged), this);
 
+	// Populate the property cache right away so the first getter doesn't
+	// have to wait for a round trip to bluez.
+	fetchAdapterProperties(BluetoothResultCallback());
+
 	mObexClient = new Bluez5ObexClient;
 }
 
 Bluez5Adapter::~Bluez5Adapter()
 {
+	if (mDiscoveryRetrySource)
+		g_source_remove(mDiscoveryRetrySource);
+
 	if (mAdapterProxy)
 		g_object_unref(mAdapterProxy);
 
@@ -83,6 +109,8 @@ Bluez5Adapter::~Bluez5Adapter()
 
 	if (mObexClient)
 		delete mObexClient;
+
+	delete mConnectionManager;
 }
 
 bool Bluez5Adapter::isDiscoveryTimeoutRunning()
@@ -95,22 +123,15 @@ void Bluez5Adapter::handleAdapterPropertiesChanged(BluezAdapter1 *, gchar *inter
 {
 	auto adapter = static_cast<Bluez5Adapter*>(userData);
 	BluetoothPropertiesList properties;
-	bool changed = false;
 
-	for (int n = 0; n < g_variant_n_children(changedProperties); n++)
-	{
-		GVariant *propertyVar = g_variant_get_child_value(changedProperties, n);
-		GVariant *keyVar = g_variant_get_child_value(propertyVar, 0);
-		GVariant *valueVar = g_variant_get_child_value(propertyVar, 1);
+	bool changed = propertyDecoder().decodeAll(adapter, changedProperties, properties);
 
-		std::string key = g_variant_get_string(keyVar, NULL);
+	adapter->updatePropertyCache(properties);
 
-		changed |= adapter->addPropertyFromVariant(properties ,key, g_variant_get_variant(valueVar));
-
-		g_variant_unref(valueVar);
-		g_variant_unref(keyVar);
-		g_variant_unref(propertyVar);
-	}
+	// bluez doesn't send values for invalidated properties so we can't
+	// trust our cache anymore until we fetched everything again.
+	if (invalidatedProperties && g_variant_n_children(invalidatedProperties) > 0)
+		adapter->mPropertyCacheValid = false;
 
 	// If state has changed and we're not discovering or powered any more
 	// we have to make sure to reset the discovery timeout.
@@ -121,155 +142,212 @@ void Bluez5Adapter::handleAdapterPropertiesChanged(BluezAdapter1 *, gchar *inter
 		adapter->observer->adapterPropertiesChanged(properties);
 }
 
-bool Bluez5Adapter::addPropertyFromVariant(BluetoothPropertiesList& properties, const std::string &key, GVariant *valueVar)
+const Bluez5Adapter::AdapterPropertyDecoder& Bluez5Adapter::propertyDecoder()
 {
-	bool changed = false;
+	static AdapterPropertyDecoder decoder;
+	static bool initialized = false;
 
-	if (key == "Name")
-	{
+	if (initialized)
+		return decoder;
+
+	decoder.add("Name", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
 		// prefer Alias over Name. So if there is a mAlias name, always consider that and do not update Name
-		if (mAlias.empty())
-		{
-			mName = g_variant_get_string(valueVar, NULL);
-			DEBUG ("%s: Since alias is empty, get name property as %s", __func__, mName.c_str());
-			properties.push_back(BluetoothProperty(BluetoothProperty::Type::NAME, mName));
-			changed = true;
-		}
-	}
-	else if (key == "Alias")
-	{
-		mAlias = g_variant_get_string(valueVar, NULL);
-		DEBUG ("%s: Got alias property as %s", __func__, mAlias.c_str());
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::NAME, mAlias));
-		changed = true;
-	}
-	else if (key == "Address")
-	{
-		std::string address = g_variant_get_string(valueVar, NULL);
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::BDADDR, address));
-		changed = true;
-	}
-	else if (key == "Class")
-	{
-		uint32_t classOfDevice = g_variant_get_uint32(valueVar);
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::CLASS_OF_DEVICE, classOfDevice));
-		changed = true;
-	}
-	else if (key == "DeviceType")
-	{
+		if (!adapter->mAlias.empty())
+			return false;
+
+		adapter->mName = g_variant_get_string(valueVar, NULL);
+		DEBUG ("Since alias is empty, get name property as %s", adapter->mName.c_str());
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::NAME, adapter->mName));
+		return true;
+	});
+	decoder.add("Alias", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		adapter->mAlias = g_variant_get_string(valueVar, NULL);
+		DEBUG ("Got alias property as %s", adapter->mAlias.c_str());
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::NAME, adapter->mAlias));
+		return true;
+	});
+	decoder.add("Address", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::BDADDR,
+		                                       std::string(g_variant_get_string(valueVar, NULL))));
+		return true;
+	});
+	decoder.add("Class", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::CLASS_OF_DEVICE, g_variant_get_uint32(valueVar)));
+		return true;
+	});
+	decoder.add("DeviceType", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
 		BluetoothDeviceType typeOfDevice = (BluetoothDeviceType)g_variant_get_uint32(valueVar);
 		properties.push_back(BluetoothProperty(BluetoothProperty::Type::TYPE_OF_DEVICE, typeOfDevice));
-		changed = true;
-	}
-	else if (key == "Discoverable")
-	{
+		return true;
+	});
+	decoder.add("Discoverable", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
 		bool discoverable = g_variant_get_boolean(valueVar);
 		properties.push_back(BluetoothProperty(BluetoothProperty::Type::DISCOVERABLE, discoverable));
-		changed = true;
-	}
-	else if (key == "DiscoverableTimeout")
-	{
-		uint32_t discoverableTimeout = g_variant_get_uint32(valueVar);
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::DISCOVERABLE_TIMEOUT, discoverableTimeout));
-		changed = true;
-	}
-	else if (key == "Pairable")
-	{
+		return true;
+	});
+	decoder.add("DiscoverableTimeout", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::DISCOVERABLE_TIMEOUT, g_variant_get_uint32(valueVar)));
+		return true;
+	});
+	decoder.add("Pairable", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
 		bool pairable = g_variant_get_boolean(valueVar);
 		properties.push_back(BluetoothProperty(BluetoothProperty::Type::PAIRABLE, pairable));
-		changed = true;
-	}
-	else if (key == "PairableTimeout")
-	{
-		uint32_t pairableTimeout = g_variant_get_uint32(valueVar);
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::PAIRABLE_TIMEOUT, pairableTimeout));
-		changed = true;
-	}
-	else if (key == "UUIDs")
-	{
-		std::vector<std::string> uuids;
-
-		for (int m = 0; m < g_variant_n_children(valueVar); m++)
-		{
-			GVariant *uuidVar = g_variant_get_child_value(valueVar, m);
-
-			std::string uuid = g_variant_get_string(uuidVar, NULL);
-			uuids.push_back(uuid);
-
-			g_variant_unref(uuidVar);
-		}
+		return true;
+	});
+	decoder.add("PairableTimeout", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		properties.push_back(BluetoothProperty(BluetoothProperty::Type::PAIRABLE_TIMEOUT, g_variant_get_uint32(valueVar)));
+		return true;
+	});
+	decoder.add("UUIDs", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		gsize length = 0;
+		const gchar **uuidArray = g_variant_get_strv(valueVar, &length);
+		std::vector<std::string> uuids(uuidArray, uuidArray + length);
+		g_free(uuidArray);
 
 		properties.push_back(BluetoothProperty(BluetoothProperty::Type::UUIDS, uuids));
-		changed = true;
-	}
-	else if (key == "Powered")
-	{
+		return true;
+	});
+	decoder.add("Powered", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
 		bool powered = g_variant_get_boolean(valueVar);
-		if (powered != mPowered)
+		if (powered != adapter->mPowered)
 		{
-			mPowered = powered;
-			if (observer)
-				observer->adapterStateChanged(mPowered);
+			adapter->mPowered = powered;
+			if (adapter->observer)
+				adapter->observer->adapterStateChanged(adapter->mPowered);
+
+			// LE scans which outlived a power cycle resume scanning
+			if (powered)
+				adapter->updateDiscoveryState();
 		}
-	}
-	else if (key == "Discovering")
+		return false;
+	});
+	decoder.add("Discovering", [](Bluez5Adapter *adapter, GVariant *valueVar, BluetoothPropertiesList &properties) -> bool {
+		adapter->updateDiscovering(g_variant_get_boolean(valueVar));
+		return false;
+	});
+
+	initialized = true;
+	return decoder;
+}
+
+void Bluez5Adapter::updateDiscovering(bool discovering)
+{
+	if (discovering == mDiscovering)
+		return;
+
+	mDiscovering = discovering;
+
+	if (!mDiscovering)
+		mDiscoveryStopping = false;
+
+	// bluez stopped discovery on its own (e.g. adapter powered off)
+	// so drop our request instead of silently restarting it. Active LE
+	// scans still need results and get discovery back once possible.
+	if (!mDiscovering && mDiscoveryTarget && !mDiscoveryCallPending)
 	{
-		bool discovering = g_variant_get_boolean(valueVar);
-		if (discovering != mDiscovering)
-		{
-			mDiscovering = discovering;
-			getObserver()->discoveryStateChanged(mDiscovering);
-			if (mCancelDiscCallback)
-				mCancelDiscCallback(BLUETOOTH_ERROR_NONE);
-		}
+		mDiscoveryTarget = false;
+		mDiscoveryRequested = false;
+
+		if (!mLeScans.empty() && mPowered)
+			scheduleDiscoveryRetry();
 	}
 
-	return changed;
+	if (observer)
+		observer->discoveryStateChanged(mDiscovering);
+
+	if (!mDiscovering && !mDiscoveryTarget)
+		completeDiscoveryStopCallbacks(BLUETOOTH_ERROR_NONE);
 }
 
-void Bluez5Adapter::getAdapterProperties(BluetoothPropertiesResultCallback callback)
+void Bluez5Adapter::updatePropertyCache(const BluetoothPropertiesList &properties)
+{
+	for (auto property : properties)
+		mPropertyCache[property.getType()] = property;
+}
+
+void Bluez5Adapter::fetchAdapterProperties(BluetoothResultCallback callback)
 {
-	auto propertiesGetCallback = [this, callback](GAsyncResult *result) {
-		GVariant *propsVar;
+	// Concurrent fetches share a single GetAll call
+	mPropertyFetchCallbacks.push_back(callback);
+	if (mPropertyFetchCallbacks.size() > 1)
+		return;
+
+	auto propertiesGetCallback = [this](GAsyncResult *result) {
+		GVariant *propsVar = 0;
 		GError *error = 0;
-		gboolean ret;
+		BluetoothError status = BLUETOOTH_ERROR_NONE;
 
-		ret = free_desktop_dbus_properties_call_get_all_finish(mPropertiesProxy, &propsVar, result, &error);
+		free_desktop_dbus_properties_call_get_all_finish(mPropertiesProxy, &propsVar, result, &error);
 		if (error)
 		{
+			DEBUG("Failed to fetch adapter properties: %s", error->message);
 			g_error_free(error);
-			callback(BLUETOOTH_ERROR_FAIL, BluetoothPropertiesList());
-			return;
+			status = BLUETOOTH_ERROR_FAIL;
 		}
-
-		BluetoothPropertiesList properties;
-
-		for (int n = 0; n < g_variant_n_children(propsVar); n++)
+		else
 		{
-			GVariant *propertyVar = g_variant_get_child_value(propsVar, n);
-			GVariant *keyVar = g_variant_get_child_value(propertyVar, 0);
-			GVariant *valueVar = g_variant_get_child_value(propertyVar, 1);
-
-			std::string key = g_variant_get_string(keyVar, NULL);
+			BluetoothPropertiesList properties;
 
-			addPropertyFromVariant(properties, key, g_variant_get_variant(valueVar));
+			propertyDecoder().decodeAll(this, propsVar, properties);
+			g_variant_unref(propsVar);
 
-			g_variant_unref(valueVar);
-			g_variant_unref(keyVar);
-			g_variant_unref(propertyVar);
+			mPropertyCache.clear();
+			updatePropertyCache(properties);
+			mPropertyCacheValid = true;
 		}
 
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::DISCOVERY_TIMEOUT, mDiscoveryTimeout));
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::STACK_NAME, std::string("bluez5")));
-		properties.push_back(BluetoothProperty(BluetoothProperty::Type::UUIDS, mUuids));
+		std::list<BluetoothResultCallback> callbacks;
+		callbacks.swap(mPropertyFetchCallbacks);
 
-		callback(BLUETOOTH_ERROR_NONE, properties);
+		for (auto fetchCallback : callbacks)
+		{
+			if (fetchCallback)
+				fetchCallback(status);
+		}
 	};
 
 	free_desktop_dbus_properties_call_get_all(mPropertiesProxy, "org.bluez.Adapter1", NULL,
 						glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(propertiesGetCallback));
 }
 
+BluetoothPropertiesList Bluez5Adapter::buildPropertiesList() const
+{
+	BluetoothPropertiesList properties;
+
+	for (auto entry : mPropertyCache)
+		properties.push_back(entry.second);
+
+	properties.push_back(BluetoothProperty(BluetoothProperty::Type::DISCOVERY_TIMEOUT, mDiscoveryTimeout));
+	properties.push_back(BluetoothProperty(BluetoothProperty::Type::STACK_NAME, std::string("bluez5")));
+	properties.push_back(BluetoothProperty(BluetoothProperty::Type::UUIDS, mUuids));
+
+	return properties;
+}
+
+void Bluez5Adapter::getAdapterProperties(BluetoothPropertiesResultCallback callback)
+{
+	getAdapterProperties(callback, false);
+}
+
+void Bluez5Adapter::getAdapterProperties(BluetoothPropertiesResultCallback callback, bool revalidate)
+{
+	if (mPropertyCacheValid && !revalidate)
+	{
+		callback(BLUETOOTH_ERROR_NONE, buildPropertiesList());
+		return;
+	}
+
+	fetchAdapterProperties([this, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, BluetoothPropertiesList());
+			return;
+		}
+
+		callback(BLUETOOTH_ERROR_NONE, buildPropertiesList());
+	});
+}
+
 std::string Bluez5Adapter::propertyTypeToString(BluetoothProperty::Type type)
 {
 	std::string propertyName;
@@ -314,6 +392,11 @@ std::string Bluez5Adapter::propertyTypeToString(BluetoothProperty::Type type)
 }
 
 void Bluez5Adapter::getAdapterProperty(BluetoothProperty::Type type, BluetoothPropertyResultCallback callback)
+{
+	getAdapterProperty(type, callback, false);
+}
+
+void Bluez5Adapter::getAdapterProperty(BluetoothProperty::Type type, BluetoothPropertyResultCallback callback, bool revalidate)
 {
 	std::string propertyName = propertyTypeToString(type);
 
@@ -334,77 +417,39 @@ void Bluez5Adapter::getAdapterProperty(BluetoothProperty::Type type, BluetoothPr
 		return;
 	}
 
-	auto propertyGetCallback = [this, callback, type](GAsyncResult *result) {
-		GVariant *propVar, *realPropVar;
-		GError *error = 0;
-		gboolean ret;
+	auto answerFromCache = [this, type, callback]() {
+		// The alias is reported as NAME so it doesn't have its own entry
+		if (type == BluetoothProperty::Type::ALIAS)
+		{
+			callback(BLUETOOTH_ERROR_NONE, BluetoothProperty(type, mAlias));
+			return;
+		}
 
-		ret = free_desktop_dbus_properties_call_get_finish(mPropertiesProxy, &propVar, result, &error);
-		if (error)
+		auto iter = mPropertyCache.find(type);
+		if (iter == mPropertyCache.end())
 		{
-			g_error_free(error);
 			callback(BLUETOOTH_ERROR_FAIL, BluetoothProperty());
 			return;
 		}
 
-		realPropVar = g_variant_get_variant(propVar);
+		callback(BLUETOOTH_ERROR_NONE, iter->second);
+	};
 
-		BluetoothProperty property(type);
-		std::string strValue;
-		uint32_t uint32Value;
-		bool boolValue;
+	if (mPropertyCacheValid && !revalidate)
+	{
+		answerFromCache();
+		return;
+	}
 
-		switch (type)
+	fetchAdapterProperties([callback, answerFromCache](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
 		{
-		case BluetoothProperty::Type::NAME:
-			if (mAlias.empty())
-			{
-				mName = g_variant_get_string(realPropVar, NULL);
-				DEBUG ("%s: Alias is empty, so get property returns name as %s", __func__, mName.c_str());
-				property.setValue(mName);
-			}
-			else
-			{
-				DEBUG ("%s: Alias name available, so get property returns name as %s", __func__, mAlias.c_str());
-				property.setValue(mAlias);
-			}
-			break;
-
-		case BluetoothProperty::Type::ALIAS:
-			mAlias = g_variant_get_string(realPropVar, NULL);
-			DEBUG ("%s: Got alias property as %s", __func__, mAlias.c_str());
-			property.setValue(mAlias);
-			break;
-
-		case BluetoothProperty::Type::BDADDR:
-			strValue = g_variant_get_string(realPropVar, NULL);
-			property.setValue(strValue);
-			break;
-		case BluetoothProperty::Type::CLASS_OF_DEVICE:
-		case BluetoothProperty::Type::DISCOVERABLE_TIMEOUT:
-		case BluetoothProperty::Type::PAIRABLE_TIMEOUT:
-		case BluetoothProperty::Type::TYPE_OF_DEVICE:
-			uint32Value = g_variant_get_uint32(realPropVar);
-			property.setValue(uint32Value);
-			break;
-		case BluetoothProperty::Type::DISCOVERABLE:
-		case BluetoothProperty::Type::PAIRABLE:
-			boolValue = g_variant_get_boolean(realPropVar);
-			property.setValue(boolValue);
-			break;
-		default:
-			callback(BLUETOOTH_ERROR_FAIL, BluetoothProperty());
+			callback(error, BluetoothProperty());
 			return;
 		}
 
-		g_variant_unref(realPropVar);
-		g_variant_unref(propVar);
-
-		callback(BLUETOOTH_ERROR_NONE, property);
-	};
-
-	free_desktop_dbus_properties_call_get(mPropertiesProxy, "org.bluez.Adapter1", propertyName.c_str(), NULL,
-						glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(propertyGetCallback));
+		answerFromCache();
+	});
 }
 
 GVariant* Bluez5Adapter::propertyValueToVariant(const BluetoothProperty& property)
@@ -435,7 +480,7 @@ GVariant* Bluez5Adapter::propertyValueToVariant(const BluetoothProperty& propert
 	return valueVar;
 }
 
-bool Bluez5Adapter::setAdapterPropertySync(const BluetoothProperty& property)
+void Bluez5Adapter::setAdapterPropertyAsync(const BluetoothProperty& property, BluetoothResultCallback callback)
 {
 	std::string propertyName = propertyTypeToString(property.getType());
 
@@ -452,49 +497,105 @@ bool Bluez5Adapter::setAdapterPropertySync(const BluetoothProperty& property)
 			observer->adapterPropertiesChanged(properties);
 		}
 
-		return true;
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
 	}
 
 	GVariant *valueVar = propertyValueToVariant(property);
 	if (!valueVar)
-		return false;
-
-	GError *error = 0;
-	free_desktop_dbus_properties_call_set_sync(mPropertiesProxy, "org.bluez.Adapter1", propertyName.c_str(),
-						g_variant_new_variant(valueVar), NULL, &error);
-	if (error)
 	{
-		DEBUG ("%s: error is %s", __func__, error->message);
-		g_error_free(error);
-		return false;
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
 	}
 
-	return true;
+	auto propertySetCallback = [this, callback, propertyName](GAsyncResult *result) {
+		GError *error = 0;
+
+		free_desktop_dbus_properties_call_set_finish(mPropertiesProxy, result, &error);
+		if (error)
+		{
+			DEBUG ("Failed to set adapter property %s: %s", propertyName.c_str(), error->message);
+			g_error_free(error);
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
+		}
+
+		callback(BLUETOOTH_ERROR_NONE);
+	};
+
+	free_desktop_dbus_properties_call_set(mPropertiesProxy, "org.bluez.Adapter1", propertyName.c_str(),
+						g_variant_new_variant(valueVar), NULL, glibAsyncMethodWrapper,
+						new GlibAsyncFunctionWrapper(propertySetCallback));
 }
 
-void Bluez5Adapter::setAdapterProperty(const BluetoothProperty& property, BluetoothResultCallback callback)
+void Bluez5Adapter::applyAdapterProperties(const BluetoothPropertiesList& properties, BluetoothResultCallback callback)
 {
-	if (!setAdapterPropertySync(property))
+	if (properties.empty())
 	{
-		callback(BLUETOOTH_ERROR_FAIL);
+		callback(BLUETOOTH_ERROR_NONE);
 		return;
 	}
 
-	callback(BLUETOOTH_ERROR_NONE);
+	auto counter = std::make_shared<AsyncOperationCounter>(properties.size(), [callback](bool success) {
+		callback(success ? BLUETOOTH_ERROR_NONE : BLUETOOTH_ERROR_FAIL);
+	});
+
+	for (auto property : properties)
+	{
+		setAdapterPropertyAsync(property, [counter](BluetoothError error) {
+			counter->finish(error == BLUETOOTH_ERROR_NONE);
+		});
+	}
+}
+
+void Bluez5Adapter::setAdapterProperty(const BluetoothProperty& property, BluetoothResultCallback callback)
+{
+	setAdapterPropertyAsync(property, callback);
 }
 
 void Bluez5Adapter::setAdapterProperties(const BluetoothPropertiesList& properties, BluetoothResultCallback callback)
 {
+	bool hasDiscoverableTimeout = false;
+	bool hasPairableTimeout = false;
+
 	for (auto property : properties)
 	{
-		if (!setAdapterPropertySync(property))
+		if (property.getType() == BluetoothProperty::Type::DISCOVERABLE_TIMEOUT)
+			hasDiscoverableTimeout = true;
+		else if (property.getType() == BluetoothProperty::Type::PAIRABLE_TIMEOUT)
+			hasPairableTimeout = true;
+	}
+
+	// All Set calls are issued at once. Only Discoverable and Pairable
+	// have to wait when the same batch carries their timeout as bluez
+	// picks up the timeout at the moment the mode is switched on.
+	BluetoothPropertiesList immediate;
+	BluetoothPropertiesList deferred;
+
+	for (auto property : properties)
+	{
+		if ((property.getType() == BluetoothProperty::Type::DISCOVERABLE && hasDiscoverableTimeout) ||
+		    (property.getType() == BluetoothProperty::Type::PAIRABLE && hasPairableTimeout))
+			deferred.push_back(property);
+		else
+			immediate.push_back(property);
+	}
+
+	if (deferred.empty())
+	{
+		applyAdapterProperties(immediate, callback);
+		return;
+	}
+
+	applyAdapterProperties(immediate, [this, deferred, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
 		{
-			callback(BLUETOOTH_ERROR_FAIL);
+			callback(error);
 			return;
 		}
-	}
 
-	callback(BLUETOOTH_ERROR_NONE);
+		applyAdapterProperties(deferred, callback);
+	});
 }
 
 void Bluez5Adapter::getDeviceProperties(const std::string& address, BluetoothPropertiesResultCallback callback)
@@ -530,15 +631,7 @@ void Bluez5Adapter::setDeviceProperties(const std::string& address, const Blueto
 		return;
 	}
 
-	for (auto property : properties)
-	{
-		if (!device->setDevicePropertySync(property))
-		{
-			callback(BLUETOOTH_ERROR_FAIL);
-			return;
-		}
-	}
-	callback(BLUETOOTH_ERROR_NONE);
+	device->setDevicePropertiesAsync(properties, callback);
 }
 
 BluetoothError Bluez5Adapter::enable()
@@ -587,6 +680,9 @@ gboolean Bluez5Adapter::handleDiscoveryTimeout(gpointer user_data)
 
 	DEBUG("Discovery has timed out. Stopping it.");
 
+	// The source is gone once we return
+	self->mDiscoveryTimeoutSource = 0;
+
 	self->cancelDiscovery([](BluetoothError error) { });
 
 	return FALSE;
@@ -603,22 +699,147 @@ void Bluez5Adapter::startDiscoveryTimeout()
 	}
 }
 
-BluetoothError Bluez5Adapter::startDiscovery()
+bool Bluez5Adapter::isDiscoveryWanted() const
 {
-	if (mDiscovering)
-		return BLUETOOTH_ERROR_NONE;
+	return mDiscoveryRequested || !mLeScans.empty();
+}
 
-	DEBUG("Starting device discovery");
+void Bluez5Adapter::completeDiscoveryStopCallbacks(BluetoothError error)
+{
+	std::list<BluetoothResultCallback> callbacks;
+	callbacks.swap(mDiscoveryStopCallbacks);
 
-	GError *error = 0;
-	bluez_adapter1_call_start_discovery_sync(mAdapterProxy, NULL, &error);
-	if (error)
+	for (auto callback : callbacks)
+		callback(error);
+}
+
+void Bluez5Adapter::scheduleDiscoveryRetry()
+{
+	if (!isDiscoveryWanted())
+		return;
+
+	DEBUG("Retrying to start discovery in %d ms", mDiscoveryRetryDelay);
+
+	mDiscoveryRetrySource = g_timeout_add(mDiscoveryRetryDelay, handleDiscoveryRetry, this);
+
+	mDiscoveryRetryDelay *= 2;
+	if (mDiscoveryRetryDelay > BLUEZ5_DISCOVERY_RETRY_MAX_DELAY)
+		mDiscoveryRetryDelay = BLUEZ5_DISCOVERY_RETRY_MAX_DELAY;
+}
+
+gboolean Bluez5Adapter::handleDiscoveryRetry(gpointer user_data)
+{
+	Bluez5Adapter *adapter = static_cast<Bluez5Adapter*>(user_data);
+
+	adapter->mDiscoveryRetrySource = 0;
+	adapter->updateDiscoveryState();
+
+	return FALSE;
+}
+
+void Bluez5Adapter::updateDiscoveryState()
+{
+	// Another call is still in flight; we reconcile once it returns so
+	// overlapping start/stop requests collapse into a single call.
+	if (mDiscoveryCallPending)
+		return;
+
+	bool wanted = isDiscoveryWanted();
+
+	// A failed start is retried once the delay passed, unless nobody needs
+	// discovery anymore
+	if (mDiscoveryRetrySource)
 	{
-		g_error_free(error);
-		return BLUETOOTH_ERROR_FAIL;
+		if (wanted)
+			return;
+
+		g_source_remove(mDiscoveryRetrySource);
+		mDiscoveryRetrySource = 0;
+		mDiscoveryRetryDelay = BLUEZ5_DISCOVERY_RETRY_MIN_DELAY;
+	}
+	// After a stop bluez replies before it reports Discovering=false, the
+	// stop callbacks complete once it did
+	if (wanted == mDiscoveryTarget && (wanted || !mDiscovering || mDiscoveryStopping))
+	{
+		if (!wanted && !mDiscovering)
+			completeDiscoveryStopCallbacks(BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	mDiscoveryTarget = wanted;
+	mDiscoveryCallPending = true;
+
+	if (wanted)
+	{
+		DEBUG("Starting device discovery");
+
+		mDiscoveryStopping = false;
+
+		auto startCallback = [this](GAsyncResult *result) {
+			GError *error = 0;
+
+			mDiscoveryCallPending = false;
+
+			bluez_adapter1_call_start_discovery_finish(mAdapterProxy, result, &error);
+			if (error)
+			{
+				ERROR(MSGID_DISCOVERY_ERROR, 0, "Failed to start discovery: %s", error->message);
+				g_error_free(error);
+
+				// The request and all LE scans stay pending, we try again
+				// with an increasing delay for as long as they need discovery
+				mDiscoveryTarget = false;
+				completeDiscoveryStopCallbacks(BLUETOOTH_ERROR_NONE);
+				scheduleDiscoveryRetry();
+				return;
+			}
+
+			mDiscoveryRetryDelay = BLUEZ5_DISCOVERY_RETRY_MIN_DELAY;
+			startDiscoveryTimeout();
+			updateDiscoveryState();
+		};
+
+		bluez_adapter1_call_start_discovery(mAdapterProxy, NULL, glibAsyncMethodWrapper,
+		                                    new GlibAsyncFunctionWrapper(startCallback));
 	}
+	else
+	{
+		DEBUG("Stopping device discovery");
+
+		resetDiscoveryTimeout();
 
-	startDiscoveryTimeout();
+		auto stopCallback = [this](GAsyncResult *result) {
+			GError *error = 0;
+
+			mDiscoveryCallPending = false;
+
+			bluez_adapter1_call_stop_discovery_finish(mAdapterProxy, result, &error);
+			if (error)
+			{
+				ERROR(MSGID_DISCOVERY_ERROR, 0, "Failed to stop discovery: %s", error->message);
+				g_error_free(error);
+
+				mDiscoveryTarget = false;
+				completeDiscoveryStopCallbacks(BLUETOOTH_ERROR_FAIL);
+				return;
+			}
+
+			mDiscoveryStopping = mDiscovering;
+			updateDiscoveryState();
+		};
+
+		bluez_adapter1_call_stop_discovery(mAdapterProxy, NULL, glibAsyncMethodWrapper,
+		                                   new GlibAsyncFunctionWrapper(stopCallback));
+	}
+}
+
+BluetoothError Bluez5Adapter::startDiscovery()
+{
+	if (!mAdapterProxy)
+		return BLUETOOTH_ERROR_FAIL;
+
+	mDiscoveryRequested = true;
+	updateDiscoveryState();
 
 	return BLUETOOTH_ERROR_NONE;
 }
@@ -635,28 +856,52 @@ void Bluez5Adapter::resetDiscoveryTimeout()
 
 void Bluez5Adapter::cancelDiscovery(BluetoothResultCallback callback)
 {
-	if (!mDiscovering)
+	mDiscoveryRequested = false;
+
+	// Active LE scans keep discovery running; the classic request is gone
+	// nonetheless so there is nothing left to wait for.
+	if (isDiscoveryWanted() || (!mDiscovering && !mDiscoveryCallPending && !mDiscoveryTarget))
 	{
 		callback(BLUETOOTH_ERROR_NONE);
 		return;
 	}
 
-	resetDiscoveryTimeout();
+	mDiscoveryStopCallbacks.push_back(callback);
+	updateDiscoveryState();
+}
 
-	GError *error = 0;
-	bluez_adapter1_call_stop_discovery_sync(mAdapterProxy, NULL, &error);
-	if (error)
+BluetoothError Bluez5Adapter::startLeDiscovery(uint32_t scanId, BluetoothBleDiscoveryUuidFilterList uuids)
+{
+	// With several adapters a new scan is placed on the least loaded one.
+	// Its results are still reported through our observer since that is
+	// where the caller started it.
+	auto forwardedIter = mForwardedLeScans.find(scanId);
+	if (forwardedIter != mForwardedLeScans.end())
+		return forwardedIter->second->addLeScan(scanId, uuids, this);
+
+	if (mSIL && mLeScans.find(scanId) == mLeScans.end())
 	{
-		g_error_free(error);
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
+		Bluez5Adapter *target = mSIL->selectAdapter();
+		if (target && target != this)
+		{
+			DEBUG("Placing LE scan %d on adapter %s", scanId, target->getObjectPath().c_str());
+
+			BluetoothError error = target->addLeScan(scanId, uuids, this);
+			if (error == BLUETOOTH_ERROR_NONE)
+				mForwardedLeScans.insert(std::pair<uint32_t, Bluez5Adapter*>(scanId, target));
+
+			return error;
+		}
 	}
 
-	mCancelDiscCallback = callback;
+	return addLeScan(scanId, uuids, this);
 }
 
-BluetoothError Bluez5Adapter::startLeDiscovery(uint32_t scanId, BluetoothBleDiscoveryUuidFilterList uuids)
+BluetoothError Bluez5Adapter::addLeScan(uint32_t scanId, BluetoothBleDiscoveryUuidFilterList uuids, Bluez5Adapter *owner)
 {
+	if (owner != this)
+		mLeScanOwners[scanId] = owner;
+
 	if (mLeScans.find(scanId) == mLeScans.end())
 	{
 		for(int i = 0; i < uuids.size(); i++)
@@ -691,29 +936,36 @@ BluetoothError Bluez5Adapter::startLeDiscovery(uint32_t scanId, BluetoothBleDisc
 				}
 				else
 					(devicesIter->second).insert(std::pair<std::string, Bluez5Device*>(device->getAddress(), device));
-				observer->leDeviceFoundByScanId(scanId, device->buildPropertiesList());
+				getLeScanObserver(scanId)->leDeviceFoundByScanId(scanId, device->buildPropertiesList());
 			}
 		}
 	}
-	if (mDiscovering)
-		return BLUETOOTH_ERROR_NONE;
 
-	DEBUG("Starting LE device discovery");
+	if (!mAdapterProxy)
+		return BLUETOOTH_ERROR_FAIL;
+
+	updateDiscoveryState();
 
-	GError *error = 0;
-	bluez_adapter1_call_start_discovery_sync(mAdapterProxy, NULL, &error);
-	if (error)
+	return BLUETOOTH_ERROR_NONE;
+}
+
+BluetoothError Bluez5Adapter::cancelLeDiscovery(uint32_t scanId)
+{
+	auto forwardedIter = mForwardedLeScans.find(scanId);
+	if (forwardedIter != mForwardedLeScans.end())
 	{
-		g_error_free(error);
-		return BLUETOOTH_ERROR_FAIL;
+		Bluez5Adapter *target = forwardedIter->second;
+		mForwardedLeScans.erase(forwardedIter);
+		return target->removeLeScan(scanId);
 	}
-	startDiscoveryTimeout();
-	return BLUETOOTH_ERROR_NONE;
 
+	return removeLeScan(scanId);
 }
 
-BluetoothError Bluez5Adapter::cancelLeDiscovery(uint32_t scanId)
+BluetoothError Bluez5Adapter::removeLeScan(uint32_t scanId)
 {
+	mLeScanOwners.erase(scanId);
+
 	auto scanIter = mLeScans.find(scanId);
 
 	if (scanIter == mLeScans.end())
@@ -723,24 +975,14 @@ BluetoothError Bluez5Adapter::cancelLeDiscovery(uint32_t scanId)
 	else
 	{
 		mLeScans.erase(scanIter);
+		mLeDevicesByScanId.erase(scanId);
 	}
-	if (!mDiscovering)
-		return BLUETOOTH_ERROR_NONE;
 
-	if (mLeScans.size() == 0)
-	{
-		resetDiscoveryTimeout();
-		GError *error = 0;
-		bluez_adapter1_call_stop_discovery_sync(mAdapterProxy, NULL, &error);
-		if (error)
-		{
-			g_error_free(error);
-			return BLUETOOTH_ERROR_FAIL;
-		}
-	}
+	updateDiscoveryState();
 
 	return BLUETOOTH_ERROR_NONE;
 }
+
 BluetoothProfile* Bluez5Adapter::createProfile(const std::string& profileId)
 {
 	BluetoothProfile *profile = 0;
@@ -812,57 +1054,120 @@ void Bluez5Adapter::addDevice(const std::string &objectPath)
 					}
 					else
 						(devicesIter->second).insert(std::pair<std::string, Bluez5Device*>(device->getAddress(), device));
-					observer->leDeviceFoundByScanId(scanId, device->buildPropertiesList());
+					getLeScanObserver(scanId)->leDeviceFoundByScanId(scanId, device->buildPropertiesList());
 				}
 			}
 		}
 		observer->deviceFound(device->buildPropertiesList());
 	}
+
+	if (mDevices.size() > mEvictionStats.peakDevices)
+		mEvictionStats.peakDevices = mDevices.size();
+
+	evictDevices();
 }
 
 void Bluez5Adapter::removeDevice(const std::string &objectPath)
 {
-	std::string address;
+	Bluez5Device *device = findDeviceByObjectPath(objectPath);
+	if (!device)
+		return;
 
-	for ( auto it = mLeScans.begin(); it != mLeScans.end(); ++it)
+	dropDevice(device);
+}
+
+void Bluez5Adapter::dropDevice(Bluez5Device *device)
+{
+	std::string lowerCaseAddress = convertAddressToLowerCase(device->getAddress());
+
+	for (auto it = mLeScans.begin(); it != mLeScans.end(); ++it)
 	{
-		uint32_t scanId;
-		scanId = it->first;
+		uint32_t scanId = it->first;
 		auto devicesIter = mLeDevicesByScanId.find(scanId);
-		if (devicesIter != mLeDevicesByScanId.end())
-		{
-			for (auto iter = devicesIter->second.begin(); iter != devicesIter->second.end(); ++iter)
-			{
-				Bluez5Device *device = (*iter).second;
-				if (device->getObjectPath() == objectPath)
-				{
-					address = device->getAddress();
-					devicesIter->second.erase(iter);
-					delete device;
-					break;
-				}
-			}
-			std::string lowerCaseAddress = convertAddressToLowerCase(address);
-			if (lowerCaseAddress.length() > 0 && observer)
-				observer->leDeviceRemovedByScanId(scanId, lowerCaseAddress);
-		}
+		if (devicesIter == mLeDevicesByScanId.end())
+			continue;
+
+		if (devicesIter->second.erase(device->getAddress()) && observer)
+			getLeScanObserver(scanId)->leDeviceRemovedByScanId(scanId, lowerCaseAddress);
 	}
-	for (auto iter = mDevices.begin(); iter != mDevices.end(); ++iter)
+
+	mConnectionManager->cancelRequests(device);
+
+	mDevices.erase(device->getAddress());
+	delete device;
+
+	if (lowerCaseAddress.length() > 0 && observer)
+		observer->deviceRemoved(lowerCaseAddress);
+}
+
+void Bluez5Adapter::setDeviceCapacity(uint32_t capacity, bool removeFromBluez)
+{
+	mDeviceCapacity = capacity;
+	mRemoveEvictedDevices = removeFromBluez;
+
+	evictDevices();
+}
+
+bool Bluez5Adapter::isDeviceEvictable(Bluez5Device *device) const
+{
+	if (device->getPaired() || device->getConnected() || device->getTrusted())
+		return false;
+
+	if (mConnectionManager->hasRequests(device))
+		return false;
+
+	return !isPairingFor(device->getAddress());
+}
+
+void Bluez5Adapter::evictDevices()
+{
+	if (mDeviceCapacity == 0)
+		return;
+
+	while (mDevices.size() > mDeviceCapacity)
 	{
-		Bluez5Device *device = (*iter).second;
-		if (device->getObjectPath() == objectPath)
+		Bluez5Device *oldest = 0;
+
+		for (auto deviceIter : mDevices)
 		{
-			address = device->getAddress();
-			mDevices.erase(iter);
-			delete device;
-			break;
+			Bluez5Device *device = deviceIter.second;
+			if (!isDeviceEvictable(device))
+				continue;
+
+			if (!oldest || device->getLastSeen() < oldest->getLastSeen())
+				oldest = device;
 		}
-	}
 
-	std::string lowerCaseAddress = convertAddressToLowerCase(address);
+		// Everything left is paired, trusted or connected; we never drop those.
+		if (!oldest)
+			return;
 
-	if (lowerCaseAddress.length() > 0 && observer)
-		observer->deviceRemoved(lowerCaseAddress);
+		DEBUG("Evicting device %s (table holds %zu devices, capacity %u)",
+		      oldest->getAddress().c_str(), mDevices.size(), mDeviceCapacity);
+
+		mEvictionStats.evictedDevices++;
+
+		if (mRemoveEvictedDevices && mAdapterProxy)
+		{
+			auto removeCallback = [this](GAsyncResult *result) {
+				GError *error = 0;
+
+				bluez_adapter1_call_remove_device_finish(mAdapterProxy, result, &error);
+				if (error)
+				{
+					DEBUG("Failed to remove evicted device: %s", error->message);
+					mEvictionStats.removeFailures++;
+					g_error_free(error);
+				}
+			};
+
+			mEvictionStats.removeRequests++;
+			bluez_adapter1_call_remove_device(mAdapterProxy, oldest->getObjectPath().c_str(), NULL,
+			                                  glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(removeCallback));
+		}
+
+		dropDevice(oldest);
+	}
 }
 
 void Bluez5Adapter::handleDevicePropertiesChanged(Bluez5Device *device)
@@ -884,7 +1189,7 @@ void Bluez5Adapter::handleDevicePropertiesChanged(Bluez5Device *device)
 						if (iterDevice->getAddress() == device->getAddress())
 						{
 							std::string lowerCaseAddress = convertAddressToLowerCase(device->getAddress());
-							observer->leDevicePropertiesChangedByScanId(scanId, lowerCaseAddress, device->buildPropertiesList());
+							getLeScanObserver(scanId)->leDevicePropertiesChangedByScanId(scanId, lowerCaseAddress, device->buildPropertiesList());
 							break;
 						}
 					}
@@ -942,6 +1247,80 @@ Bluez5Device* Bluez5Adapter::findDevice(const std::string &address)
 	return mDevices.count(upperCaseAddress) ? mDevices[upperCaseAddress] : NULL;
 }
 
+Bluez5Device* Bluez5Adapter::routeDevice(const std::string &address)
+{
+	if (!mSIL)
+		return findDevice(address);
+
+	return mSIL->routeDevice(address, this);
+}
+
+Bluez5Device* Bluez5Adapter::routeDeviceByObjectPath(const std::string &objectPath)
+{
+	if (!mSIL)
+		return findDeviceByObjectPath(objectPath);
+
+	return mSIL->findDeviceByObjectPath(objectPath);
+}
+
+bool Bluez5Adapter::isDeviceInUse(const std::string &address, const Bluez5ProfileBase *except) const
+{
+	for (auto &iter : mProfiles)
+	{
+		Bluez5ProfileBase *profile = dynamic_cast<Bluez5ProfileBase*>(iter.second);
+		if (profile && profile != except && profile->hasConnection(address))
+			return true;
+	}
+
+	return false;
+}
+
+BluetoothAdapterStatusObserver* Bluez5Adapter::getLeScanObserver(uint32_t scanId)
+{
+	auto ownerIter = mLeScanOwners.find(scanId);
+	if (ownerIter != mLeScanOwners.end())
+		return ownerIter->second->observer;
+
+	return observer;
+}
+
+void Bluez5Adapter::dropLeScansForAdapter(Bluez5Adapter *adapter)
+{
+	for (auto iter = mForwardedLeScans.begin(); iter != mForwardedLeScans.end();)
+	{
+		if (iter->second == adapter)
+			iter = mForwardedLeScans.erase(iter);
+		else
+			++iter;
+	}
+
+	std::list<uint32_t> ownedScans;
+	for (auto iter : mLeScanOwners)
+	{
+		if (iter.second == adapter)
+			ownedScans.push_back(iter.first);
+	}
+
+	for (auto scanId : ownedScans)
+		removeLeScan(scanId);
+}
+
+uint32_t Bluez5Adapter::getLoad() const
+{
+	uint32_t load = mLeScans.size();
+
+	if (mDiscoveryRequested)
+		load++;
+
+	for (auto entry : mDevices)
+	{
+		if (entry.second->getConnected())
+			load++;
+	}
+
+	return load;
+}
+
 bool Bluez5Adapter::anyMatch(BluetoothBleDiscoveryUuidFilterList deviceUuids, BluetoothBleDiscoveryUuidFilterList requestUuids)
 {
 	for(int i = 0; i < deviceUuids.size(); i++)
@@ -968,21 +1347,24 @@ Bluez5Device* Bluez5Adapter::findDeviceByObjectPath(const std::string &objectPat
 	return 0;
 }
 
-void Bluez5Adapter::reportPairingResult(bool success)
+bool Bluez5Adapter::isPairingFor(const std::string &address) const
 {
+	return mPairingSessions.count(convertAddressToUpperCase(address)) > 0;
 }
 
-bool Bluez5Adapter::isPairingFor(const std::string &address) const
+bool Bluez5Adapter::isPairing() const
 {
-	if (mPairing && mCurrentPairingDevice)
-		return mCurrentPairingDevice->getAddress() == address;
+	return !mPairingSessions.empty();
+}
 
-	return false;
+void Bluez5Adapter::addPairingSession(const std::string &address, bool outgoing)
+{
+	mPairingSessions[convertAddressToUpperCase(address)] = outgoing;
 }
 
-bool Bluez5Adapter::isPairing() const
+void Bluez5Adapter::removePairingSession(const std::string &address)
 {
-	return mPairing;
+	mPairingSessions.erase(convertAddressToUpperCase(address));
 }
 
 void Bluez5Adapter::pair(const std::string &address, BluetoothResultCallback callback)
@@ -993,8 +1375,22 @@ void Bluez5Adapter::pair(const std::string &address, BluetoothResultCallback cal
 		return;
 	}
 
-	if (mPairing)
+	if (isPairingFor(address))
+	{
+		callback(BLUETOOTH_ERROR_BUSY);
+		return;
+	}
+
+	uint32_t outgoingSessions = 0;
+	for (auto session : mPairingSessions)
+	{
+		if (session.second)
+			outgoingSessions++;
+	}
+
+	if (mMaxPairingSessions > 0 && outgoingSessions >= mMaxPairingSessions)
 	{
+		DEBUG("Too many pairings in progress, not pairing with %s", address.c_str());
 		callback(BLUETOOTH_ERROR_BUSY);
 		return;
 	}
@@ -1006,9 +1402,6 @@ void Bluez5Adapter::pair(const std::string &address, BluetoothResultCallback cal
 		return;
 	}
 
-	mPairing = true;
-	mCurrentPairingDevice = device;
-
 	device->pair(callback);
 }
 
@@ -1110,7 +1503,8 @@ void Bluez5Adapter::cancelPairing(const std::string &address, BluetoothResultCal
 		return;
 	}
 
-	if (!mPairing)
+	auto session = mPairingSessions.find(convertAddressToUpperCase(address));
+	if (session == mPairingSessions.end())
 	{
 		callback(BLUETOOTH_ERROR_NOT_READY);
 		return;
@@ -1123,7 +1517,7 @@ void Bluez5Adapter::cancelPairing(const std::string &address, BluetoothResultCal
 		return;
 	}
 
-	if (device == mCurrentPairingDevice)
+	if (session->second)
 	{
 		DEBUG("Canceling outgoing pairing to address %s", address.c_str());
 		device->cancelPairing(callback);
@@ -1134,8 +1528,8 @@ void Bluez5Adapter::cancelPairing(const std::string &address, BluetoothResultCal
 
 		if (getAgent()->cancelPairing(address))
 		{
+			getAgent()->stopPairingForDevice(device);
 			callback(BLUETOOTH_ERROR_NONE);
-			setPairing(false);
 		}
 		else
 		{
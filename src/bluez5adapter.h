@@ -34,15 +34,33 @@ extern "C" {
 
 class Bluez5Agent;
 class Bluez5ObexClient;
+class Bluez5SIL;
+class Bluez5ConnectionManager;
+class Bluez5ProfileBase;
+
+template <typename T, typename... Args> class PropertyDecoder;
+
+struct Bluez5DeviceEvictionStats
+{
+	uint64_t evictedDevices;
+	uint64_t removeRequests;
+	uint64_t removeFailures;
+	uint32_t peakDevices;
+};
 
 class Bluez5Adapter : public BluetoothAdapter
 {
 public:
-	Bluez5Adapter(const std::string &objectPath);
+	Bluez5Adapter(const std::string &objectPath, Bluez5SIL *sil = 0);
 	~Bluez5Adapter();
 
 	void getAdapterProperties(BluetoothPropertiesResultCallback callback);
 	void getAdapterProperty(BluetoothProperty::Type type, BluetoothPropertyResultCallback callback);
+	// Adapter properties are answered from a cache kept current through
+	// PropertiesChanged signals. Passing revalidate forces a fresh GetAll
+	// from bluez before the callback is called.
+	void getAdapterProperties(BluetoothPropertiesResultCallback callback, bool revalidate);
+	void getAdapterProperty(BluetoothProperty::Type type, BluetoothPropertyResultCallback callback, bool revalidate);
 	void setAdapterProperty(const BluetoothProperty& property, BluetoothResultCallback callback);
 	void setAdapterProperties(const BluetoothPropertiesList& newProperties, BluetoothResultCallback callback);
 	void getDeviceProperties(const std::string& address, BluetoothPropertiesResultCallback callback);
@@ -65,8 +83,30 @@ public:
 
 	void addDevice(const std::string &objectPath);
 	void removeDevice(const std::string &objectPath);
+
+	// Limits the number of devices we keep proxies for. Once exceeded the
+	// least recently seen device which is neither paired, trusted nor
+	// connected is dropped. A capacity of zero disables eviction. Devices
+	// evicted without removing them from bluez reappear with their next
+	// property update.
+	void setDeviceCapacity(uint32_t capacity, bool removeFromBluez = true);
+	uint32_t getDeviceCapacity() const { return mDeviceCapacity; }
+	const Bluez5DeviceEvictionStats& getDeviceEvictionStats() const { return mEvictionStats; }
 	Bluez5Device* findDeviceByObjectPath(const std::string &objectPath);
 	Bluez5Device* findDevice(const std::string &address);
+
+	// Profiles look devices up through these so that with several adapters
+	// a connection is made through the least loaded one and everything
+	// after that follows the adapter owning the connection.
+	Bluez5Device* routeDevice(const std::string &address);
+	Bluez5Device* routeDeviceByObjectPath(const std::string &objectPath);
+	// Whether any profile besides the given one holds a connection to the
+	// device
+	bool isDeviceInUse(const std::string &address, const Bluez5ProfileBase *except) const;
+
+	bool getPowered() const { return mPowered; }
+	uint32_t getLoad() const;
+	void dropLeScansForAdapter(Bluez5Adapter *adapter);
 	bool anyMatch(BluetoothBleDiscoveryUuidFilterList deviceUuids, BluetoothBleDiscoveryUuidFilterList requestUuids);
 
 	void assignAgent(Bluez5Agent *agent);
@@ -91,13 +131,17 @@ public:
 	static void handleAdapterPropertiesChanged(BluezAdapter1 *, gchar *interface,  GVariant *changedProperties,
 											   GVariant *invalidatedProperties, gpointer userData);
 
-	void reportPairingResult(bool success);
-
 	BluetoothAdapterStatusObserver* getObserver() { return observer; }
 
-	void setPairing(bool pairing) { mPairing = pairing; }
+	// Pairing state is kept per device so several pairings can run in
+	// parallel. Outgoing pairings are limited to getMaxPairingSessions().
+	void addPairingSession(const std::string &address, bool outgoing);
+	void removePairingSession(const std::string &address);
+	void setMaxPairingSessions(uint32_t maxSessions) { mMaxPairingSessions = maxSessions; }
+	uint32_t getMaxPairingSessions() const { return mMaxPairingSessions; }
 
 	Bluez5ObexClient* getObexClient() const { return mObexClient; }
+	Bluez5ConnectionManager* getConnectionManager() const { return mConnectionManager; }
 
 	static gboolean handleDiscoveryTimeout(gpointer user_data);
 
@@ -130,16 +174,36 @@ public:
 private:
 	std::string propertyTypeToString(BluetoothProperty::Type type);
 	GVariant* propertyValueToVariant(const BluetoothProperty& property);
-	bool addPropertyFromVariant(BluetoothPropertiesList& properties, const std::string &key, GVariant *valueVar);
-	bool setAdapterPropertySync(const BluetoothProperty& property);
+	typedef PropertyDecoder<Bluez5Adapter, BluetoothPropertiesList&> AdapterPropertyDecoder;
+	static const AdapterPropertyDecoder& propertyDecoder();
+	void updateDiscovering(bool discovering);
+	void fetchAdapterProperties(BluetoothResultCallback callback);
+	void updatePropertyCache(const BluetoothPropertiesList &properties);
+	BluetoothPropertiesList buildPropertiesList() const;
+	void setAdapterPropertyAsync(const BluetoothProperty& property, BluetoothResultCallback callback);
+	void applyAdapterProperties(const BluetoothPropertiesList& properties, BluetoothResultCallback callback);
 	BluetoothProfile* createProfile(const std::string& profileId);
 
 	void resetDiscoveryTimeout();
 	void startDiscoveryTimeout();
 	bool isDiscoveryTimeoutRunning();
 
+	bool isDeviceEvictable(Bluez5Device *device) const;
+	void evictDevices();
+	void dropDevice(Bluez5Device *device);
+
+	void updateDiscoveryState();
+	bool isDiscoveryWanted() const;
+	void completeDiscoveryStopCallbacks(BluetoothError error);
+	void scheduleDiscoveryRetry();
+	static gboolean handleDiscoveryRetry(gpointer user_data);
+	BluetoothError addLeScan(uint32_t scanId, BluetoothBleDiscoveryUuidFilterList uuids, Bluez5Adapter *owner);
+	BluetoothError removeLeScan(uint32_t scanId);
+	BluetoothAdapterStatusObserver* getLeScanObserver(uint32_t scanId);
+
 private:
 	std::string mObjectPath;
+	Bluez5SIL *mSIL;
 	BluezAdapter1 *mAdapterProxy;
 	BluezGattManager1 *mGattManagerProxy;
 	FreeDesktopDBusProperties *mPropertiesProxy;
@@ -148,21 +212,44 @@ private:
 	std::unordered_map<std::string, Bluez5Device*> mDevices;
 	std::unordered_map<uint32_t, BluetoothBleDiscoveryUuidFilterList> mLeScans;
 	std::unordered_map<uint32_t, std::unordered_map<std::string, Bluez5Device*>> mLeDevicesByScanId;
+	// scan id -> adapter we placed the scan on
+	std::unordered_map<uint32_t, Bluez5Adapter*> mForwardedLeScans;
+	// scan id -> adapter that placed the scan on us
+	std::unordered_map<uint32_t, Bluez5Adapter*> mLeScanOwners;
 	uint32_t mDiscoveryTimeout;
 	guint mDiscoveryTimeoutSource;
 	Bluez5Agent *mAgent;
 	Bluez5Advertise *mAdvertise;
 	BluezProfileManager1 *mProfileManager;
-	bool mPairing;
-	Bluez5Device *mCurrentPairingDevice;
-	BluetoothResultCallback mCurrentPairingCallback;
+	// device address -> true for pairings we initiated
+	std::unordered_map<std::string, bool> mPairingSessions;
+	uint32_t mMaxPairingSessions;
 	std::map<std::string, BluetoothProfile*> mProfiles;
 	Bluez5ObexClient *mObexClient;
+	Bluez5ConnectionManager *mConnectionManager;
 	std::string mName;
 	std::string mAlias;
-	BluetoothResultCallback mCancelDiscCallback;
+	// Discovery is reference counted between the classic discovery request
+	// and all active LE scans. mDiscoveryTarget is the state we last asked
+	// bluez for and at most one StartDiscovery/StopDiscovery call is in
+	// flight at any time.
+	bool mDiscoveryRequested;
+	bool mDiscoveryTarget;
+	bool mDiscoveryCallPending;
+	// bluez accepted StopDiscovery but still reports Discovering
+	bool mDiscoveryStopping;
+	// pending retry of a failed StartDiscovery
+	guint mDiscoveryRetrySource;
+	uint32_t mDiscoveryRetryDelay;
+	std::list<BluetoothResultCallback> mDiscoveryStopCallbacks;
 	bool mAdvertising;
 	std::vector <std::string> mUuids;
+	uint32_t mDeviceCapacity;
+	bool mRemoveEvictedDevices;
+	Bluez5DeviceEvictionStats mEvictionStats;
+	std::map<BluetoothProperty::Type, BluetoothProperty> mPropertyCache;
+	bool mPropertyCacheValid;
+	std::list<BluetoothResultCallback> mPropertyFetchCallbacks;
 };
 
 #endif // BLUEZ5ADAPTER_H
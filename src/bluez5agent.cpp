@@ -21,6 +21,7 @@
 #include "bluez5adapter.h"
 #include "bluez5agent.h"
 #include "bluez5sil.h"
+#include "bluez5pairingpolicy.h"
 #include "logging.h"
 #include "utils.h"
 
@@ -75,7 +76,8 @@ Bluez5Agent::Bluez5Agent(BluezAgentManager1 *agentManager, Bluez5SIL *sil) :
 	mAgentManager(agentManager),
 	mPath(BLUEZ5_AGENT_OBJECT_PATH),
 	mSIL(sil),
-	mCapability(BLUETOOTH_PAIRING_IO_CAPABILITY_NO_INPUT_NO_OUTPUT)
+	mCapability(BLUETOOTH_PAIRING_IO_CAPABILITY_NO_INPUT_NO_OUTPUT),
+	mPairingPolicy(0)
 {
 	mBusId = g_bus_own_name(G_BUS_TYPE_SYSTEM, BLUEZ5_AGENT_BUS_NAME,
 				G_BUS_NAME_OWNER_FLAGS_NONE,
@@ -202,6 +204,37 @@ Bluez5AgentPairingInfo* Bluez5Agent::findPairingInfoForAddress(const std::string
 	return pairingInfo;
 }
 
+std::string Bluez5Agent::getDeviceName(const std::string &objectPath)
+{
+	Bluez5Device *device = mSIL->findDeviceByObjectPath(objectPath);
+	if (!device)
+		return std::string();
+
+	return device->getName();
+}
+
+std::string Bluez5Agent::getDeviceAddress(const std::string &objectPath)
+{
+	Bluez5Device *device = mSIL->findDeviceByObjectPath(objectPath);
+	if (!device)
+		return std::string();
+
+	return device->getAddress();
+}
+
+Bluez5AgentPairingInfo* Bluez5Agent::findPairingInfoWithPendingRequest()
+{
+	for (auto iter = mDevicePairings.begin(); iter != mDevicePairings.end(); ++iter)
+	{
+		auto pairingInfo = iter->second;
+		if (pairingInfo->requestConfirmation || pairingInfo->requestAuthorization ||
+		    pairingInfo->requestPairingSecret)
+			return pairingInfo;
+	}
+
+	return 0;
+}
+
 Bluez5AgentPairingInfo* Bluez5Agent::initiatePairing(GDBusMethodInvocation *invocation, const gchar *objectPath)
 {
 	auto pairingInfo = findPairingInfoForDevice(objectPath);
@@ -211,14 +244,7 @@ Bluez5AgentPairingInfo* Bluez5Agent::initiatePairing(GDBusMethodInvocation *invo
 
 		// As we don't have an entry for the device yet we got a
 		// pairing request from a remote device
-		Bluez5Adapter *defaultAdapter = mSIL->getDefaultBluez5Adapter();
-		if (!defaultAdapter)
-		{
-			DEBUG ("default adapter is not set");
-			return NULL;
-		}
-
-		Bluez5Device* device = defaultAdapter->findDeviceByObjectPath(objectPath);
+		Bluez5Device* device = mSIL->findDeviceByObjectPath(objectPath);
 		if (!device || !startPairingForDevice(device, true))
 		{
 			DEBUG("Failed to handle incoming pairing request");
@@ -253,13 +279,34 @@ gboolean Bluez5Agent::handleCancel(BluezAgent1 *proxy, GDBusMethodInvocation *in
 
 	Bluez5Agent *agent = static_cast<Bluez5Agent*>(user_data);
 
-	Bluez5Adapter *defaultAdapter = agent->mSIL->getDefaultBluez5Adapter();
-	if (defaultAdapter && defaultAdapter->isPairing())
+	// bluez has at most one request outstanding with its agent so the
+	// cancel belongs to the pairing still waiting for an answer.
+	Bluez5AgentPairingInfo *pairingInfo = agent->findPairingInfoWithPendingRequest();
+	if (pairingInfo)
 	{
-		BluetoothAdapterStatusObserver *observer = defaultAdapter->getObserver();
+		std::string deviceAddress = pairingInfo->deviceAddress;
+		BluetoothAdapterStatusObserver *observer = pairingInfo->adapter->getObserver();
+
+		agent->cancelPairing(deviceAddress);
+
+		// Outgoing pairings are cleaned up once the pair call returns but
+		// nothing else ends an incoming one
+		if (pairingInfo->incoming)
+			agent->stopPairingForDevice(deviceAddress);
+
 		if (observer)
 			observer->pairingCanceled();
 	}
+	else
+	{
+		Bluez5Adapter *defaultAdapter = agent->mSIL->getDefaultBluez5Adapter();
+		if (defaultAdapter && defaultAdapter->isPairing())
+		{
+			BluetoothAdapterStatusObserver *observer = defaultAdapter->getObserver();
+			if (observer)
+				observer->pairingCanceled();
+		}
+	}
 
 	bluez_agent1_complete_cancel(agent->mInterface, invocation);
 
@@ -270,6 +317,26 @@ gboolean Bluez5Agent::handleAuthorizeService(BluezAgent1 *proxy, GDBusMethodInvo
                                          const gchar *address, const gchar *service, gpointer user_data)
 {
 	DEBUG("Agent authorize service method was called");
+
+	Bluez5Agent *agent = static_cast<Bluez5Agent*>(user_data);
+	if (agent->mPairingPolicy)
+	{
+		auto decision = agent->mPairingPolicy->authorizeService(agent->getDeviceAddress(address),
+		                                                        agent->getDeviceName(address), service);
+		if (decision == Bluez5PairingPolicy::ACCEPT)
+		{
+			DEBUG("Service %s authorized by pairing policy", service);
+			bluez_agent1_complete_authorize_service(proxy, invocation);
+			return TRUE;
+		}
+		else if (decision == Bluez5PairingPolicy::REJECT)
+		{
+			DEBUG("Service %s rejected by pairing policy", service);
+			g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_REJECTED, "Rejected by policy");
+			return TRUE;
+		}
+	}
+
 	g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_NOT_IMPLEMENTED, "Not implemented yet");
 
 	return FALSE;
@@ -279,6 +346,26 @@ gboolean Bluez5Agent::handleRequestAuthorization(BluezAgent1 *proxy, GDBusMethod
                                                  const gchar *address, gpointer user_data)
 {
 	DEBUG("Agent request authorize method was called");
+
+	Bluez5Agent *agent = static_cast<Bluez5Agent*>(user_data);
+	if (agent->mPairingPolicy)
+	{
+		auto decision = agent->mPairingPolicy->authorizePairing(agent->getDeviceAddress(address),
+		                                                        agent->getDeviceName(address));
+		if (decision == Bluez5PairingPolicy::ACCEPT)
+		{
+			DEBUG("Pairing authorized by pairing policy");
+			bluez_agent1_complete_request_authorization(proxy, invocation);
+			return TRUE;
+		}
+		else if (decision == Bluez5PairingPolicy::REJECT)
+		{
+			DEBUG("Pairing rejected by pairing policy");
+			g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_REJECTED, "Rejected by policy");
+			return TRUE;
+		}
+	}
+
 	g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_NOT_IMPLEMENTED, "Not implemented yet");
 
 	return FALSE;
@@ -345,6 +432,18 @@ gboolean Bluez5Agent::handleRequestConfirmation(BluezAgent1 *proxy, GDBusMethodI
 
 	pairingInfo->requestConfirmation = invocation;
 
+	if (agent->mPairingPolicy)
+	{
+		auto decision = agent->mPairingPolicy->confirmPairing(pairingInfo->deviceAddress,
+		                                                      agent->getDeviceName(objectPath), passkey);
+		if (decision != Bluez5PairingPolicy::ASK)
+		{
+			DEBUG("Pairing confirmation for %s answered by pairing policy", pairingInfo->deviceAddress.c_str());
+			agent->supplyPairingConfirmation(pairingInfo->deviceAddress, decision == Bluez5PairingPolicy::ACCEPT);
+			return TRUE;
+		}
+	}
+
 	BluetoothAdapterStatusObserver *observer = pairingInfo->adapter->getObserver();
 
 	if (observer)
@@ -369,6 +468,32 @@ gboolean Bluez5Agent::handleRequestPasskey(BluezAgent1 *proxy, GDBusMethodInvoca
 
 	pairingInfo->requestPairingSecret = invocation;
 
+	if (agent->mPairingPolicy)
+	{
+		BluetoothPasskey passkey = 0;
+		auto decision = agent->mPairingPolicy->lookupPasskey(pairingInfo->deviceAddress,
+		                                                     agent->getDeviceName(objectPath), passkey);
+		if (decision == Bluez5PairingPolicy::ACCEPT)
+		{
+			DEBUG("Passkey for %s supplied by pairing policy", pairingInfo->deviceAddress.c_str());
+			agent->supplyPairingSecret(pairingInfo->deviceAddress, passkey);
+			return TRUE;
+		}
+		else if (decision == Bluez5PairingPolicy::REJECT)
+		{
+			std::string deviceAddress = pairingInfo->deviceAddress;
+
+			DEBUG("Passkey for %s rejected by pairing policy", deviceAddress.c_str());
+			g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_REJECTED, "Rejected by policy");
+			pairingInfo->requestPairingSecret = 0;
+
+			if (pairingInfo->incoming)
+				agent->stopPairingForDevice(deviceAddress);
+
+			return TRUE;
+		}
+	}
+
 	BluetoothAdapterStatusObserver *observer = pairingInfo->adapter->getObserver();
 
 	if (observer)
@@ -393,6 +518,32 @@ gboolean Bluez5Agent::handleRequestPinCode(BluezAgent1 *proxy, GDBusMethodInvoca
 
 	pairingInfo->requestPairingSecret = invocation;
 
+	if (agent->mPairingPolicy)
+	{
+		std::string pin;
+		auto decision = agent->mPairingPolicy->lookupPinCode(pairingInfo->deviceAddress,
+		                                                     agent->getDeviceName(objectPath), pin);
+		if (decision == Bluez5PairingPolicy::ACCEPT && !pin.empty())
+		{
+			DEBUG("Pin code for %s supplied by pairing policy", pairingInfo->deviceAddress.c_str());
+			agent->supplyPairingSecret(pairingInfo->deviceAddress, pin);
+			return TRUE;
+		}
+		else if (decision == Bluez5PairingPolicy::REJECT)
+		{
+			std::string deviceAddress = pairingInfo->deviceAddress;
+
+			DEBUG("Pin code for %s rejected by pairing policy", deviceAddress.c_str());
+			g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_REJECTED, "Rejected by policy");
+			pairingInfo->requestPairingSecret = 0;
+
+			if (pairingInfo->incoming)
+				agent->stopPairingForDevice(deviceAddress);
+
+			return TRUE;
+		}
+	}
+
 	BluetoothAdapterStatusObserver *observer = pairingInfo->adapter->getObserver();
 	if (observer)
 	{
@@ -425,22 +576,34 @@ bool Bluez5Agent::startPairingForDevice(Bluez5Device *device, bool incoming)
 
 	mDevicePairings.insert(std::pair<std::string,Bluez5AgentPairingInfo*>(device->getObjectPath(), pairingInfo));
 
-	device->getAdapter()->setPairing(true);
+	device->getAdapter()->addPairingSession(device->getAddress(), !incoming);
 
 	return true;
 }
 
-void Bluez5Agent::stopPairingForDevice(const std::string &address)
+void Bluez5Agent::removePairing(std::unordered_map<std::string, Bluez5AgentPairingInfo*>::iterator iter)
 {
-	Bluez5Adapter *defaultAdapter = mSIL->getDefaultBluez5Adapter();
-	if (!defaultAdapter)
-		return;
+	Bluez5AgentPairingInfo *pairingInfo = iter->second;
 
-	Bluez5Device *device = defaultAdapter->findDevice(address);
-	if (!device)
-		return;
+	pairingInfo->adapter->removePairingSession(pairingInfo->deviceAddress);
+
+	delete pairingInfo;
+	mDevicePairings.erase(iter);
+}
 
-	stopPairingForDevice(device);
+void Bluez5Agent::stopPairingForDevice(const std::string &address)
+{
+	std::string upperCaseAddress = convertAddressToUpperCase(address);
+
+	for (auto iter = mDevicePairings.begin(); iter != mDevicePairings.end(); ++iter)
+	{
+		if (iter->second->deviceAddress == upperCaseAddress)
+		{
+			DEBUG("Stop pairing with %s", upperCaseAddress.c_str());
+			removePairing(iter);
+			return;
+		}
+	}
 }
 
 void Bluez5Agent::stopPairingForDevice(Bluez5Device *device)
@@ -457,11 +620,7 @@ void Bluez5Agent::stopPairingForDevice(Bluez5Device *device)
 		return;
 	}
 
-	delete iter->second;
-
-	mDevicePairings.erase(iter);
-
-	device->getAdapter()->setPairing(false);
+	removePairing(iter);
 }
 
 bool Bluez5Agent::supplyPairingConfirmation(const std::string &address, bool accept)
@@ -486,20 +645,14 @@ bool Bluez5Agent::supplyPairingConfirmation(const std::string &address, bool acc
 		bluez_agent1_complete_request_confirmation(mInterface, pairingInfo->requestConfirmation);
 	}
 
+	pairingInfo->requestConfirmation = 0;
+
 	// For incoming pairing requests we can remove the pairing info here
 	// and for outgoing ones it will be removed once the pair callback comes
 	// back from bluez
 	if (pairingInfo->incoming)
 	{
-		Bluez5Adapter *defaultAdapter = mSIL->getDefaultBluez5Adapter();
-		if (!defaultAdapter)
-			return false;
-
-		Bluez5Device *device = defaultAdapter->findDevice(address);
-		if (!device)
-			return false;
-
-		stopPairingForDevice(device);
+		stopPairingForDevice(address);
 
 		// We're done with pairing at this point. Everything else is up to the remote
 		// party and will notify our layer on top through a property change of the
@@ -517,6 +670,11 @@ bool Bluez5Agent::supplyPairingSecret(const std::string &address, BluetoothPassk
 		return false;
 
 	bluez_agent1_complete_request_passkey(mInterface, pairingInfo->requestPairingSecret, passkey);
+	pairingInfo->requestPairingSecret = 0;
+
+	// Incoming pairings are done from our side once the secret went out
+	if (pairingInfo->incoming)
+		stopPairingForDevice(address);
 
 	return true;
 }
@@ -532,6 +690,11 @@ bool Bluez5Agent::supplyPairingSecret(const std::string &address, const std::str
 		return false;
 
 	bluez_agent1_complete_request_pin_code(mInterface, pairingInfo->requestPairingSecret, pin.c_str());
+	pairingInfo->requestPairingSecret = 0;
+
+	// Incoming pairings are done from our side once the secret went out
+	if (pairingInfo->incoming)
+		stopPairingForDevice(address);
 
 	return true;
 }
@@ -554,6 +717,14 @@ bool Bluez5Agent::cancelPairing(const std::string address)
 			DEBUG("Sending cancel signal to remote device");
 			g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_AGENT_ERROR_CANCELED,
                                                                    "Pairing canceled by user");
+
+			if (invocation == pairingInfo->requestConfirmation)
+				pairingInfo->requestConfirmation = 0;
+			else if (invocation == pairingInfo->requestAuthorization)
+				pairingInfo->requestAuthorization = 0;
+			else
+				pairingInfo->requestPairingSecret = 0;
+
 			return true;
 		}
 	}
@@ -28,6 +28,7 @@ extern "C" {
 
 class Bluez5AgentPairingInfo;
 class Bluez5SIL;
+class Bluez5PairingPolicy;
 
 class Bluez5Agent
 {
@@ -44,6 +45,11 @@ public:
 	bool supplyPairingSecret(const std::string &address, BluetoothPasskey passkey);
 	bool cancelPairing(const std::string address);
 
+	// Requests the policy has an answer for are completed right away
+	// instead of going through the adapter observer. The policy is not
+	// owned by the agent.
+	void setPairingPolicy(Bluez5PairingPolicy *policy) { mPairingPolicy = policy; }
+
 	static void handleBusAcquired(GDBusConnection *connection, const gchar *name, gpointer user_data);
 
 	static gboolean handleRequestConfirmation(BluezAgent1 *proxy, GDBusMethodInvocation *invocation,
@@ -68,9 +74,13 @@ public:
 private:
 	Bluez5AgentPairingInfo* findPairingInfoForDevice(const std::string &objectPath);
 	Bluez5AgentPairingInfo* findPairingInfoForAddress(const std::string &address);
+	Bluez5AgentPairingInfo* findPairingInfoWithPendingRequest();
+	void removePairing(std::unordered_map<std::string, Bluez5AgentPairingInfo*>::iterator iter);
 	Bluez5AgentPairingInfo* initiatePairing(GDBusMethodInvocation *invocation, const gchar *objectPath);
 	void createInterface(GDBusConnection *connection);
 	std::string convertPairingIOCapability(BluetoothPairingIOCapability capability);
+	std::string getDeviceName(const std::string &objectPath);
+	std::string getDeviceAddress(const std::string &objectPath);
 
 private:
 	guint mBusId;
@@ -80,6 +90,7 @@ private:
 	std::unordered_map<std::string, Bluez5AgentPairingInfo*> mDevicePairings;
 	Bluez5SIL *mSIL;
 	BluetoothPairingIOCapability mCapability;
+	Bluez5PairingPolicy *mPairingPolicy;
 };
 
 #endif // BLUEZ5AGENT_H
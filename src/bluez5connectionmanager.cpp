@@ -0,0 +1,416 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bluez5connectionmanager.h"
+#include "bluez5adapter.h"
+#include "bluez5device.h"
+#include "logging.h"
+
+#define BLUEZ5_DEFAULT_MAX_CONCURRENT_CONNECTS    2
+#define BLUEZ5_DEFAULT_CONNECT_TIMEOUT_MS         15000
+#define BLUEZ5_DEFAULT_CONNECT_RETRIES            2
+#define BLUEZ5_DEFAULT_INITIAL_BACKOFF_MS         500
+#define BLUEZ5_DEFAULT_MAX_BACKOFF_MS             8000
+
+Bluez5ConnectionManager::Bluez5ConnectionManager(Bluez5Adapter *adapter) :
+	mAdapter(adapter),
+	mMaxConcurrentConnects(BLUEZ5_DEFAULT_MAX_CONCURRENT_CONNECTS),
+	mConnectTimeout(BLUEZ5_DEFAULT_CONNECT_TIMEOUT_MS),
+	mMaxRetries(BLUEZ5_DEFAULT_CONNECT_RETRIES),
+	mInitialBackoff(BLUEZ5_DEFAULT_INITIAL_BACKOFF_MS),
+	mMaxBackoff(BLUEZ5_DEFAULT_MAX_BACKOFF_MS),
+	mDispatching(false)
+{
+}
+
+Bluez5ConnectionManager::~Bluez5ConnectionManager()
+{
+	for (auto request : mQueue)
+		delete request;
+
+	for (auto request : mBackoff)
+	{
+		g_source_remove(request->retrySource);
+		delete request;
+	}
+
+	// Attempts still in flight free their request once bluez answers
+	for (auto request : mActive)
+	{
+		request->manager = 0;
+
+		if (request->timeoutSource)
+		{
+			g_source_remove(request->timeoutSource);
+			request->timeoutSource = 0;
+		}
+
+		g_cancellable_cancel(request->cancellable);
+	}
+}
+
+void Bluez5ConnectionManager::setMaxConcurrentConnects(uint32_t maxConnects)
+{
+	mMaxConcurrentConnects = maxConnects;
+	dispatch();
+}
+
+void Bluez5ConnectionManager::setRetryBackoff(uint32_t initialMs, uint32_t maxMs)
+{
+	mInitialBackoff = initialMs;
+	mMaxBackoff = maxMs;
+}
+
+bool Bluez5ConnectionManager::getConnectStats(const std::string &address, Bluez5ConnectStats &stats) const
+{
+	auto iter = mStats.find(address);
+	if (iter == mStats.end())
+		return false;
+
+	stats = iter->second;
+	return true;
+}
+
+void Bluez5ConnectionManager::connect(Bluez5Device *device, BluetoothResultCallback callback)
+{
+	enqueue(device, CONNECT_DEVICE, std::string(), callback);
+}
+
+void Bluez5ConnectionManager::connectProfile(Bluez5Device *device, const std::string &uuid, BluetoothResultCallback callback)
+{
+	enqueue(device, CONNECT_PROFILE, uuid, callback);
+}
+
+void Bluez5ConnectionManager::connectGatt(Bluez5Device *device, BluetoothResultCallback callback)
+{
+	enqueue(device, CONNECT_GATT, std::string(), callback);
+}
+
+void Bluez5ConnectionManager::enqueue(Bluez5Device *device, ConnectType type, const std::string &uuid,
+                                      BluetoothResultCallback callback)
+{
+	if (!device)
+	{
+		callback(BLUETOOTH_ERROR_PARAM_INVALID);
+		return;
+	}
+
+	Request *request = new Request;
+	request->manager = this;
+	request->type = type;
+	request->objectPath = device->getObjectPath();
+	request->address = device->getAddress();
+	request->uuid = uuid;
+	request->callback = callback;
+	request->attempt = 0;
+	request->startTime = 0;
+	request->cancellable = 0;
+	request->timeoutSource = 0;
+	request->retrySource = 0;
+	request->timedOut = false;
+	request->aborted = false;
+
+	mQueue.push_back(request);
+
+	dispatch();
+}
+
+bool Bluez5ConnectionManager::isDeviceBusy(const std::string &objectPath) const
+{
+	// A device waiting for its retry is still busy
+	for (auto list : { &mActive, &mBackoff })
+	{
+		for (auto request : *list)
+		{
+			if (request->objectPath == objectPath)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+void Bluez5ConnectionManager::dispatch()
+{
+	// Starting an attempt may complete a request right away and its
+	// callback may queue another one so we never walk the queue twice.
+	if (mDispatching)
+		return;
+
+	mDispatching = true;
+
+	bool started = true;
+	while (started)
+	{
+		started = false;
+
+		for (auto iter = mQueue.begin(); iter != mQueue.end(); ++iter)
+		{
+			if (mMaxConcurrentConnects > 0 && mActive.size() >= mMaxConcurrentConnects)
+				break;
+
+			Request *request = *iter;
+			if (isDeviceBusy(request->objectPath))
+				continue;
+
+			mQueue.erase(iter);
+			startAttempt(request);
+			started = true;
+			break;
+		}
+	}
+
+	mDispatching = false;
+}
+
+void Bluez5ConnectionManager::startAttempt(Request *request)
+{
+	Bluez5Device *device = mAdapter->findDeviceByObjectPath(request->objectPath);
+	if (!device)
+	{
+		DEBUG("Device %s disappeared before it could be connected", request->address.c_str());
+		finishRequest(request, BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	if (request->attempt == 0)
+		request->startTime = g_get_monotonic_time();
+
+	request->attempt++;
+	request->timedOut = false;
+	request->cancellable = g_cancellable_new();
+
+	mActive.push_back(request);
+	mStats[request->address].attempts++;
+
+	DEBUG("Connecting to %s, attempt %d", request->address.c_str(), request->attempt);
+
+	if (mConnectTimeout > 0)
+		request->timeoutSource = g_timeout_add(mConnectTimeout, handleAttemptTimeout, request);
+
+	auto resultCallback = [request](BluetoothError error, bool retryable) {
+		handleAttemptResult(request, error, retryable);
+	};
+
+	switch (request->type)
+	{
+	case CONNECT_DEVICE:
+		device->connect(resultCallback, request->cancellable);
+		break;
+	case CONNECT_PROFILE:
+		device->connect(request->uuid, resultCallback, request->cancellable);
+		break;
+	case CONNECT_GATT:
+		device->connectGatt(resultCallback, request->cancellable);
+		break;
+	}
+}
+
+gboolean Bluez5ConnectionManager::handleAttemptTimeout(gpointer user_data)
+{
+	Request *request = static_cast<Request*>(user_data);
+	Bluez5ConnectionManager *manager = request->manager;
+
+	request->timeoutSource = 0;
+	request->timedOut = true;
+
+	DEBUG("Connect attempt to %s timed out", request->address.c_str());
+
+	// Cancelling our call doesn't stop bluez from trying so abort the
+	// pending link setup as well. A profile connect may run on top of an
+	// existing link which we must not tear down.
+	if (request->type != CONNECT_PROFILE)
+	{
+		Bluez5Device *device = manager->mAdapter->findDeviceByObjectPath(request->objectPath);
+		if (device && !device->getConnected())
+			device->disconnect([](BluetoothError error) { });
+	}
+
+	g_cancellable_cancel(request->cancellable);
+
+	return FALSE;
+}
+
+void Bluez5ConnectionManager::handleAttemptResult(Request *request, BluetoothError error, bool retryable)
+{
+	Bluez5ConnectionManager *manager = request->manager;
+
+	if (request->timeoutSource)
+	{
+		g_source_remove(request->timeoutSource);
+		request->timeoutSource = 0;
+	}
+
+	g_object_unref(request->cancellable);
+	request->cancellable = 0;
+
+	if (!manager)
+	{
+		delete request;
+		return;
+	}
+
+	manager->mActive.remove(request);
+
+	// The device of an aborted request is gone together with its stats
+	if (request->aborted)
+	{
+		manager->finishRequest(request, error);
+		return;
+	}
+
+	if (error == BLUETOOTH_ERROR_NONE)
+	{
+		manager->recordSuccess(request);
+		manager->finishRequest(request, error);
+		return;
+	}
+
+	Bluez5ConnectStats &stats = manager->mStats[request->address];
+	if (request->timedOut)
+		stats.timeouts++;
+
+	// Our own timeout cancels the call which bluez reports like any other
+	// transient failure
+	if ((retryable || request->timedOut) && request->attempt <= manager->mMaxRetries)
+	{
+		uint32_t backoff = manager->mMaxBackoff;
+		uint32_t shift = request->attempt - 1;
+
+		if (shift < 16 && (manager->mInitialBackoff << shift) < manager->mMaxBackoff)
+			backoff = manager->mInitialBackoff << shift;
+
+		DEBUG("Retrying connect to %s in %d ms", request->address.c_str(), backoff);
+
+		stats.retries++;
+		request->retrySource = g_timeout_add(backoff, handleRetryTimeout, request);
+		manager->mBackoff.push_back(request);
+
+		manager->dispatch();
+		return;
+	}
+
+	stats.failures++;
+	manager->finishRequest(request, error);
+}
+
+gboolean Bluez5ConnectionManager::handleRetryTimeout(gpointer user_data)
+{
+	Request *request = static_cast<Request*>(user_data);
+	Bluez5ConnectionManager *manager = request->manager;
+
+	request->retrySource = 0;
+
+	// Retries keep their place ahead of requests queued meanwhile
+	manager->mBackoff.remove(request);
+	manager->mQueue.push_front(request);
+	manager->dispatch();
+
+	return FALSE;
+}
+
+void Bluez5ConnectionManager::recordSuccess(Request *request)
+{
+	Bluez5ConnectStats &stats = mStats[request->address];
+	gint64 latency = g_get_monotonic_time() - request->startTime;
+
+	stats.successes++;
+	stats.lastLatency = latency;
+	stats.totalLatency += latency;
+
+	if (stats.minLatency == 0 || latency < stats.minLatency)
+		stats.minLatency = latency;
+
+	if (latency > stats.maxLatency)
+		stats.maxLatency = latency;
+}
+
+void Bluez5ConnectionManager::finishRequest(Request *request, BluetoothError error)
+{
+	BluetoothResultCallback callback = request->callback;
+
+	delete request;
+
+	dispatch();
+
+	if (callback)
+		callback(error);
+}
+
+bool Bluez5ConnectionManager::hasRequests(Bluez5Device *device) const
+{
+	std::string objectPath = device->getObjectPath();
+
+	for (auto list : { &mQueue, &mActive, &mBackoff })
+	{
+		for (auto request : *list)
+		{
+			if (request->objectPath == objectPath)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+void Bluez5ConnectionManager::cancelRequests(Bluez5Device *device)
+{
+	std::string objectPath = device->getObjectPath();
+	std::list<Request*> canceled;
+
+	mStats.erase(device->getAddress());
+
+	for (auto iter = mQueue.begin(); iter != mQueue.end();)
+	{
+		if ((*iter)->objectPath == objectPath)
+		{
+			canceled.push_back(*iter);
+			iter = mQueue.erase(iter);
+		}
+		else
+			++iter;
+	}
+
+	for (auto iter = mBackoff.begin(); iter != mBackoff.end();)
+	{
+		if ((*iter)->objectPath == objectPath)
+		{
+			g_source_remove((*iter)->retrySource);
+			canceled.push_back(*iter);
+			iter = mBackoff.erase(iter);
+		}
+		else
+			++iter;
+	}
+
+	for (auto request : mActive)
+	{
+		if (request->objectPath == objectPath)
+		{
+			request->aborted = true;
+			g_cancellable_cancel(request->cancellable);
+		}
+	}
+
+	for (auto request : canceled)
+	{
+		BluetoothResultCallback callback = request->callback;
+		delete request;
+
+		if (callback)
+			callback(BLUETOOTH_ERROR_FAIL);
+	}
+}
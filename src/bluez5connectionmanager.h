@@ -0,0 +1,123 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BLUEZ5CONNECTIONMANAGER_H
+#define BLUEZ5CONNECTIONMANAGER_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <bluetooth-sil-api.h>
+
+class Bluez5Adapter;
+class Bluez5Device;
+
+struct Bluez5ConnectStats
+{
+	uint64_t attempts;
+	uint64_t successes;
+	uint64_t failures;
+	uint64_t timeouts;
+	uint64_t retries;
+	// latencies of successful connects in microseconds, measured from the
+	// first attempt so they include the time spent in retries
+	gint64 lastLatency;
+	gint64 minLatency;
+	gint64 maxLatency;
+	gint64 totalLatency;
+};
+
+// Queues connect requests of all devices of one adapter. Only a limited
+// number of attempts is in flight at a time and at most one per device,
+// every attempt is bound by a timeout and attempts which failed for a
+// transient reason are retried with exponential backoff.
+class Bluez5ConnectionManager
+{
+public:
+	Bluez5ConnectionManager(Bluez5Adapter *adapter);
+	~Bluez5ConnectionManager();
+
+	void connect(Bluez5Device *device, BluetoothResultCallback callback);
+	void connectProfile(Bluez5Device *device, const std::string &uuid, BluetoothResultCallback callback);
+	void connectGatt(Bluez5Device *device, BluetoothResultCallback callback);
+
+	// Fails all queued requests of a device which is about to go away and
+	// forgets its stats
+	void cancelRequests(Bluez5Device *device);
+	bool hasRequests(Bluez5Device *device) const;
+
+	void setMaxConcurrentConnects(uint32_t maxConnects);
+	void setConnectTimeout(uint32_t timeoutMs) { mConnectTimeout = timeoutMs; }
+	void setMaxRetries(uint32_t maxRetries) { mMaxRetries = maxRetries; }
+	void setRetryBackoff(uint32_t initialMs, uint32_t maxMs);
+
+	bool getConnectStats(const std::string &address, Bluez5ConnectStats &stats) const;
+
+private:
+	enum ConnectType
+	{
+		CONNECT_DEVICE,
+		CONNECT_PROFILE,
+		CONNECT_GATT
+	};
+
+	struct Request
+	{
+		Bluez5ConnectionManager *manager;
+		ConnectType type;
+		std::string objectPath;
+		std::string address;
+		std::string uuid;
+		BluetoothResultCallback callback;
+		uint32_t attempt;
+		gint64 startTime;
+		GCancellable *cancellable;
+		guint timeoutSource;
+		guint retrySource;
+		bool timedOut;
+		bool aborted;
+	};
+
+	void enqueue(Bluez5Device *device, ConnectType type, const std::string &uuid, BluetoothResultCallback callback);
+	void dispatch();
+	bool isDeviceBusy(const std::string &objectPath) const;
+	void startAttempt(Request *request);
+	void finishRequest(Request *request, BluetoothError error);
+	void recordSuccess(Request *request);
+
+	static void handleAttemptResult(Request *request, BluetoothError error, bool retryable);
+	static gboolean handleAttemptTimeout(gpointer user_data);
+	static gboolean handleRetryTimeout(gpointer user_data);
+
+	Bluez5Adapter *mAdapter;
+	std::list<Request*> mQueue;
+	std::list<Request*> mActive;
+	std::list<Request*> mBackoff;
+	uint32_t mMaxConcurrentConnects;
+	uint32_t mConnectTimeout;
+	uint32_t mMaxRetries;
+	uint32_t mInitialBackoff;
+	uint32_t mMaxBackoff;
+	bool mDispatching;
+	// dropped together with the device
+	std::unordered_map<std::string, Bluez5ConnectStats> mStats;
+};
+
+#endif // BLUEZ5CONNECTIONMANAGER_H
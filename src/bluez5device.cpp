@@ -19,6 +19,30 @@
 #include "bluez5adapter.h"
 #include "bluez5agent.h"
 #include "asyncutils.h"
+#include "propertydecoder.h"
+
+// Upper bounds for the advertisement record of a single device. The data
+// of an extended advertisement, chained over several PDUs, is limited to
+// 1650 bytes so no single entry can be longer than that.
+#define BLUEZ5_MAX_AD_ENTRIES        8
+#define BLUEZ5_MAX_AD_DATA_LENGTH    1650
+
+static void copyAdvertisementBytes(GVariant *bytesVar, std::vector<uint8_t> &out)
+{
+	gsize length = 0;
+	const guint8 *bytes = 0;
+
+	if (g_variant_is_of_type(bytesVar, G_VARIANT_TYPE_BYTESTRING))
+		bytes = static_cast<const guint8*>(g_variant_get_fixed_array(bytesVar, &length, sizeof(guint8)));
+
+	if (length > BLUEZ5_MAX_AD_DATA_LENGTH)
+		length = BLUEZ5_MAX_AD_DATA_LENGTH;
+
+	if (bytes)
+		out.assign(bytes, bytes + length);
+	else
+		out.clear();
+}
 
 Bluez5Device::Bluez5Device(Bluez5Adapter *adapter, const std::string &objectPath) :
 	mAdapter(adapter),
@@ -32,10 +56,11 @@ Bluez5Device::Bluez5Device(Bluez5Adapter *adapter, const std::string &objectPath
 	mTxPower(0),
 	mRSSI(0),
 	mDeviceProxy(0),
-	mPropertiesProxy(0)
+	mPropertiesProxy(0),
+	mLastSeen(g_get_monotonic_time())
 {
 	GError *error = 0;
-	GVariant *propsVar;
+	GVariant *propsVar = 0;
 
 	mDeviceProxy = bluez_device1_proxy_new_for_bus_sync(G_BUS_TYPE_SYSTEM, G_DBUS_PROXY_FLAGS_NONE,
 														"org.bluez", objectPath.c_str(), NULL, &error);
@@ -61,24 +86,17 @@ Bluez5Device::Bluez5Device(Bluez5Adapter *adapter, const std::string &objectPath
 
 	g_signal_connect(G_OBJECT(mPropertiesProxy), "properties-changed", G_CALLBACK(handlePropertiesChanged), this);
 
-	free_desktop_dbus_properties_call_get_all_sync(mPropertiesProxy, "org.bluez.Device1", &propsVar, NULL, NULL);
-	if(!error)
+	free_desktop_dbus_properties_call_get_all_sync(mPropertiesProxy, "org.bluez.Device1", &propsVar, NULL, &error);
+	if (error)
 	{
-		for (int n = 0; n < g_variant_n_children(propsVar); n++)
-		{
-			GVariant *propertyVar = g_variant_get_child_value(propsVar, n);
-			GVariant *keyVar = g_variant_get_child_value(propertyVar, 0);
-			GVariant *valueVar = g_variant_get_child_value(propertyVar, 1);
-
-			std::string key = g_variant_get_string(keyVar, NULL);
-
-			parsePropertyFromVariant(key, g_variant_get_variant(valueVar));
-
-			g_variant_unref(propertyVar);
-			g_variant_unref(keyVar);
-			g_variant_unref(valueVar);
-		}
+		ERROR(MSGID_FAILED_TO_CREATE_ADAPTER_PROXY, 0, "Failed to get properties for device on path %s: %s",
+			  objectPath.c_str(), error->message);
+		g_error_free(error);
+		return;
 	}
+
+	propertyDecoder().decodeAll(this, propsVar);
+	g_variant_unref(propsVar);
 }
 
 Bluez5Device::~Bluez5Device()
@@ -87,31 +105,21 @@ Bluez5Device::~Bluez5Device()
 		g_object_unref(mDeviceProxy);
 
 	if (mPropertiesProxy)
+	{
+		g_signal_handlers_disconnect_by_data(mPropertiesProxy, this);
 		g_object_unref(mPropertiesProxy);
+	}
 }
 
 
 void Bluez5Device::handlePropertiesChanged(BluezDevice1 *, gchar *interface,  GVariant *changedProperties,
 												   GVariant *invalidatedProperties, gpointer userData)
 {
-	bool propertiesChanged = false;
 	auto device = static_cast<Bluez5Device*>(userData);
 
-	for (int n = 0; n < g_variant_n_children(changedProperties); n++)
-	{
-		GVariant *propertyVar = g_variant_get_child_value(changedProperties, n);
-		GVariant *keyVar = g_variant_get_child_value(propertyVar, 0);
-		GVariant *valueVar = g_variant_get_child_value(propertyVar, 1);
+	device->mLastSeen = g_get_monotonic_time();
 
-		std::string key = g_variant_get_string(keyVar, NULL);
-
-		if (device->parsePropertyFromVariant(key, g_variant_get_variant(valueVar)))
-			propertiesChanged = true;
-
-		g_variant_unref(valueVar);
-		g_variant_unref(keyVar);
-		g_variant_unref(propertyVar);
-	}
+	bool propertiesChanged = propertyDecoder().decodeAll(device, changedProperties);
 
 	if (propertiesChanged)
 	{
@@ -120,129 +128,152 @@ void Bluez5Device::handlePropertiesChanged(BluezDevice1 *, gchar *interface,  GV
 	}
 }
 
-bool Bluez5Device::parsePropertyFromVariant(const std::string &key, GVariant *valueVar)
+const Bluez5Device::DevicePropertyDecoder& Bluez5Device::propertyDecoder()
 {
-	bool changed = false;
+	static DevicePropertyDecoder decoder;
+	static bool initialized = false;
+
+	if (initialized)
+		return decoder;
+
+	decoder.add("Name", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		if (!device->mAlias.empty())       //prefer Alias over Name
+			return false;
+
+		device->mName = g_variant_get_string(valueVar, NULL);
+		DEBUG("Alias name is empty, got name as %s", device->mName.c_str());
+		return true;
+	});
+	decoder.add("Alias", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mAlias = g_variant_get_string(valueVar, NULL);
+		DEBUG("Got alias as %s", device->mAlias.c_str());
+		device->mName = device->mAlias;
+		return true;
+	});
+	decoder.add("Address", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mAddress = g_variant_get_string(valueVar, NULL);
+		return true;
+	});
+	decoder.add("Class", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mClassOfDevice = g_variant_get_uint32(valueVar);
+		return true;
+	});
+	decoder.add("DeviceType", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mType = (BluetoothDeviceType) g_variant_get_uint32(valueVar);
+		return true;
+	});
+	decoder.add("Paired", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mPaired = g_variant_get_boolean(valueVar);
+		return true;
+	});
+	decoder.add("Connected", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mConnected = g_variant_get_boolean(valueVar);
+		return true;
+	});
+	decoder.add("UUIDs", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		gsize length = 0;
+		const gchar **uuids = g_variant_get_strv(valueVar, &length);
+		device->mUuids.assign(uuids, uuids + length);
+		g_free(uuids);
+		return true;
+	});
+	decoder.add("Trusted", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mTrusted = g_variant_get_boolean(valueVar);
+		DEBUG("Got trusted as %d for address %s", device->mTrusted, device->mAddress.c_str());
+		return true;
+	});
+	decoder.add("Blocked", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mBlocked = g_variant_get_boolean(valueVar);
+		DEBUG("Got blocked as %d for address %s", device->mBlocked, device->mAddress.c_str());
+		return true;
+	});
+	decoder.add("ManufacturerData", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->parseManufacturerData(valueVar);
+		return true;
+	});
+	decoder.add("ServiceData", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->parseServiceData(valueVar);
+		return true;
+	});
+	decoder.add("AdvertisingFlags", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		copyAdvertisementBytes(valueVar, device->mAdvertisementData.flags);
+		return true;
+	});
+	decoder.add("TxPower", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mTxPower = g_variant_get_int16(valueVar);
+		return true;
+	});
+	decoder.add("RSSI", [](Bluez5Device *device, GVariant *valueVar) -> bool {
+		device->mRSSI = g_variant_get_int16(valueVar);
+		return true;
+	});
+
+	initialized = true;
+	return decoder;
+}
 
-	if (key == "Name")
-	{
-		if(mAlias.empty())       //prefer Alias over Name
-		{
-			mName = g_variant_get_string(valueVar, NULL);
-			DEBUG("Alias name is empty, got name as %s", mName.c_str());
-			changed = true;
-		}
-	}
-	if (key == "Alias")
-	{
-		mAlias = g_variant_get_string(valueVar, NULL);
-		DEBUG("Got alias as %s", mAlias.c_str());
-		mName = mAlias;
-		changed = true;
-	}
-	else if (key == "Address")
-	{
-		mAddress = g_variant_get_string(valueVar, NULL);
-		changed = true;
-	}
-	else if (key == "Class")
-	{
-		mClassOfDevice = g_variant_get_uint32(valueVar);
-		changed = true;
-	}
-	else if (key == "DeviceType")
-	{
-		mType = (BluetoothDeviceType) g_variant_get_uint32(valueVar);
-		changed = true;
-	}
-	else if (key == "Paired")
-	{
-		mPaired = g_variant_get_boolean(valueVar);
-		changed = true;
-	}
-	else if (key == "Connected")
+void Bluez5Device::parseManufacturerData(GVariant *valueVar)
+{
+	auto &entries = mAdvertisementData.manufacturerData;
+	gsize count = g_variant_n_children(valueVar);
+	if (count > BLUEZ5_MAX_AD_ENTRIES)
+		count = BLUEZ5_MAX_AD_ENTRIES;
+
+	// Resize instead of clear so the per entry buffers keep their capacity
+	// across the frequent updates we get while scanning.
+	entries.resize(count);
+
+	for (gsize n = 0; n < count; n++)
 	{
-		mConnected = g_variant_get_boolean(valueVar);
-		changed = true;
+		guint16 companyId = 0;
+		GVariant *dataVar = 0;
+
+		g_variant_get_child(valueVar, n, "{qv}", &companyId, &dataVar);
+
+		entries[n].companyId = companyId;
+		copyAdvertisementBytes(dataVar, entries[n].data);
+
+		g_variant_unref(dataVar);
 	}
-	else if (key == "UUIDs")
-	{
-		mUuids.clear();
 
-		for (int m = 0; m < g_variant_n_children(valueVar); m++)
-		{
-			GVariant *uuidVar = g_variant_get_child_value(valueVar, m);
+	// The flat MANUFACTURER_DATA property only ever carried the first
+	// company entry prefixed by its identifier; keep that layout.
+	mManufacturerData.clear();
+	if (entries.empty())
+		return;
 
-			std::string uuid = g_variant_get_string(uuidVar, NULL);
-			mUuids.push_back(uuid);
+	uint16_t companyId = entries[0].companyId;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+	mManufacturerData.push_back((companyId & 0xFF00) >> 8);
+	mManufacturerData.push_back(companyId & 0x00FF);
+#else
+	mManufacturerData.push_back(companyId & 0x00FF);
+	mManufacturerData.push_back((companyId & 0xFF00) >> 8);
+#endif
+	mManufacturerData.insert(mManufacturerData.end(), entries[0].data.begin(), entries[0].data.end());
+}
 
-			g_variant_unref(uuidVar);
-		}
+void Bluez5Device::parseServiceData(GVariant *valueVar)
+{
+	auto &entries = mAdvertisementData.serviceData;
+	gsize count = g_variant_n_children(valueVar);
+	if (count > BLUEZ5_MAX_AD_ENTRIES)
+		count = BLUEZ5_MAX_AD_ENTRIES;
 
-		changed = true;
-	}
-	else if (key == "Trusted")
-	{
-		mTrusted = g_variant_get_boolean(valueVar);
-		DEBUG("Got trusted as %d for address %s", mTrusted, mAddress.c_str());
-		changed = true;
-	}
-	else if (key == "Blocked")
-	{
-		mBlocked = g_variant_get_boolean(valueVar);
-		DEBUG("Got blocked as %d for address %s", mBlocked, mAddress.c_str());
-		changed = true;
-	}
-	else if (key == "ManufacturerData")
+	entries.resize(count);
+
+	for (gsize n = 0; n < count; n++)
 	{
-		unsigned int i = 1;
-		bool isLittleEndian = false;
-		char *c = (char*)&i;
-		if (*c)
-			isLittleEndian = true;
+		const gchar *uuid = 0;
+		GVariant *dataVar = 0;
 
-		GVariantIter *iter;
-		g_variant_get (valueVar, "a{qv}", &iter);
+		g_variant_get_child(valueVar, n, "{&sv}", &uuid, &dataVar);
 
-		GVariant *array;
-		uint16_t key;
-		uint8_t val;
+		entries[n].uuid = uuid;
+		copyAdvertisementBytes(dataVar, entries[n].data);
 
-		while (g_variant_iter_loop(iter, "{qv}", &key, &array))
-		{
-			if (isLittleEndian)
-			{
-				mManufacturerData.push_back((key & 0xFF00) >> 8);
-				mManufacturerData.push_back(key & 0x00FF);
-			}
-			else
-			{
-				mManufacturerData.push_back(key & 0x00FF);
-				mManufacturerData.push_back((key & 0xFF00) >> 8);
-			}
-			GVariantIter it_array;
-			g_variant_iter_init(&it_array, array);
-			while(g_variant_iter_loop(&it_array, "y", &val))
-			{
-				mManufacturerData.push_back(val);
-			}
-			break;
-		}
-		g_variant_iter_free(iter);
-		changed = true;
+		g_variant_unref(dataVar);
 	}
-	else if (key == "TxPower")
-	{
-		mTxPower = g_variant_get_int16(valueVar);
-		changed = true;
-	}
-	else if (key == "RSSI")
-	{
-		mRSSI = g_variant_get_int16(valueVar);
-		changed = true;
-	}
-
-	return changed;
 }
 
 GVariant* Bluez5Device::devPropertyValueToVariant(const BluetoothProperty& property)
@@ -313,27 +344,26 @@ void Bluez5Device::setDevicePropertyAsync(const BluetoothProperty& property, Blu
                                                g_variant_new_variant(valueVar), NULL, glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(setStateCallback));
 }
 
-bool Bluez5Device::setDevicePropertySync(const BluetoothProperty& property)
+void Bluez5Device::setDevicePropertiesAsync(const BluetoothPropertiesList& properties, BluetoothResultCallback callback)
 {
-	std::string propertyName = devPropertyTypeToString(property.getType());
-
-	DEBUG ("%s: property name is %s", __func__, propertyName.c_str());
+	if (properties.empty())
+	{
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
 
-	GVariant *valueVar = devPropertyValueToVariant(property);
-	if (!valueVar)
-		return false;
+	// None of the writable device properties depend on each other so all
+	// Set calls go out at once.
+	auto counter = std::make_shared<AsyncOperationCounter>(properties.size(), [callback](bool success) {
+		callback(success ? BLUETOOTH_ERROR_NONE : BLUETOOTH_ERROR_FAIL);
+	});
 
-	GError *error = 0;
-	free_desktop_dbus_properties_call_set_sync(mPropertiesProxy, "org.bluez.Device1", propertyName.c_str(),
-                                               g_variant_new_variant(valueVar), NULL, &error);
-	if (error)
+	for (auto property : properties)
 	{
-		DEBUG ("%s: error is %s", __func__, error->message);
-		g_error_free(error);
-		return false;
+		setDevicePropertyAsync(property, [counter](BluetoothError error) {
+			counter->finish(error == BLUETOOTH_ERROR_NONE);
+		});
 	}
-
-	return true;
 }
 
 void Bluez5Device::pair(BluetoothResultCallback callback)
@@ -427,8 +457,8 @@ void Bluez5Device::cancelPairing(BluetoothResultCallback callback)
 			return;
 		}
 
-		mAdapter->setPairing(false);
-
+		// The pairing session itself is dropped once the pending Pair
+		// call returns with the cancellation.
 		if (callback)
 			callback(BLUETOOTH_ERROR_NONE);
 	};
@@ -437,24 +467,46 @@ void Bluez5Device::cancelPairing(BluetoothResultCallback callback)
 							glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(cancelPairingCallback));
 }
 
-void Bluez5Device::connect(const std::string &uuid, BluetoothResultCallback callback)
+// bluez reports page timeouts, aborted link setups and the like as plain
+// Failed. Local errors come from our own timeout or a lost reply.
+static bool isRetryableConnectError(GError *error)
 {
-	auto connectCallback = [this, callback](GAsyncResult *result) {
+	if (!g_dbus_error_is_remote_error(error))
+		return true;
+
+	gchar *name = g_dbus_error_get_remote_error(error);
+	bool retryable = g_strcmp0(name, "org.bluez.Error.Failed") == 0 ||
+	                 g_strcmp0(name, "org.bluez.Error.NotReady") == 0 ||
+	                 g_strcmp0(name, "org.freedesktop.DBus.Error.NoReply") == 0;
+	g_free(name);
+
+	return retryable;
+}
+
+void Bluez5Device::connect(const std::string &uuid, Bluez5ConnectCallback callback, GCancellable *cancellable)
+{
+	// The connection manager may drop us while the call is still pending
+	// so the callback holds its own reference on the proxy.
+	BluezDevice1 *proxy = BLUEZ_DEVICE1(g_object_ref(mDeviceProxy));
+
+	auto connectCallback = [proxy, callback](GAsyncResult *result) {
 		GError *error = 0;
-		gboolean ret;
 
-		ret = bluez_device1_call_connect_profile_finish(mDeviceProxy, result, &error);
+		bluez_device1_call_connect_profile_finish(proxy, result, &error);
+		g_object_unref(proxy);
+
 		if (error)
 		{
+			bool retryable = isRetryableConnectError(error);
 			g_error_free(error);
-			callback(BLUETOOTH_ERROR_FAIL);
+			callback(BLUETOOTH_ERROR_FAIL, retryable);
 			return;
 		}
 
-		callback(BLUETOOTH_ERROR_NONE);
+		callback(BLUETOOTH_ERROR_NONE, false);
 	};
 
-	bluez_device1_call_connect_profile(mDeviceProxy, uuid.c_str(), NULL,
+	bluez_device1_call_connect_profile(mDeviceProxy, uuid.c_str(), cancellable,
 	                                   glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(connectCallback));
 }
 
@@ -479,24 +531,30 @@ void Bluez5Device::disconnect(const std::string &uuid, BluetoothResultCallback c
 	                                      glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(disconnectCallback));
 }
 
-void Bluez5Device::connect(BluetoothResultCallback callback)
+void Bluez5Device::connect(Bluez5ConnectCallback callback, GCancellable *cancellable)
 {
-	auto connectCallback = [this, callback](GAsyncResult *result) {
+	// The connection manager may drop us while the call is still pending
+	// so the callback holds its own reference on the proxy.
+	BluezDevice1 *proxy = BLUEZ_DEVICE1(g_object_ref(mDeviceProxy));
+
+	auto connectCallback = [proxy, callback](GAsyncResult *result) {
 		GError *error = 0;
-		gboolean ret;
 
-		ret = bluez_device1_call_connect_finish(mDeviceProxy, result, &error);
+		bluez_device1_call_connect_finish(proxy, result, &error);
+		g_object_unref(proxy);
+
 		if (error)
 		{
+			bool retryable = isRetryableConnectError(error);
 			g_error_free(error);
-			callback(BLUETOOTH_ERROR_FAIL);
+			callback(BLUETOOTH_ERROR_FAIL, retryable);
 			return;
 		}
 
-		callback(BLUETOOTH_ERROR_NONE);
+		callback(BLUETOOTH_ERROR_NONE, false);
 	};
 
-	bluez_device1_call_connect(mDeviceProxy, NULL,
+	bluez_device1_call_connect(mDeviceProxy, cancellable,
 	                                   glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(connectCallback));
 }
 
@@ -521,24 +579,30 @@ void Bluez5Device::disconnect(BluetoothResultCallback callback)
 	                                      glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(disconnectCallback));
 }
 
-void Bluez5Device::connectGatt(BluetoothResultCallback callback)
+void Bluez5Device::connectGatt(Bluez5ConnectCallback callback, GCancellable *cancellable)
 {
-	auto connectCallback = [this, callback](GAsyncResult *result) {
+	// The connection manager may drop us while the call is still pending
+	// so the callback holds its own reference on the proxy.
+	BluezDevice1 *proxy = BLUEZ_DEVICE1(g_object_ref(mDeviceProxy));
+
+	auto connectCallback = [proxy, callback](GAsyncResult *result) {
 		GError *error = 0;
-		gboolean ret;
 
-		ret = bluez_device1_call_connect_finish(mDeviceProxy, result, &error);
+		bluez_device1_call_connect_gatt_finish(proxy, result, &error);
+		g_object_unref(proxy);
+
 		if (error)
 		{
+			bool retryable = isRetryableConnectError(error);
 			g_error_free(error);
-			callback(BLUETOOTH_ERROR_FAIL);
+			callback(BLUETOOTH_ERROR_FAIL, retryable);
 			return;
 		}
 
-		callback(BLUETOOTH_ERROR_NONE);
+		callback(BLUETOOTH_ERROR_NONE, false);
 	};
 
-	bluez_device1_call_connect_gatt(mDeviceProxy, NULL,
+	bluez_device1_call_connect_gatt(mDeviceProxy, cancellable,
 	                                   glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(connectCallback));
 }
 
@@ -18,6 +18,7 @@
 #define BLUEZ5DEVICE_H
 
 #include <string>
+#include <functional>
 #include <bluetooth-sil-api.h>
 
 extern "C" {
@@ -27,6 +28,34 @@ extern "C" {
 
 class Bluez5Adapter;
 
+// Result of a connect attempt. retryable is false for errors another
+// attempt won't fix like an unsupported profile or a failed authentication.
+typedef std::function<void(BluetoothError error, bool retryable)> Bluez5ConnectCallback;
+
+template <typename T, typename... Args> class PropertyDecoder;
+
+// Last advertisement payload bluez reported for a device. Every update
+// replaces the previous content so the record never grows beyond the
+// limits enforced while decoding.
+struct Bluez5AdvertisementData
+{
+	struct ManufacturerEntry
+	{
+		uint16_t companyId;
+		std::vector<uint8_t> data;
+	};
+
+	struct ServiceDataEntry
+	{
+		std::string uuid;
+		std::vector<uint8_t> data;
+	};
+
+	std::vector<ManufacturerEntry> manufacturerData;
+	std::vector<ServiceDataEntry> serviceData;
+	std::vector<uint8_t> flags;
+};
+
 class Bluez5Device
 {
 public:
@@ -37,11 +66,11 @@ public:
 	void unpair(BluetoothResultCallback callback);
 	void cancelPairing(BluetoothResultCallback callback);
 
-	void connect(const std::string& uuid, BluetoothResultCallback callback);
+	void connect(const std::string& uuid, Bluez5ConnectCallback callback, GCancellable *cancellable = 0);
 	void disconnect(const std::string &uuid, BluetoothResultCallback callback);
-	void connect(BluetoothResultCallback callback);
+	void connect(Bluez5ConnectCallback callback, GCancellable *cancellable = 0);
 	void disconnect(BluetoothResultCallback callback);
-	void connectGatt(BluetoothResultCallback callback);
+	void connectGatt(Bluez5ConnectCallback callback, GCancellable *cancellable = 0);
 
 	std::string getObjectPath() const;
 
@@ -51,19 +80,30 @@ public:
 	BluetoothDeviceType getType() const;
 	std::vector<std::string> getUuids() const;
 	bool getConnected() const;
+	bool getPaired() const { return mPaired; }
+	bool getTrusted() const { return mTrusted; }
 	Bluez5Adapter* getAdapter() const;
 
+	// Monotonic time in microseconds of the last property update we got
+	// from bluez for this device (e.g. a new advertisement / RSSI).
+	gint64 getLastSeen() const { return mLastSeen; }
+
+	const Bluez5AdvertisementData& getAdvertisementData() const { return mAdvertisementData; }
+
 	BluetoothPropertiesList buildPropertiesList() const;
 
 	static void handlePropertiesChanged(BluezDevice1 *, gchar *interface,  GVariant *changedProperties,
 									GVariant *invalidatedProperties, gpointer userData);
 
 	void setPaired (bool paired) { mPaired = paired; }
-	bool setDevicePropertySync(const BluetoothProperty& property);
 	void setDevicePropertyAsync(const BluetoothProperty& property, BluetoothResultCallback callback);
+	void setDevicePropertiesAsync(const BluetoothPropertiesList& properties, BluetoothResultCallback callback);
 
 private:
-	bool parsePropertyFromVariant(const std::string &key, GVariant *valueVar);
+	typedef PropertyDecoder<Bluez5Device> DevicePropertyDecoder;
+	static const DevicePropertyDecoder& propertyDecoder();
+	void parseManufacturerData(GVariant *valueVar);
+	void parseServiceData(GVariant *valueVar);
 	GVariant* devPropertyValueToVariant(const BluetoothProperty& property);
 	std::string devPropertyTypeToString(BluetoothProperty::Type type);
 
@@ -77,6 +117,7 @@ private:
 	BluetoothDeviceType mType;
 	std::vector<std::string> mUuids;
 	std::vector <std::uint8_t> mManufacturerData;
+	Bluez5AdvertisementData mAdvertisementData;
 	bool mPaired;
 	BluezDevice1 *mDeviceProxy;
 	FreeDesktopDBusProperties *mPropertiesProxy;
@@ -85,6 +126,7 @@ private:
 	bool mBlocked;
 	int mTxPower;
 	int mRSSI;
+	gint64 mLastSeen;
 };
 
 #endif // BLUEZ5DEVICE_H
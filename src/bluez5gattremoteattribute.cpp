@@ -16,6 +16,7 @@
 
 #include "logging.h"
 #include "utils.h"
+#include "asyncutils.h"
 #include "bluez5profilegatt.h"
 #include "bluetooth-sil-api.h"
 #include "bluez5gattremoteattribute.h"
@@ -102,6 +103,43 @@ std::vector<unsigned char> GattRemoteCharacteristic::readValue(uint16_t offset)
 	return result;
 }
 
+void GattRemoteCharacteristic::readValue(GattRemoteReadCallback callback, uint16_t offset)
+{
+	GVariantDict dict;
+	g_variant_dict_init(&dict, NULL);
+
+	if (offset)
+		g_variant_dict_insert_value(&dict, "offset", g_variant_new_uint16(offset));
+
+	GVariant *variant = g_variant_dict_end(&dict);
+
+	BluezGattCharacteristic1 *proxy = BLUEZ_GATT_CHARACTERISTIC1(g_object_ref(mInterface));
+
+	auto readCallback = [proxy, callback](GAsyncResult *result) {
+		GError *error = 0;
+		GVariant *value = 0;
+
+		bluez_gatt_characteristic1_call_read_value_finish(proxy, &value, result, &error);
+		g_object_unref(proxy);
+
+		if (error)
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "readValue failed due to %s", error->message);
+			g_error_free(error);
+			callback(BLUETOOTH_ERROR_FAIL, std::vector<unsigned char>());
+			return;
+		}
+
+		std::vector<unsigned char> bytes = convertArrayByteGVariantToVector(value);
+		g_variant_unref(value);
+
+		callback(BLUETOOTH_ERROR_NONE, bytes);
+	};
+
+	bluez_gatt_characteristic1_call_read_value(proxy, variant, NULL, glibAsyncMethodWrapper,
+	                                           new GlibAsyncFunctionWrapper(readCallback));
+}
+
 bool GattRemoteCharacteristic::writeValue(const std::vector<unsigned char> &characteristicValue, uint16_t offset)
 {
 	GError *error = NULL;
@@ -128,6 +166,44 @@ bool GattRemoteCharacteristic::writeValue(const std::vector<unsigned char> &char
 	return result;
 }
 
+void GattRemoteCharacteristic::writeValue(const std::vector<unsigned char> &characteristicValue,
+                                          BluetoothResultCallback callback, uint16_t offset, bool reliable)
+{
+	GVariant *variantValue = convertVectorToArrayByteGVariant(characteristicValue);
+	GVariantDict dict;
+	g_variant_dict_init(&dict, NULL);
+
+	if (offset)
+		g_variant_dict_insert_value(&dict, "offset", g_variant_new_uint16(offset));
+
+	if (reliable)
+		g_variant_dict_insert_value(&dict, "type", g_variant_new_string("reliable"));
+
+	GVariant *variant = g_variant_dict_end(&dict);
+
+	BluezGattCharacteristic1 *proxy = BLUEZ_GATT_CHARACTERISTIC1(g_object_ref(mInterface));
+
+	auto writeCallback = [proxy, callback](GAsyncResult *result) {
+		GError *error = 0;
+
+		bluez_gatt_characteristic1_call_write_value_finish(proxy, result, &error);
+		g_object_unref(proxy);
+
+		if (error)
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "WriteValue failed due to %s", error->message);
+			g_error_free(error);
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
+		}
+
+		callback(BLUETOOTH_ERROR_NONE);
+	};
+
+	bluez_gatt_characteristic1_call_write_value(proxy, variantValue, variant, NULL, glibAsyncMethodWrapper,
+	                                            new GlibAsyncFunctionWrapper(writeCallback));
+}
+
 BluetoothGattCharacteristicProperties GattRemoteCharacteristic::readProperties()
 {
 	BluetoothGattCharacteristicProperties properties = 0;
@@ -174,6 +250,43 @@ std::vector<unsigned char> GattRemoteDescriptor::readValue(uint16_t offset)
 	return result;
 }
 
+void GattRemoteDescriptor::readValue(GattRemoteReadCallback callback, uint16_t offset)
+{
+	GVariantDict dict;
+	g_variant_dict_init(&dict, NULL);
+
+	if (offset)
+		g_variant_dict_insert_value(&dict, "offset", g_variant_new_uint16(offset));
+
+	GVariant *variant = g_variant_dict_end(&dict);
+
+	BluezGattDescriptor1 *proxy = BLUEZ_GATT_DESCRIPTOR1(g_object_ref(mInterface));
+
+	auto readCallback = [proxy, callback](GAsyncResult *result) {
+		GError *error = 0;
+		GVariant *value = 0;
+
+		bluez_gatt_descriptor1_call_read_value_finish(proxy, &value, result, &error);
+		g_object_unref(proxy);
+
+		if (error)
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "readValue failed due to %s", error->message);
+			g_error_free(error);
+			callback(BLUETOOTH_ERROR_FAIL, std::vector<unsigned char>());
+			return;
+		}
+
+		std::vector<unsigned char> bytes = convertArrayByteGVariantToVector(value);
+		g_variant_unref(value);
+
+		callback(BLUETOOTH_ERROR_NONE, bytes);
+	};
+
+	bluez_gatt_descriptor1_call_read_value(proxy, variant, NULL, glibAsyncMethodWrapper,
+	                                       new GlibAsyncFunctionWrapper(readCallback));
+}
+
 bool GattRemoteDescriptor::writeValue(const std::vector<unsigned char> &descriptorValue, uint16_t offset)
 {
 	GError *error = NULL;
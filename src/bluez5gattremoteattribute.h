@@ -20,6 +20,9 @@
 #include <gio/gio.h>
 #include <string>
 #include <vector>
+#include <functional>
+
+#include <bluetooth-sil-api.h>
 
 extern "C" {
 #include "freedesktop-interface.h"
@@ -28,6 +31,8 @@ extern "C" {
 
 class Bluez5ProfileGatt;
 
+typedef std::function<void(BluetoothError error, const std::vector<unsigned char> &value)> GattRemoteReadCallback;
+
 class GattRemoteDescriptor
 {
 public:
@@ -35,6 +40,9 @@ public:
 		: mInterface(interface) {
 	}
 	std::vector<unsigned char> readValue(uint16_t offset = 0);
+	// The callback doesn't depend on this object so it may be deleted
+	// while the read is in flight
+	void readValue(GattRemoteReadCallback callback, uint16_t offset = 0);
 	bool writeValue(const std::vector<unsigned char> &descriptorValue, uint16_t offset = 0);
 
 	static const std::map <BluetoothGattPermission, std::string> descriptorPermissionMap;
@@ -57,7 +65,12 @@ public:
 	bool startNotify();
 	bool stopNotify();
 	std::vector<unsigned char> readValue(uint16_t offset = 0);
+	void readValue(GattRemoteReadCallback callback, uint16_t offset = 0);
 	bool writeValue(const std::vector<unsigned char> &characteristicValue, uint16_t offset = 0);
+	// A reliable write is carried out by bluez as a prepared write which is
+	// verified before it gets executed
+	void writeValue(const std::vector<unsigned char> &characteristicValue, BluetoothResultCallback callback,
+	                uint16_t offset = 0, bool reliable = false);
 	BluetoothGattCharacteristicProperties readProperties();
 
 	static const std::map <std::string, BluetoothGattCharacteristic::Property> characteristicPropertyMap;
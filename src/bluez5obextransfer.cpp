@@ -20,6 +20,7 @@
 #include "bluez5obexsession.h"
 #include "logging.h"
 #include "asyncutils.h"
+#include "propertydecoder.h"
 
 Bluez5ObexTransfer::Bluez5ObexTransfer(const std::string &objectPath) :
 	mObjectPath(objectPath),
@@ -99,36 +100,46 @@ void Bluez5ObexTransfer::notifyWatcherAboutChangedProperties()
 	mWatchCallback();
 }
 
-bool Bluez5ObexTransfer::parsePropertyFromVariant(const std::string &key, GVariant *valueVar)
+const Bluez5ObexTransfer::TransferPropertyDecoder& Bluez5ObexTransfer::propertyDecoder()
 {
-	bool changed = false;
+	static TransferPropertyDecoder decoder;
+	static bool initialized = false;
+
+	if (initialized)
+		return decoder;
+
+	decoder.add("Transferred", [](Bluez5ObexTransfer *transfer, GVariant *valueVar) -> bool {
+		transfer->mBytesTransferred = g_variant_get_uint64(valueVar);
+		return true;
+	});
+	decoder.add("Size", [](Bluez5ObexTransfer *transfer, GVariant *valueVar) -> bool {
+		transfer->mFileSize = g_variant_get_uint64(valueVar);
+		return false;
+	});
+	decoder.add("Status", [](Bluez5ObexTransfer *transfer, GVariant *valueVar) -> bool {
+		const gchar *state = g_variant_get_string(valueVar, NULL);
+
+		if (g_strcmp0(state, "queued") == 0)
+			transfer->mState = QUEUED;
+		else if (g_strcmp0(state, "active") == 0)
+			transfer->mState = ACTIVE;
+		else if (g_strcmp0(state, "suspended") == 0)
+			transfer->mState = SUSPENDED;
+		else if (g_strcmp0(state, "complete") == 0)
+			transfer->mState = COMPLETE;
+		else if (g_strcmp0(state, "error") == 0)
+			transfer->mState = ERROR;
+
+		return true;
+	});
+
+	initialized = true;
+	return decoder;
+}
 
-	if (key == "Transferred")
-	{
-		mBytesTransferred = g_variant_get_uint64(valueVar);
-		changed = true;
-	}
-	else if (key == "Size")
-	{
-		mFileSize = g_variant_get_uint64(valueVar);
-	}
-	else if (key == "Status")
-	{
-		std::string state = g_variant_get_string(valueVar, NULL);
-
-		if (state == "queued")
-			mState = QUEUED;
-		else if (state == "active")
-			mState = ACTIVE;
-		else if (state == "suspended")
-			mState = SUSPENDED;
-		else if (state == "complete")
-			mState = COMPLETE;
-		else if (state == "error")
-			mState = ERROR;
-
-		changed = true;
-	}
+void Bluez5ObexTransfer::updateFromProperties(GVariant *properties)
+{
+	bool changed = propertyDecoder().decodeAll(this, properties);
 
 	if (mState == COMPLETE)
 	{
@@ -141,28 +152,6 @@ bool Bluez5ObexTransfer::parsePropertyFromVariant(const std::string &key, GVaria
 			mBytesTransferred = mFileSize;
 	}
 
-	return changed;
-}
-
-void Bluez5ObexTransfer::updateFromProperties(GVariant *properties)
-{
-	bool changed = false;
-
-	for (int n = 0; n < g_variant_n_children(properties); n++)
-	{
-		GVariant *propertyVar = g_variant_get_child_value(properties, n);
-		GVariant *keyVar = g_variant_get_child_value(propertyVar, 0);
-		GVariant *valueVar = g_variant_get_child_value(propertyVar, 1);
-
-		std::string key = g_variant_get_string(keyVar, NULL);
-
-		changed |= parsePropertyFromVariant(key, g_variant_get_variant(valueVar));
-
-		g_variant_unref(valueVar);
-		g_variant_unref(keyVar);
-		g_variant_unref(propertyVar);
-	}
-
 	if (changed)
 		notifyWatcherAboutChangedProperties();
 }
@@ -31,6 +31,8 @@ typedef std::function<void()> Bluez5ObexTransferWatchCallback;
 
 class Bluez5ObexSession;
 
+template <typename T, typename... Args> class PropertyDecoder;
+
 class Bluez5ObexTransfer
 {
 public:
@@ -70,7 +72,8 @@ private:
 	State mState;
 
 	void updateFromProperties(GVariant *properties);
-	bool parsePropertyFromVariant(const std::string &key, GVariant *valueVar);
+	typedef PropertyDecoder<Bluez5ObexTransfer> TransferPropertyDecoder;
+	static const TransferPropertyDecoder& propertyDecoder();
 	void notifyWatcherAboutChangedProperties();
 };
 
@@ -0,0 +1,139 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <glib.h>
+
+#include "bluez5pairingpolicy.h"
+#include "utils.h"
+
+#define BLUEZ5_OUI_LENGTH    8
+
+Bluez5PairingPolicy::Bluez5PairingPolicy() :
+	mRejectUnknown(false)
+{
+}
+
+Bluez5PairingPolicy::~Bluez5PairingPolicy()
+{
+}
+
+std::string Bluez5PairingPolicy::ouiForAddress(const std::string &address)
+{
+	return convertAddressToUpperCase(address).substr(0, BLUEZ5_OUI_LENGTH);
+}
+
+void Bluez5PairingPolicy::allowAddress(const std::string &address)
+{
+	mAddresses.insert(convertAddressToUpperCase(address));
+}
+
+void Bluez5PairingPolicy::allowOui(const std::string &oui)
+{
+	mOuis.insert(ouiForAddress(oui));
+}
+
+void Bluez5PairingPolicy::allowNamePattern(const std::string &pattern)
+{
+	mNamePatterns.push_back(pattern);
+}
+
+void Bluez5PairingPolicy::setPinCode(const std::string &addressOrOui, const std::string &pin)
+{
+	mPinCodes[convertAddressToUpperCase(addressOrOui)] = pin;
+}
+
+void Bluez5PairingPolicy::setPasskey(const std::string &addressOrOui, BluetoothPasskey passkey)
+{
+	mPasskeys[convertAddressToUpperCase(addressOrOui)] = passkey;
+}
+
+void Bluez5PairingPolicy::autoAuthorizeService(const std::string &uuid)
+{
+	mServices.insert(convertAddressToLowerCase(uuid));
+}
+
+bool Bluez5PairingPolicy::isAllowed(const std::string &address, const std::string &name) const
+{
+	std::string upperCaseAddress = convertAddressToUpperCase(address);
+
+	if (mAddresses.count(upperCaseAddress))
+		return true;
+
+	if (mOuis.count(ouiForAddress(upperCaseAddress)))
+		return true;
+
+	for (auto pattern : mNamePatterns)
+	{
+		if (g_pattern_match_simple(pattern.c_str(), name.c_str()))
+			return true;
+	}
+
+	return false;
+}
+
+Bluez5PairingPolicy::Decision Bluez5PairingPolicy::confirmPairing(const std::string &address, const std::string &name,
+                                                                  BluetoothPasskey passkey) const
+{
+	return isAllowed(address, name) ? ACCEPT : unknownDecision();
+}
+
+Bluez5PairingPolicy::Decision Bluez5PairingPolicy::authorizePairing(const std::string &address, const std::string &name) const
+{
+	return isAllowed(address, name) ? ACCEPT : unknownDecision();
+}
+
+Bluez5PairingPolicy::Decision Bluez5PairingPolicy::authorizeService(const std::string &address, const std::string &name,
+                                                                    const std::string &uuid) const
+{
+	if (isAllowed(address, name) && mServices.count(convertAddressToLowerCase(uuid)))
+		return ACCEPT;
+
+	return unknownDecision();
+}
+
+Bluez5PairingPolicy::Decision Bluez5PairingPolicy::lookupPinCode(const std::string &address, const std::string &name,
+                                                                 std::string &pin) const
+{
+	if (!isAllowed(address, name))
+		return unknownDecision();
+
+	auto iter = mPinCodes.find(convertAddressToUpperCase(address));
+	if (iter == mPinCodes.end())
+		iter = mPinCodes.find(ouiForAddress(address));
+
+	if (iter == mPinCodes.end())
+		return unknownDecision();
+
+	pin = iter->second;
+	return ACCEPT;
+}
+
+Bluez5PairingPolicy::Decision Bluez5PairingPolicy::lookupPasskey(const std::string &address, const std::string &name,
+                                                                 BluetoothPasskey &passkey) const
+{
+	if (!isAllowed(address, name))
+		return unknownDecision();
+
+	auto iter = mPasskeys.find(convertAddressToUpperCase(address));
+	if (iter == mPasskeys.end())
+		iter = mPasskeys.find(ouiForAddress(address));
+
+	if (iter == mPasskeys.end())
+		return unknownDecision();
+
+	passkey = iter->second;
+	return ACCEPT;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BLUEZ5PAIRINGPOLICY_H
+#define BLUEZ5PAIRINGPOLICY_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <bluetooth-sil-api.h>
+
+// Decides agent requests inline so pairing doesn't have to wait for the
+// layer on top. Devices are matched by address, by OUI (the first three
+// octets of the address) or by a name pattern as understood by
+// g_pattern_match_simple(). Pin codes and passkeys are looked up by
+// address first and by OUI second.
+//
+// Every request the policy has no answer for is passed on to the observer
+// as before, unless rejectUnknown is set.
+class Bluez5PairingPolicy
+{
+public:
+	enum Decision
+	{
+		ASK,
+		ACCEPT,
+		REJECT
+	};
+
+	Bluez5PairingPolicy();
+	virtual ~Bluez5PairingPolicy();
+
+	void allowAddress(const std::string &address);
+	void allowOui(const std::string &oui);
+	void allowNamePattern(const std::string &pattern);
+
+	void setPinCode(const std::string &addressOrOui, const std::string &pin);
+	void setPasskey(const std::string &addressOrOui, BluetoothPasskey passkey);
+
+	void autoAuthorizeService(const std::string &uuid);
+
+	void setRejectUnknown(bool rejectUnknown) { mRejectUnknown = rejectUnknown; }
+	bool getRejectUnknown() const { return mRejectUnknown; }
+
+	virtual bool isAllowed(const std::string &address, const std::string &name) const;
+
+	virtual Decision confirmPairing(const std::string &address, const std::string &name, BluetoothPasskey passkey) const;
+	virtual Decision authorizePairing(const std::string &address, const std::string &name) const;
+	virtual Decision authorizeService(const std::string &address, const std::string &name, const std::string &uuid) const;
+	virtual Decision lookupPinCode(const std::string &address, const std::string &name, std::string &pin) const;
+	virtual Decision lookupPasskey(const std::string &address, const std::string &name, BluetoothPasskey &passkey) const;
+
+private:
+	Decision unknownDecision() const { return mRejectUnknown ? REJECT : ASK; }
+	static std::string ouiForAddress(const std::string &address);
+
+	std::unordered_set<std::string> mAddresses;
+	std::unordered_set<std::string> mOuis;
+	std::vector<std::string> mNamePatterns;
+	std::unordered_map<std::string, std::string> mPinCodes;
+	std::unordered_map<std::string, BluetoothPasskey> mPasskeys;
+	std::unordered_set<std::string> mServices;
+	bool mRejectUnknown;
+};
+
+#endif // BLUEZ5PAIRINGPOLICY_H
@@ -17,6 +17,7 @@
 #include "bluez5profilebase.h"
 #include "bluez5device.h"
 #include "bluez5adapter.h"
+#include "bluez5connectionmanager.h"
 #include "logging.h"
 
 Bluez5ProfileBase::Bluez5ProfileBase(Bluez5Adapter *adapter, const std::string &uuid) :
@@ -31,19 +32,19 @@ Bluez5ProfileBase::~Bluez5ProfileBase()
 
 void Bluez5ProfileBase::connect(const std::string &address, BluetoothResultCallback callback)
 {
-	Bluez5Device *device = mAdapter->findDevice(address);
+	Bluez5Device *device = mAdapter->routeDevice(address);
 	if (!device)
 	{
 		callback(BLUETOOTH_ERROR_PARAM_INVALID);
 		return;
 	}
 
-	device->connect(mUuid, callback);
+	device->getAdapter()->getConnectionManager()->connectProfile(device, mUuid, callback);
 }
 
 void Bluez5ProfileBase::disconnect(const std::string &address, BluetoothResultCallback callback)
 {
-	Bluez5Device *device = mAdapter->findDevice(address);
+	Bluez5Device *device = mAdapter->routeDevice(address);
 	if (!device)
 	{
 		DEBUG("Could not find device with address %s while trying to disconnect", address.c_str());
@@ -31,6 +31,10 @@ public:
 	virtual void connect(const std::string& address, BluetoothResultCallback callback);
 	virtual void disconnect(const std::string& address, BluetoothResultCallback callback);
 	std::string getProfileUuid() { return mUuid; }
+
+	// Whether this profile currently holds a connection to the device so
+	// other profiles know not to tear the link down underneath it
+	virtual bool hasConnection(const std::string &address) const { return false; }
 protected:
 	Bluez5Adapter *mAdapter;
 	std::string mUuid;
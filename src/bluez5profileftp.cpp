@@ -22,6 +22,7 @@
 #include "bluez5obexsession.h"
 #include "bluez5obextransfer.h"
 #include "asyncutils.h"
+#include "utils.h"
 #include "logging.h"
 
 using namespace std::placeholders;
@@ -180,6 +181,19 @@ void Bluez5ProfileFtp::removeTransfer(BluetoothFtpTransferId id)
 	delete transfer;
 }
 
+bool Bluez5ProfileFtp::hasConnection(const std::string &address) const
+{
+	std::string lowerCaseAddress = convertAddressToLowerCase(address);
+
+	for (auto &session : mSessions)
+	{
+		if (convertAddressToLowerCase(session.first) == lowerCaseAddress)
+			return true;
+	}
+
+	return false;
+}
+
 Bluez5ObexSession* Bluez5ProfileFtp::findSession(const std::string &address)
 {
 	auto sessionIter = mSessions.find(address);
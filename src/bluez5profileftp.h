@@ -51,6 +51,8 @@ public:
 				const std::string &targetPath, BluetoothFtpTransferResultCallback callback);
 	void cancelTransfer(BluetoothFtpTransferId id, BluetoothResultCallback callback);
 
+	bool hasConnection(const std::string &address) const;
+
 private:
 	std::map<std::string, Bluez5ObexSession*> mSessions;
 	std::map<BluetoothFtpTransferId, Bluez5ObexTransfer*> mTransfers;
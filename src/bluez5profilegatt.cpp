@@ -16,12 +16,14 @@
 
 #include <string>
 #include <unordered_map>
+#include <algorithm>
 
 #include "logging.h"
 #include "bluez5adapter.h"
 #include "bluez5agent.h"
 #include "asyncutils.h"
 #include "utils.h"
+#include "bluez5connectionmanager.h"
 #include "bluez5profilegatt.h"
 #include "bluez5gattremoteattribute.h"
 
@@ -36,6 +38,16 @@ const std::string BLUETOOTH_PROFILE_GATT_UUID = "00001801-0000-1000-8000-00805f9
 #define BLUEZ5_GATT_OBJECT_CLIENT_PATH BLUEZ5_GATT_OBJECT_PATH CLIENT_PATH
 #define BLUEZ5_GATT_OBJECT_SERVER_PATH BLUEZ5_GATT_OBJECT_PATH SERVER_PATH
 
+#define BLUEZ5_GATT_DEFAULT_MAX_WARM_LINKS     4
+#define BLUEZ5_GATT_WRITE_PIPELINE_DEPTH       4
+// The ATT MTU isn't exposed by bluez so chunks are sized to fit a single
+// PDU at the largest MTU LE data length extension allows (247 bytes).
+// bluez splits them further on links with a smaller MTU.
+#define BLUEZ5_GATT_DEFAULT_CHUNK_SIZE         244
+#define BLUEZ5_GATT_CHUNK_RETRIES              2
+#define BLUEZ5_GATT_MAX_ATTRIBUTE_LENGTH       512
+#define BLUEZ5_GATT_DEFAULT_WARM_LINK_TIMEOUT  60000
+
 
 Bluez5ProfileGatt::Bluez5ProfileGatt(Bluez5Adapter *adapter):
 	Bluez5ProfileBase(adapter, BLUETOOTH_PROFILE_GATT_UUID),
@@ -43,7 +55,11 @@ Bluez5ProfileGatt::Bluez5ProfileGatt(Bluez5Adapter *adapter):
 	mLastCharId(0),
 	mConn(nullptr),
 	mAdapter(adapter),
-	mObjectManagerGattServer(nullptr)
+	mObjectManagerGattServer(nullptr),
+	mNextSubscriptionId(1),
+	mTransferChunkSize(BLUEZ5_GATT_DEFAULT_CHUNK_SIZE),
+	mMaxWarmLinks(BLUEZ5_GATT_DEFAULT_MAX_WARM_LINKS),
+	mWarmLinkTimeout(BLUEZ5_GATT_DEFAULT_WARM_LINK_TIMEOUT)
 {
 	DEBUG("Bluez5ProfileGatt created");
 	mBusId = g_bus_own_name(G_BUS_TYPE_SYSTEM, BLUEZ5_GATT_BUS_NAME,
@@ -56,6 +72,13 @@ Bluez5ProfileGatt::~Bluez5ProfileGatt()
 {
 	DEBUG("Bluez5ProfileGatt dtor");
 
+	for (auto link : mWarmLinks)
+	{
+		if (link->idleSource)
+			g_source_remove(link->idleSource);
+		delete link;
+	}
+
 	if (mObjectManagerGattServer)
 	{
 		g_object_unref(mObjectManagerGattServer);
@@ -78,7 +101,7 @@ void Bluez5ProfileGatt::handleBusAcquired(GDBusConnection *connection, const gch
 
 void Bluez5ProfileGatt::addRemoteServiceToDevice(GattRemoteService* gattService)
 {
-	Bluez5Device* device = mAdapter->findDeviceByObjectPath(gattService->parentObjectPath);
+	Bluez5Device* device = mAdapter->routeDeviceByObjectPath(gattService->parentObjectPath);
 	if(!device)
 		return;
 
@@ -162,7 +185,7 @@ GattRemoteService* Bluez5ProfileGatt::getRemoteGattService(std::string& serviceO
 	std::string deviceObjectPath, serviceName;
 	splitInPathAndName(serviceObjectPath, deviceObjectPath, serviceName);
 
-	Bluez5Device* device = mAdapter->findDeviceByObjectPath(deviceObjectPath);
+	Bluez5Device* device = mAdapter->routeDeviceByObjectPath(deviceObjectPath);
 	if(!device)
 		return foundService;
 
@@ -263,6 +286,7 @@ void Bluez5ProfileGatt::removeRemoteGattCharacteristic(const std::string &charac
 
 		if (characteristicIter != characteristicList.end())
 		{
+			dropNotifySubscription(characteristicObjectPath);
 			g_object_unref((*characteristicIter)->mInterface);
 			delete (*characteristicIter);
 			characteristicList.erase(characteristicIter);
@@ -403,7 +427,7 @@ void Bluez5ProfileGatt::removeRemoteGattService(const std::string &serviceObject
 	std::string deviceObjPath, serviceName;
 	splitInPathAndName(serviceObjectPath, deviceObjPath, serviceName);
 
-	Bluez5Device* device = mAdapter->findDeviceByObjectPath(deviceObjPath);
+	Bluez5Device* device = mAdapter->routeDeviceByObjectPath(deviceObjPath);
 	if(!device)
 		return;
 
@@ -528,7 +552,7 @@ void Bluez5ProfileGatt::registerSignalHandlers()
 void Bluez5ProfileGatt::connectGatt(const uint16_t & appId, bool autoConnection, const std::string & address, BluetoothConnectCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	Bluez5Device *device = mAdapter->findDevice(address);
+	Bluez5Device *device = mAdapter->routeDevice(address);
 	if (!device)
 	{
 		callback(BLUETOOTH_ERROR_PARAM_INVALID, -1);
@@ -546,10 +570,19 @@ void Bluez5ProfileGatt::connectGatt(const uint16_t & appId, bool autoConnection,
 		if (mConnectedDevices.find(appId) == mConnectedDevices.end())
 		{
 			mConnectedDevices.insert({ appId, lowerCaseAddress});
+			resumeNotifySubscriptions(lowerCaseAddress);
 			callback(BLUETOOTH_ERROR_NONE, appId);
 		}
 	};
-	device->connectGatt(isConnectCallback);
+
+	if (unparkLink(lowerCaseAddress) && device->getConnected())
+	{
+		DEBUG("Reusing idle GATT link to %s", deviceAddress.c_str());
+		isConnectCallback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	device->getAdapter()->getConnectionManager()->connectGatt(device, isConnectCallback);
 }
 
 void Bluez5ProfileGatt::disconnectGatt(const uint16_t &appId, const uint16_t &connectId, const std::string &address, BluetoothResultCallback callback)
@@ -567,7 +600,7 @@ void Bluez5ProfileGatt::disconnectGatt(const uint16_t &appId, const uint16_t &co
 		deviceAddress = deviceInfo->second;
 	}
 
-	Bluez5Device *device = mAdapter->findDevice(deviceAddress);
+	Bluez5Device *device = mAdapter->routeDevice(deviceAddress);
 	if (!device)
 	{
 		DEBUG("Could not find device with address %s while trying to disconnect", address.c_str());
@@ -575,30 +608,157 @@ void Bluez5ProfileGatt::disconnectGatt(const uint16_t &appId, const uint16_t &co
 		return;
 	}
 
-	auto isDisconnectCallback = [this, deviceInfo, deviceAddress, callback](BluetoothError error)
+	// The link stays up as long as another application uses it
+	if (isLinkInUse(deviceAddress, appId))
 	{
-		if (error != BLUETOOTH_ERROR_NONE)
-		{
-			callback(error);
-			return;
-		}
 		mConnectedDevices.erase(deviceInfo);
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
 
-		GError *err = nullptr;
-		Bluez5Device *device = mAdapter->findDevice(deviceAddress);
-		if (device)
-		{
-			bluez_adapter1_call_remove_device_sync(mAdapter->getAdapterProxy(), device->getObjectPath().c_str(), NULL, &err);
-			if (err)
-			{
-				g_error_free(err);
-			}
-		}
+	// Keep bluez' device object around in any case so reconnecting doesn't
+	// have to resolve all services again
+	if (mMaxWarmLinks > 0 && device->getConnected())
+	{
+		mConnectedDevices.erase(deviceInfo);
+		parkLink(deviceAddress);
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
 
+	// Other profiles may still use the link
+	if (mAdapter->isDeviceInUse(deviceAddress, this))
+	{
+		mConnectedDevices.erase(deviceInfo);
 		callback(BLUETOOTH_ERROR_NONE);
-	};
+		return;
+	}
+
+	// The application stays connected until the link is really gone
+	device->disconnect([this, appId, callback](BluetoothError error) {
+		if (error == BLUETOOTH_ERROR_NONE)
+			mConnectedDevices.erase(appId);
+
+		callback(error);
+	});
+}
 
-	device->disconnect(isDisconnectCallback);
+void Bluez5ProfileGatt::setMaxWarmLinks(uint32_t maxLinks)
+{
+	mMaxWarmLinks = maxLinks;
+	evictWarmLinks();
+}
+
+bool Bluez5ProfileGatt::isLinkInUse(const std::string &address, id_type exceptAppId) const
+{
+	for (auto &connection : mConnectedDevices)
+	{
+		if (connection.first != exceptAppId && connection.second == address)
+			return true;
+	}
+
+	return false;
+}
+
+void Bluez5ProfileGatt::parkLink(const std::string &address)
+{
+	unparkLink(address);
+
+	DEBUG("Keeping idle GATT link to %s", address.c_str());
+
+	WarmLink *link = new WarmLink;
+	link->profile = this;
+	link->address = address;
+	link->idleSource = 0;
+
+	if (mWarmLinkTimeout > 0)
+		link->idleSource = g_timeout_add(mWarmLinkTimeout, handleWarmLinkTimeout, link);
+
+	mWarmLinks.push_front(link);
+
+	evictWarmLinks();
+}
+
+bool Bluez5ProfileGatt::unparkLink(const std::string &address)
+{
+	for (auto iter = mWarmLinks.begin(); iter != mWarmLinks.end(); ++iter)
+	{
+		WarmLink *link = *iter;
+		if (link->address != address)
+			continue;
+
+		if (link->idleSource)
+			g_source_remove(link->idleSource);
+
+		mWarmLinks.erase(iter);
+		delete link;
+		return true;
+	}
+
+	return false;
+}
+
+void Bluez5ProfileGatt::closeWarmLink(WarmLink *link)
+{
+	DEBUG("Closing idle GATT link to %s", link->address.c_str());
+
+	mWarmLinks.remove(link);
+
+	Bluez5Device *device = mAdapter->routeDevice(link->address);
+	if (device && device->getConnected() && !mAdapter->isDeviceInUse(link->address, this))
+		device->disconnect([](BluetoothError error) { });
+
+	delete link;
+}
+
+void Bluez5ProfileGatt::evictWarmLinks()
+{
+	while (mWarmLinks.size() > mMaxWarmLinks)
+	{
+		WarmLink *link = mWarmLinks.back();
+
+		if (link->idleSource)
+			g_source_remove(link->idleSource);
+
+		closeWarmLink(link);
+	}
+}
+
+gboolean Bluez5ProfileGatt::handleWarmLinkTimeout(gpointer user_data)
+{
+	WarmLink *link = static_cast<WarmLink*>(user_data);
+
+	link->idleSource = 0;
+	link->profile->closeWarmLink(link);
+
+	return FALSE;
+}
+
+void Bluez5ProfileGatt::ensureLink(const std::string &address, BluetoothResultCallback callback)
+{
+	Bluez5Device *device = mAdapter->routeDevice(address);
+	if (!device)
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	if (device->getConnected())
+	{
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	// The link of an application went down underneath it, bring it back
+	// before running the operation
+	DEBUG("Reconnecting GATT link to %s", address.c_str());
+
+	device->getAdapter()->getConnectionManager()->connectGatt(device, [this, address, callback](BluetoothError error) {
+		if (error == BLUETOOTH_ERROR_NONE)
+			resumeNotifySubscriptions(address);
+
+		callback(error);
+	});
 }
 
 uint16_t Bluez5ProfileGatt::nextAppId()
@@ -887,19 +1047,22 @@ void Bluez5ProfileGatt::readCharacteristic(const uint16_t &connId, const Bluetoo
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
 
-	BluetoothGattCharacteristic readCharacteristicValue;
 	std::string deviceAddress = getAddress(connId);
 	if (deviceAddress.empty())
 	{
-		callback(BLUETOOTH_ERROR_FAIL, readCharacteristicValue);
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattCharacteristic());
 		return;
 	}
 
-	readCharacteristicValue = readCharacteristic(deviceAddress, service, characteristics);
-	if (readCharacteristicValue.isValid())
-		callback(BLUETOOTH_ERROR_NONE, readCharacteristicValue);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, readCharacteristicValue);
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristics, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, BluetoothGattCharacteristic());
+			return;
+		}
+
+		readCharacteristic(deviceAddress, service, characteristics, callback);
+	});
 }
 
 void Bluez5ProfileGatt::readCharacteristics(const uint16_t &connId, const BluetoothUuid& service,
@@ -908,21 +1071,22 @@ void Bluez5ProfileGatt::readCharacteristics(const uint16_t &connId, const Blueto
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
 
-	BluetoothGattCharacteristicList serviceCharacteristicList;
-	bool found = false;
-
 	std::string deviceAddress = getAddress(connId);
 	if (deviceAddress.empty())
 	{
-		callback(BLUETOOTH_ERROR_FAIL, serviceCharacteristicList);
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattCharacteristicList());
 		return;
 	}
-	serviceCharacteristicList = readCharacteristics(deviceAddress, service, characteristics, found);
-	if (found)
-		callback(BLUETOOTH_ERROR_NONE, serviceCharacteristicList);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, serviceCharacteristicList);
 
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristics, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, BluetoothGattCharacteristicList());
+			return;
+		}
+
+		readCharacteristics(deviceAddress, service, characteristics, callback);
+	});
 }
 
 void Bluez5ProfileGatt::writeCharacteristic(const uint16_t &connId, const BluetoothUuid& service,
@@ -937,65 +1101,61 @@ void Bluez5ProfileGatt::writeCharacteristic(const uint16_t &connId, const Blueto
 		return;
 	}
 
-	GattRemoteService* remoteService = findService(deviceAddress, service);
-	if (!remoteService)
-	{
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
-	}
-	GattRemoteCharacteristic* remoteChar = findCharacteristic(remoteService, characteristic.getUuid());
-	if (remoteChar && remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_WRITE))
-	{
-		if (remoteChar->writeValue(characteristic.getValue()))
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristic, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
 		{
-			remoteService->service.updateCharacteristicValue(characteristic.getUuid(), characteristic.getValue());
-			updateRemoteDeviceServices();
-			callback(BLUETOOTH_ERROR_NONE);
+			callback(error);
 			return;
 		}
-	}
 
-	callback(BLUETOOTH_ERROR_FAIL);
+		writeCharacteristic(deviceAddress, service, characteristic, callback);
+	});
 }
 
 void Bluez5ProfileGatt::readDescriptor(const uint16_t &connId, const BluetoothUuid& service, const BluetoothUuid &characteristic,
 								 const BluetoothUuid &descriptor, BluetoothGattReadDescriptorCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	BluetoothGattDescriptor readDescriptorValue;
 
 	std::string deviceAddress = getAddress(connId);
 	if (deviceAddress.empty())
 	{
-		callback(BLUETOOTH_ERROR_FAIL, readDescriptorValue);
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattDescriptor());
 		return;
 	}
 
-	readDescriptorValue = readDescriptor(deviceAddress, service, characteristic,descriptor);
-	if (readDescriptorValue.isValid())
-		callback(BLUETOOTH_ERROR_NONE, readDescriptorValue);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, readDescriptorValue);
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristic, descriptor, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, BluetoothGattDescriptor());
+			return;
+		}
+
+		readDescriptor(deviceAddress, service, characteristic, descriptor, callback);
+	});
 }
 
 void Bluez5ProfileGatt::readDescriptors(const uint16_t &connId, const BluetoothUuid& service, const BluetoothUuid &characteristic,
 								 const BluetoothUuidList &descriptors, BluetoothGattReadDescriptorsCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	BluetoothGattDescriptorList characteristicDescriptorList;
-	bool found = false;
 
 	std::string deviceAddress = getAddress(connId);
 	if (deviceAddress.empty())
 	{
-		callback(BLUETOOTH_ERROR_FAIL, characteristicDescriptorList);
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattDescriptorList());
 		return;
 	}
-	characteristicDescriptorList = readDescriptors(deviceAddress, service, characteristic, descriptors, found);
-	if (found)
-		callback(BLUETOOTH_ERROR_NONE, characteristicDescriptorList);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, characteristicDescriptorList);
+
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristic, descriptors, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, BluetoothGattDescriptorList());
+			return;
+		}
+
+		readDescriptors(deviceAddress, service, characteristic, descriptors, callback);
+	});
 }
 
 void Bluez5ProfileGatt::writeDescriptor(const uint16_t &connId, const BluetoothUuid &service, const BluetoothUuid &characteristic,
@@ -1010,28 +1170,15 @@ void Bluez5ProfileGatt::writeDescriptor(const uint16_t &connId, const BluetoothU
 		return;
 	}
 
-	GattRemoteService* remoteService = findService(deviceAddress, service);
-	if (!remoteService)
-	{
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
-	}
-	GattRemoteCharacteristic* remoteChar = findCharacteristic(remoteService, characteristic);
-	if (remoteChar && remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_WRITE))
-	{
-		GattRemoteDescriptor* remoteDesc = findDescriptor(remoteChar, descriptor.getUuid());
-		if (remoteDesc && remoteDesc->writeValue(descriptor.getValue()))
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristic, descriptor, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
 		{
-			remoteChar->characteristic.updateDescriptorValue(descriptor.getUuid(), descriptor.getValue());
-			remoteService->service.updateDescriptorValue(remoteChar->characteristic.getUuid(),
-														 descriptor.getUuid(),
-														 descriptor.getValue());
-			updateRemoteDeviceServices();
-			callback(BLUETOOTH_ERROR_NONE);
+			callback(error);
 			return;
 		}
-	}
-	callback(BLUETOOTH_ERROR_FAIL);
+
+		writeDescriptor(deviceAddress, service, characteristic, descriptor, callback);
+	});
 }
 
 void Bluez5ProfileGatt::changeCharacteristicWatchStatus(const std::string &address, const BluetoothUuid &service,
@@ -1039,45 +1186,151 @@ void Bluez5ProfileGatt::changeCharacteristicWatchStatus(const std::string &addre
 										BluetoothResultCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	bool result;
-	auto deviceServicesIter = mDeviceServicesMap.find(address);
 
-	if (deviceServicesIter == mDeviceServicesMap.end())
+	GattRemoteService *remoteService = findService(convertAddressToLowerCase(address), service);
+	GattRemoteCharacteristic *remoteChar = remoteService ? findCharacteristic(remoteService, characteristic) : 0;
+	if (!remoteChar)
 	{
 		ERROR(MSGID_GATT_PROFILE_ERROR, 0, "Device is not connected");
 		callback(BLUETOOTH_ERROR_FAIL);
 		return;
 	}
 
-	auto &servicesList = deviceServicesIter->second;
-	for (auto serviceIt : servicesList)
+	if (enabled)
 	{
-		if (serviceIt->service.getUuid() == service)
+		NotifySubscription *subscription = acquireNotifySubscription(remoteChar);
+		if (!subscription)
 		{
-			for (auto charIt = serviceIt->gattRemoteCharacteristics.begin(); charIt != serviceIt->gattRemoteCharacteristics.end(); charIt++)
-			{
-				if ((*charIt)->characteristic.getUuid() == characteristic)
-				{
-					if (enabled)
-					{
-						result = (*charIt)->startNotify();
-					}
-					else
-					{
-						result = (*charIt)->stopNotify();
-					}
-					break;
-				}
-			}
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
 		}
+
+		subscription->observerWatchers++;
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	auto subscriptionIter = mNotifySubscriptions.find(remoteChar->objectPath);
+	if (subscriptionIter == mNotifySubscriptions.end() || subscriptionIter->second.observerWatchers == 0)
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
 	}
 
-	if (result)
+	subscriptionIter->second.observerWatchers--;
+
+	if (releaseNotifySubscription(remoteChar->objectPath))
 		callback(BLUETOOTH_ERROR_NONE);
 	else
 		callback(BLUETOOTH_ERROR_FAIL);
 }
 
+uint32_t Bluez5ProfileGatt::subscribeCharacteristic(const std::string &address, const BluetoothUuid &service,
+                                                    const BluetoothUuid &characteristic, NotificationCallback callback)
+{
+	GattRemoteService *remoteService = findService(convertAddressToLowerCase(address), service);
+	GattRemoteCharacteristic *remoteChar = remoteService ? findCharacteristic(remoteService, characteristic) : 0;
+	if (!remoteChar)
+		return 0;
+
+	NotifySubscription *subscription = acquireNotifySubscription(remoteChar);
+	if (!subscription)
+		return 0;
+
+	uint32_t subscriptionId = mNextSubscriptionId++;
+	subscription->subscribers.insert({ subscriptionId, callback });
+	mSubscriptionPaths.insert({ subscriptionId, remoteChar->objectPath });
+
+	return subscriptionId;
+}
+
+bool Bluez5ProfileGatt::unsubscribeCharacteristic(uint32_t subscriptionId)
+{
+	auto pathIter = mSubscriptionPaths.find(subscriptionId);
+	if (pathIter == mSubscriptionPaths.end())
+		return false;
+
+	std::string characteristicObjectPath = pathIter->second;
+	mSubscriptionPaths.erase(pathIter);
+
+	auto subscriptionIter = mNotifySubscriptions.find(characteristicObjectPath);
+	if (subscriptionIter == mNotifySubscriptions.end())
+		return false;
+
+	subscriptionIter->second.subscribers.erase(subscriptionId);
+
+	return releaseNotifySubscription(characteristicObjectPath);
+}
+
+Bluez5ProfileGatt::NotifySubscription* Bluez5ProfileGatt::acquireNotifySubscription(GattRemoteCharacteristic *characteristic)
+{
+	auto subscriptionIter = mNotifySubscriptions.find(characteristic->objectPath);
+	if (subscriptionIter != mNotifySubscriptions.end())
+		return &subscriptionIter->second;
+
+	if (!characteristic->startNotify())
+		return 0;
+
+	NotifySubscription &subscription = mNotifySubscriptions[characteristic->objectPath];
+	subscription.characteristic = characteristic;
+	subscription.observerWatchers = 0;
+
+	return &subscription;
+}
+
+bool Bluez5ProfileGatt::releaseNotifySubscription(const std::string &characteristicObjectPath)
+{
+	auto subscriptionIter = mNotifySubscriptions.find(characteristicObjectPath);
+	if (subscriptionIter == mNotifySubscriptions.end())
+		return true;
+
+	NotifySubscription &subscription = subscriptionIter->second;
+	if (subscription.observerWatchers > 0 || !subscription.subscribers.empty())
+		return true;
+
+	bool result = subscription.characteristic->stopNotify();
+	mNotifySubscriptions.erase(subscriptionIter);
+
+	return result;
+}
+
+void Bluez5ProfileGatt::resumeNotifySubscriptions(const std::string &address)
+{
+	Bluez5Device *device = mAdapter->routeDevice(address);
+	if (!device)
+		return;
+
+	// Notification sessions end with the link while bluez keeps the
+	// attributes of a bonded device around, so our subscriptions outlive
+	// the link and have to be started again on the new one
+	std::string devicePath = device->getObjectPath() + "/";
+
+	for (auto &subscription : mNotifySubscriptions)
+	{
+		if (subscription.first.compare(0, devicePath.length(), devicePath))
+			continue;
+
+		// still running on a link that never went down
+		if (bluez_gatt_characteristic1_get_notifying(subscription.second.characteristic->mInterface))
+			continue;
+
+		DEBUG("Restarting notifications for %s", subscription.first.c_str());
+		subscription.second.characteristic->startNotify();
+	}
+}
+
+void Bluez5ProfileGatt::dropNotifySubscription(const std::string &characteristicObjectPath)
+{
+	auto subscriptionIter = mNotifySubscriptions.find(characteristicObjectPath);
+	if (subscriptionIter == mNotifySubscriptions.end())
+		return;
+
+	for (auto &subscriber : subscriptionIter->second.subscribers)
+		mSubscriptionPaths.erase(subscriber.first);
+
+	mNotifySubscriptions.erase(subscriptionIter);
+}
+
 void Bluez5ProfileGatt::readCharacteristic(const std::string &address, const BluetoothUuid& service,
 									 const BluetoothUuid &characteristic,
 									 BluetoothGattReadCharacteristicCallback callback)
@@ -1097,13 +1350,74 @@ void Bluez5ProfileGatt::readCharacteristics(const std::string &address, const Bl
 									BluetoothGattReadCharacteristicsCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	BluetoothGattCharacteristicList serviceCharacteristicList;
-	bool found = false;
-	serviceCharacteristicList = readCharacteristics(address, service, characteristics, found);
-	if (found)
-		callback(BLUETOOTH_ERROR_NONE, serviceCharacteristicList);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, serviceCharacteristicList);
+
+	readCharacteristicBatch(address, service, characteristics,
+		[callback](BluetoothError error, const BluetoothGattCharacteristicList &characteristics,
+		           const std::vector<BluetoothError> &results) {
+			callback(error, characteristics);
+		});
+}
+
+void Bluez5ProfileGatt::readCharacteristicBatch(const std::string &address, const BluetoothUuid &service,
+                                                const BluetoothUuidList &characteristics,
+                                                ReadCharacteristicBatchCallback callback)
+{
+	GattRemoteService *remoteService = findService(address, service);
+	if (!remoteService)
+	{
+		ERROR(MSGID_GATT_PROFILE_ERROR, 0, "remote GATT service object is null");
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattCharacteristicList(),
+		         std::vector<BluetoothError>(characteristics.size(), BLUETOOTH_ERROR_FAIL));
+		return;
+	}
+
+	if (characteristics.empty())
+	{
+		callback(BLUETOOTH_ERROR_NONE, BluetoothGattCharacteristicList(), std::vector<BluetoothError>());
+		return;
+	}
+
+	auto values = std::make_shared<BluetoothGattCharacteristicList>(characteristics.size());
+	auto results = std::make_shared<std::vector<BluetoothError>>(characteristics.size(), BLUETOOTH_ERROR_NONE);
+
+	// The cached service list is refreshed once for the whole batch
+	auto counter = std::make_shared<AsyncOperationCounter>(characteristics.size(),
+		[this, values, results, callback](bool success) {
+			updateRemoteDeviceServices();
+			callback(success ? BLUETOOTH_ERROR_NONE : BLUETOOTH_ERROR_FAIL, *values, *results);
+		});
+
+	for (size_t n = 0; n < characteristics.size(); n++)
+	{
+		BluetoothUuid uuid = characteristics[n];
+		(*values)[n].setUuid(uuid);
+
+		GattRemoteCharacteristic *remoteChar = findCharacteristic(remoteService, uuid);
+		if (!remoteChar || !remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_READ))
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "Characteristic not found");
+			(*results)[n] = BLUETOOTH_ERROR_FAIL;
+			counter->finish(false);
+			continue;
+		}
+
+		(*values)[n].setProperties(remoteChar->readProperties());
+
+		remoteChar->readValue([this, address, service, uuid, n, values, results, counter](BluetoothError error,
+		                                                                                  const std::vector<unsigned char> &value) {
+			if (error == BLUETOOTH_ERROR_NONE)
+			{
+				(*values)[n].setValue(value);
+
+				GattRemoteService *remoteService = findService(address, service);
+				if (remoteService)
+					remoteService->service.updateCharacteristicValue(uuid, value);
+			}
+
+			(*results)[n] = error;
+			counter->finish(error == BLUETOOTH_ERROR_NONE);
+		});
+	}
 }
 
 void Bluez5ProfileGatt::writeCharacteristic(const std::string &address, const BluetoothUuid& service,
@@ -1150,14 +1464,355 @@ void Bluez5ProfileGatt::readDescriptors(const std::string &address, const Blueto
 						const BluetoothUuidList &descriptors, BluetoothGattReadDescriptorsCallback callback)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-	BluetoothGattDescriptorList characteristicDescriptorList;
-	bool found = false;
 
-	characteristicDescriptorList = readDescriptors(address, service, characteristic, descriptors, found);
-	if (found)
-		callback(BLUETOOTH_ERROR_NONE, characteristicDescriptorList);
-	else
-		callback(BLUETOOTH_ERROR_FAIL, characteristicDescriptorList);
+	readDescriptorBatch(address, service, characteristic, descriptors,
+		[callback](BluetoothError error, const BluetoothGattDescriptorList &descriptors,
+		           const std::vector<BluetoothError> &results) {
+			callback(error, descriptors);
+		});
+}
+
+void Bluez5ProfileGatt::readDescriptorBatch(const std::string &address, const BluetoothUuid &service,
+                                            const BluetoothUuid &characteristic, const BluetoothUuidList &descriptors,
+                                            ReadDescriptorBatchCallback callback)
+{
+	GattRemoteService *remoteService = findService(address, service);
+	GattRemoteCharacteristic *remoteChar = remoteService ? findCharacteristic(remoteService, characteristic) : 0;
+	if (!remoteChar || !remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_READ))
+	{
+		ERROR(MSGID_GATT_PROFILE_ERROR, 0, "Read property not available");
+		callback(BLUETOOTH_ERROR_FAIL, BluetoothGattDescriptorList(),
+		         std::vector<BluetoothError>(descriptors.size(), BLUETOOTH_ERROR_FAIL));
+		return;
+	}
+
+	if (descriptors.empty())
+	{
+		callback(BLUETOOTH_ERROR_NONE, BluetoothGattDescriptorList(), std::vector<BluetoothError>());
+		return;
+	}
+
+	auto values = std::make_shared<BluetoothGattDescriptorList>(descriptors.size());
+	auto results = std::make_shared<std::vector<BluetoothError>>(descriptors.size(), BLUETOOTH_ERROR_NONE);
+
+	auto counter = std::make_shared<AsyncOperationCounter>(descriptors.size(),
+		[this, values, results, callback](bool success) {
+			updateRemoteDeviceServices();
+			callback(success ? BLUETOOTH_ERROR_NONE : BLUETOOTH_ERROR_FAIL, *values, *results);
+		});
+
+	for (size_t n = 0; n < descriptors.size(); n++)
+	{
+		BluetoothUuid uuid = descriptors[n];
+		(*values)[n].setUuid(uuid);
+
+		GattRemoteDescriptor *remoteDesc = findDescriptor(remoteChar, uuid);
+		if (!remoteDesc)
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "Descriptor not found");
+			(*results)[n] = BLUETOOTH_ERROR_FAIL;
+			counter->finish(false);
+			continue;
+		}
+
+		remoteDesc->readValue([this, address, service, characteristic, uuid, n, values, results, counter](BluetoothError error,
+		                                                                                                 const std::vector<unsigned char> &value) {
+			if (error == BLUETOOTH_ERROR_NONE)
+			{
+				(*values)[n].setValue(value);
+
+				GattRemoteService *remoteService = findService(address, service);
+				GattRemoteCharacteristic *remoteChar = remoteService ? findCharacteristic(remoteService, characteristic) : 0;
+				if (remoteChar)
+				{
+					remoteChar->characteristic.updateDescriptorValue(uuid, value);
+					remoteService->service.updateDescriptorValue(characteristic, uuid, value);
+				}
+			}
+
+			(*results)[n] = error;
+			counter->finish(error == BLUETOOTH_ERROR_NONE);
+		});
+	}
+}
+
+void Bluez5ProfileGatt::writeCharacteristics(const uint16_t &connId, const BluetoothUuid &service,
+                                             const BluetoothGattCharacteristicList &characteristics, bool stopOnFailure,
+                                             WriteCharacteristicBatchCallback callback)
+{
+	std::string deviceAddress = getAddress(connId);
+	if (deviceAddress.empty())
+	{
+		callback(BLUETOOTH_ERROR_FAIL, std::vector<BluetoothError>(characteristics.size(), BLUETOOTH_ERROR_FAIL));
+		return;
+	}
+
+	ensureLink(deviceAddress, [this, deviceAddress, service, characteristics, stopOnFailure, callback](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			callback(error, std::vector<BluetoothError>(characteristics.size(), error));
+			return;
+		}
+
+		writeCharacteristics(deviceAddress, service, characteristics, stopOnFailure, callback);
+	});
+}
+
+void Bluez5ProfileGatt::writeCharacteristics(const std::string &address, const BluetoothUuid &service,
+                                             const BluetoothGattCharacteristicList &characteristics, bool stopOnFailure,
+                                             WriteCharacteristicBatchCallback callback)
+{
+	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	auto batch = std::make_shared<WriteBatch>();
+	batch->address = address;
+	batch->service = service;
+	batch->characteristics = characteristics;
+	batch->results.assign(characteristics.size(), BLUETOOTH_ERROR_FAIL);
+	batch->next = 0;
+	batch->pending = 0;
+	batch->stopOnFailure = stopOnFailure;
+	batch->failed = false;
+	batch->callback = callback;
+
+	issueBatchWrites(batch);
+}
+
+void Bluez5ProfileGatt::issueBatchWrites(std::shared_ptr<WriteBatch> batch)
+{
+	while (batch->next < batch->characteristics.size() && batch->pending < BLUEZ5_GATT_WRITE_PIPELINE_DEPTH)
+	{
+		if (batch->failed && batch->stopOnFailure)
+			break;
+
+		size_t n = batch->next++;
+		const BluetoothGattCharacteristic &characteristic = batch->characteristics[n];
+
+		// Looked up again for every write as the remote objects may vanish
+		// while the batch is running
+		GattRemoteService *remoteService = findService(batch->address, batch->service);
+		GattRemoteCharacteristic *remoteChar = remoteService ? findCharacteristic(remoteService, characteristic.getUuid()) : 0;
+		if (!remoteChar || !remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_WRITE))
+		{
+			ERROR(MSGID_GATT_PROFILE_ERROR, 0, "Characteristic not found or not writable");
+			batch->failed = true;
+			continue;
+		}
+
+		batch->pending++;
+
+		remoteChar->writeValue(characteristic.getValue(), [this, batch, n](BluetoothError error) {
+			batch->pending--;
+			batch->results[n] = error;
+
+			if (error != BLUETOOTH_ERROR_NONE)
+				batch->failed = true;
+
+			issueBatchWrites(batch);
+		});
+	}
+
+	if (batch->pending > 0)
+		return;
+
+	if (batch->next < batch->characteristics.size() && !(batch->failed && batch->stopOnFailure))
+		return;
+
+	completeWriteBatch(batch);
+}
+
+void Bluez5ProfileGatt::completeWriteBatch(std::shared_ptr<WriteBatch> batch)
+{
+	GattRemoteService *remoteService = findService(batch->address, batch->service);
+	if (remoteService)
+	{
+		for (size_t n = 0; n < batch->characteristics.size(); n++)
+		{
+			if (batch->results[n] == BLUETOOTH_ERROR_NONE)
+				remoteService->service.updateCharacteristicValue(batch->characteristics[n].getUuid(),
+				                                                 batch->characteristics[n].getValue());
+		}
+
+		updateRemoteDeviceServices();
+	}
+
+	batch->callback(batch->failed ? BLUETOOTH_ERROR_FAIL : BLUETOOTH_ERROR_NONE, batch->results);
+}
+
+void Bluez5ProfileGatt::readCharacteristicLong(const std::string &address, const BluetoothUuid &service,
+                                               const BluetoothUuid &characteristic, uint16_t offset,
+                                               TransferProgressCallback progressCallback, LongReadCallback callback)
+{
+	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	auto transfer = std::make_shared<LongTransfer>();
+	transfer->address = convertAddressToLowerCase(address);
+	transfer->service = service;
+	transfer->characteristic = characteristic;
+	transfer->offset = offset;
+	transfer->retries = 0;
+	transfer->reliable = false;
+	transfer->progressCallback = progressCallback;
+	transfer->readCallback = callback;
+
+	ensureLink(transfer->address, [this, transfer](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			completeLongTransfer(transfer, error);
+			return;
+		}
+
+		readNextChunk(transfer);
+	});
+}
+
+void Bluez5ProfileGatt::writeCharacteristicLong(const std::string &address, const BluetoothUuid &service,
+                                                const BluetoothGattCharacteristic &characteristic, uint16_t offset,
+                                                bool reliable, TransferProgressCallback progressCallback,
+                                                BluetoothResultCallback callback)
+{
+	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	if (characteristic.getValue().empty() || characteristic.getValue().size() > BLUEZ5_GATT_MAX_ATTRIBUTE_LENGTH ||
+	    offset >= characteristic.getValue().size())
+	{
+		callback(BLUETOOTH_ERROR_PARAM_INVALID);
+		return;
+	}
+
+	auto transfer = std::make_shared<LongTransfer>();
+	transfer->address = convertAddressToLowerCase(address);
+	transfer->service = service;
+	transfer->characteristic = characteristic.getUuid();
+	transfer->value = characteristic.getValue();
+	transfer->offset = offset;
+	transfer->retries = 0;
+	transfer->reliable = reliable;
+	transfer->progressCallback = progressCallback;
+	transfer->writeCallback = callback;
+
+	ensureLink(transfer->address, [this, transfer](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			completeLongTransfer(transfer, error);
+			return;
+		}
+
+		writeNextChunk(transfer);
+	});
+}
+
+GattRemoteCharacteristic* Bluez5ProfileGatt::findTransferCharacteristic(std::shared_ptr<LongTransfer> transfer)
+{
+	GattRemoteService *remoteService = findService(transfer->address, transfer->service);
+	if (!remoteService)
+		return 0;
+
+	return findCharacteristic(remoteService, transfer->characteristic);
+}
+
+void Bluez5ProfileGatt::readNextChunk(std::shared_ptr<LongTransfer> transfer)
+{
+	GattRemoteCharacteristic *remoteChar = findTransferCharacteristic(transfer);
+	if (!remoteChar || !remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_READ))
+	{
+		completeLongTransfer(transfer, BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	remoteChar->readValue([this, transfer](BluetoothError error, const std::vector<unsigned char> &chunk) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			if (transfer->retries++ < BLUEZ5_GATT_CHUNK_RETRIES)
+			{
+				DEBUG("Retrying read at offset %d", transfer->offset);
+				readNextChunk(transfer);
+				return;
+			}
+
+			completeLongTransfer(transfer, error);
+			return;
+		}
+
+		// bluez carries out the whole long read itself and returns the
+		// remainder of the value starting at the offset, there is no way
+		// to ask for less of it
+		transfer->value.insert(transfer->value.end(), chunk.begin(), chunk.end());
+		transfer->offset += chunk.size();
+
+		if (transfer->progressCallback)
+			transfer->progressCallback(transfer->offset, transfer->offset);
+
+		completeLongTransfer(transfer, BLUETOOTH_ERROR_NONE);
+	}, transfer->offset);
+}
+
+void Bluez5ProfileGatt::writeNextChunk(std::shared_ptr<LongTransfer> transfer)
+{
+	if (transfer->offset >= transfer->value.size())
+	{
+		completeLongTransfer(transfer, BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	GattRemoteCharacteristic *remoteChar = findTransferCharacteristic(transfer);
+	if (!remoteChar || !remoteChar->characteristic.isPropertySet(BluetoothGattCharacteristic::Property::PROPERTY_WRITE))
+	{
+		completeLongTransfer(transfer, BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	// A reliable write is only atomic within one prepared write queue, so
+	// the remainder goes out in one piece which bluez splits up itself
+	uint32_t length = transfer->value.size() - transfer->offset;
+	if (!transfer->reliable)
+		length = std::min<uint32_t>(mTransferChunkSize, length);
+
+	std::vector<unsigned char> chunk(transfer->value.begin() + transfer->offset,
+	                                 transfer->value.begin() + transfer->offset + length);
+
+	remoteChar->writeValue(chunk, [this, transfer, length](BluetoothError error) {
+		if (error != BLUETOOTH_ERROR_NONE)
+		{
+			if (transfer->retries++ < BLUEZ5_GATT_CHUNK_RETRIES)
+			{
+				DEBUG("Retrying write at offset %d", transfer->offset);
+				writeNextChunk(transfer);
+				return;
+			}
+
+			completeLongTransfer(transfer, error);
+			return;
+		}
+
+		transfer->retries = 0;
+		transfer->offset += length;
+
+		if (transfer->progressCallback)
+			transfer->progressCallback(transfer->offset, transfer->value.size());
+
+		writeNextChunk(transfer);
+	}, transfer->offset, transfer->reliable);
+}
+
+void Bluez5ProfileGatt::completeLongTransfer(std::shared_ptr<LongTransfer> transfer, BluetoothError error)
+{
+	// A resumed read only holds the tail of the value which must not end
+	// up in the cache
+	if (error == BLUETOOTH_ERROR_NONE && transfer->offset == transfer->value.size())
+	{
+		GattRemoteService *remoteService = findService(transfer->address, transfer->service);
+		if (remoteService)
+		{
+			remoteService->service.updateCharacteristicValue(transfer->characteristic, transfer->value);
+			updateRemoteDeviceServices();
+		}
+	}
+
+	if (transfer->readCallback)
+		transfer->readCallback(error, transfer->value);
+	else if (transfer->writeCallback)
+		transfer->writeCallback(error);
 }
 
 uint16_t Bluez5ProfileGatt::getConnectId(const std::string &address)
@@ -2036,7 +2691,7 @@ void Bluez5ProfileGatt::onCharacteristicPropertiesChanged(GattRemoteCharacterist
 	std::string deviceObjPath, serviceName;
 	splitInPathAndName(characteristic->parentObjectPath, deviceObjPath, serviceName);
 
-	Bluez5Device* device = mAdapter->findDeviceByObjectPath(deviceObjPath);
+	Bluez5Device* device = mAdapter->routeDeviceByObjectPath(deviceObjPath);
 
 	if (!device)
 	{
@@ -2076,6 +2731,15 @@ void Bluez5ProfileGatt::onCharacteristicPropertiesChanged(GattRemoteCharacterist
 				remoteChar.setUuid(charUuid);
 				remoteChar.setValue(charValue);
 				getGattObserver()->characteristicValueChanged(lowerCaseAddress, service_uuid, remoteChar);
+
+				auto subscriptionIter = mNotifySubscriptions.find(characteristic->objectPath);
+				if (subscriptionIter != mNotifySubscriptions.end())
+				{
+					// Subscribers may unsubscribe from within their callback
+					auto subscribers = subscriptionIter->second.subscribers;
+					for (auto &subscriber : subscribers)
+						subscriber.second(lowerCaseAddress, service_uuid, remoteChar);
+				}
 			}
 		}
 		g_variant_iter_free (iter);
@@ -19,6 +19,10 @@
 
 #include <gio/gio.h>
 #include <string>
+#include <list>
+#include <map>
+#include <functional>
+#include <memory>
 #include <unordered_map>
 
 #include <bluetooth-sil-api.h>
@@ -39,6 +43,17 @@ class Bluez5ProfileGatt : public Bluez5ProfileBase,
 {
 public:
 	typedef uint16_t id_type;
+	typedef std::function<void(const std::string &address, const BluetoothUuid &service,
+	                           const BluetoothGattCharacteristic &characteristic)> NotificationCallback;
+	// results holds the status of every requested item in request order
+	typedef std::function<void(BluetoothError error, const BluetoothGattCharacteristicList &characteristics,
+	                           const std::vector<BluetoothError> &results)> ReadCharacteristicBatchCallback;
+	typedef std::function<void(BluetoothError error, const BluetoothGattDescriptorList &descriptors,
+	                           const std::vector<BluetoothError> &results)> ReadDescriptorBatchCallback;
+	typedef std::function<void(BluetoothError error, const std::vector<BluetoothError> &results)> WriteCharacteristicBatchCallback;
+	// total is zero for reads as the length isn't known in advance
+	typedef std::function<void(uint32_t transferred, uint32_t total)> TransferProgressCallback;
+	typedef std::function<void(BluetoothError error, const BluetoothGattValue &value)> LongReadCallback;
 	Bluez5ProfileGatt(Bluez5Adapter *adapter);
 	~Bluez5ProfileGatt();
 
@@ -47,6 +62,13 @@ public:
 	uint16_t addApplication(const BluetoothUuid &appUuid, ApplicationType type);
 	bool removeApplication(uint16_t appId, ApplicationType type);
 	void disconnectGatt(const uint16_t &appId, const uint16_t &connectId, const std::string &address, BluetoothResultCallback callback);
+
+	// Links no application uses anymore are kept open so a following
+	// connect or operation doesn't pay for link setup and service discovery
+	// again. At most maxLinks idle links are kept, the least recently used
+	// one is closed first and every idle link is closed after timeoutMs.
+	void setMaxWarmLinks(uint32_t maxLinks);
+	void setWarmLinkTimeout(uint32_t timeoutMs) { mWarmLinkTimeout = timeoutMs; }
 	void getProperties(const std::string &address, BluetoothPropertiesResultCallback  callback);
 	void getProperty(const std::string &address, BluetoothProperty::Type type,
 	                         BluetoothPropertyResultCallback callback);
@@ -75,6 +97,13 @@ public:
 	void changeCharacteristicWatchStatus(const std::string &address, const BluetoothUuid &service,
 												 const BluetoothUuid &characteristic, bool enabled,
 												 BluetoothResultCallback callback);
+	// All watchers of a characteristic share one notification session in
+	// bluez: StartNotify is only issued for the first watcher and StopNotify
+	// for the last one. Every value is passed to the observer and to all
+	// subscribers. Returns 0 if the subscription failed.
+	uint32_t subscribeCharacteristic(const std::string &address, const BluetoothUuid &service,
+	                                 const BluetoothUuid &characteristic, NotificationCallback callback);
+	bool unsubscribeCharacteristic(uint32_t subscriptionId);
 	void readCharacteristic(const std::string &address, const BluetoothUuid& service,
 									 const BluetoothUuid &characteristic,
 									 BluetoothGattReadCharacteristicCallback callback);
@@ -88,6 +117,33 @@ public:
 								 const BluetoothUuid &descriptor, BluetoothGattReadDescriptorCallback callback);
 	void readDescriptors(const std::string &address, const BluetoothUuid& service, const BluetoothUuid &characteristic,
 	                             const BluetoothUuidList &descriptors, BluetoothGattReadDescriptorsCallback callback);
+	// All reads of a batch are issued at once and a single callback is
+	// called once the last of them finished
+	void readCharacteristicBatch(const std::string &address, const BluetoothUuid &service,
+	                             const BluetoothUuidList &characteristics, ReadCharacteristicBatchCallback callback);
+	void readDescriptorBatch(const std::string &address, const BluetoothUuid &service, const BluetoothUuid &characteristic,
+	                         const BluetoothUuidList &descriptors, ReadDescriptorBatchCallback callback);
+	// Writes are pipelined, bluez keeps their order on the link. With
+	// stopOnFailure no further write is issued after the first failed one
+	// and all writes which weren't issued report a failure.
+	void writeCharacteristics(const std::string &address, const BluetoothUuid &service,
+	                          const BluetoothGattCharacteristicList &characteristics, bool stopOnFailure,
+	                          WriteCharacteristicBatchCallback callback);
+	void writeCharacteristics(const uint16_t &connId, const BluetoothUuid &service,
+	                          const BluetoothGattCharacteristicList &characteristics, bool stopOnFailure,
+	                          WriteCharacteristicBatchCallback callback);
+	// Long writes are moved in chunks at increasing offsets, a reliable one
+	// in a single prepared write so it is applied atomically. Reads are one
+	// long read done by bluez from the offset on. Each chunk or read is
+	// retried a few times before the transfer fails. A failed transfer can
+	// be resumed by passing the offset reached so far: for reads that is
+	// the length of the value handed to the callback.
+	void readCharacteristicLong(const std::string &address, const BluetoothUuid &service, const BluetoothUuid &characteristic,
+	                            uint16_t offset, TransferProgressCallback progressCallback, LongReadCallback callback);
+	void writeCharacteristicLong(const std::string &address, const BluetoothUuid &service,
+	                             const BluetoothGattCharacteristic &characteristic, uint16_t offset, bool reliable,
+	                             TransferProgressCallback progressCallback, BluetoothResultCallback callback);
+	void setTransferChunkSize(uint16_t chunkSize) { mTransferChunkSize = chunkSize; }
 	uint16_t getConnectId(const std::string &address);
 	std::string getAddress(const uint16_t &connId);
 	BluetoothGattCharacteristic readCharacteristic(const std::string &address, const BluetoothUuid& service,
@@ -192,6 +248,69 @@ private:
 	id_type nextDescId();
 
 private:
+	struct NotifySubscription
+	{
+		GattRemoteCharacteristic *characteristic;
+		// watchers enabled through changeCharacteristicWatchStatus
+		uint32_t observerWatchers;
+		std::map<uint32_t, NotificationCallback> subscribers;
+	};
+
+	NotifySubscription* acquireNotifySubscription(GattRemoteCharacteristic *characteristic);
+	bool releaseNotifySubscription(const std::string &characteristicObjectPath);
+	void dropNotifySubscription(const std::string &characteristicObjectPath);
+	void resumeNotifySubscriptions(const std::string &address);
+
+	struct WriteBatch
+	{
+		std::string address;
+		BluetoothUuid service;
+		BluetoothGattCharacteristicList characteristics;
+		std::vector<BluetoothError> results;
+		size_t next;
+		size_t pending;
+		bool stopOnFailure;
+		bool failed;
+		WriteCharacteristicBatchCallback callback;
+	};
+
+	void issueBatchWrites(std::shared_ptr<WriteBatch> batch);
+	void completeWriteBatch(std::shared_ptr<WriteBatch> batch);
+
+	struct LongTransfer
+	{
+		std::string address;
+		BluetoothUuid service;
+		BluetoothUuid characteristic;
+		BluetoothGattValue value;
+		uint32_t offset;
+		uint32_t retries;
+		bool reliable;
+		TransferProgressCallback progressCallback;
+		LongReadCallback readCallback;
+		BluetoothResultCallback writeCallback;
+	};
+
+	GattRemoteCharacteristic* findTransferCharacteristic(std::shared_ptr<LongTransfer> transfer);
+	void readNextChunk(std::shared_ptr<LongTransfer> transfer);
+	void writeNextChunk(std::shared_ptr<LongTransfer> transfer);
+	void completeLongTransfer(std::shared_ptr<LongTransfer> transfer, BluetoothError error);
+
+	struct WarmLink
+	{
+		Bluez5ProfileGatt *profile;
+		std::string address;
+		guint idleSource;
+	};
+
+	void parkLink(const std::string &address);
+	bool unparkLink(const std::string &address);
+	void closeWarmLink(WarmLink *link);
+	void evictWarmLinks();
+	void ensureLink(const std::string &address, BluetoothResultCallback callback);
+	bool isLinkInUse(const std::string &address, id_type exceptAppId) const;
+	static gboolean handleWarmLinkTimeout(gpointer user_data);
+
 	void registerSignalHandlers();
 
 	void addRemoteServiceToDevice(GattRemoteService* gattService);
@@ -226,6 +345,15 @@ private:
 	std::unordered_map<id_type, std::unique_ptr <BluezGattLocalApplication>> mGattLocalApplications;
 	std::unordered_map<std::string, GattServiceList> mDeviceServicesMap;
 	std::unordered_map<std::string, BluetoothGattServiceList> mRemoteDeviceServicesMap;
+	// characteristic object path -> shared notification session
+	std::unordered_map<std::string, NotifySubscription> mNotifySubscriptions;
+	std::unordered_map<uint32_t, std::string> mSubscriptionPaths;
+	uint32_t mNextSubscriptionId;
+	uint16_t mTransferChunkSize;
+	// most recently used idle link first
+	std::list<WarmLink*> mWarmLinks;
+	uint32_t mMaxWarmLinks;
+	uint32_t mWarmLinkTimeout;
 };
 
 #endif // BLUEZ5PROFILEGATT_H
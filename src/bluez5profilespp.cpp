@@ -21,12 +21,34 @@
 #include "bluez5profilespp.h"
 #include "utils.h"
 #include "asyncutils.h"
+#include "bluez5connectionmanager.h"
+#include "bluez5sppioworker.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 
 const std::string BLUETOOTH_PROFILE_SPP_UUID = "00001101-0000-1000-8000-00805f9b34fb";
 const std::string BASE_OBJ_PATH = "/bluetooth/profile/serial_port/";
 
+#define BLUEZ5_SPP_DEFAULT_TX_HIGH_WATER_MARK    (64 * 1024)
+#define BLUEZ5_SPP_DEFAULT_TX_LOW_WATER_MARK     (16 * 1024)
+#define BLUEZ5_SPP_DEFAULT_RX_BUFFER_SIZE        (16 * 1024)
+#define BLUEZ5_SPP_RFCOMM_FIRST_CHANNEL          1
+#define BLUEZ5_SPP_RFCOMM_LAST_CHANNEL           30
+#define BLUEZ5_SPP_CLIENT_FIRST_CHANNEL_ID       31
+#define BLUEZ5_SPP_CLIENT_LAST_CHANNEL_ID        254
+
+#define BLUEZ5_SPP_ERROR_REJECTED                "org.bluez.Error.Rejected"
+
 Bluez5ProfileSpp::Bluez5ProfileSpp(Bluez5Adapter *adapter):
-	Bluez5ProfileBase(adapter, BLUETOOTH_PROFILE_SPP_UUID), mAdapter(adapter), mConn(0)
+	Bluez5ProfileBase(adapter, BLUETOOTH_PROFILE_SPP_UUID), mAdapter(adapter), mConn(0),
+	mTxHighWaterMark(BLUEZ5_SPP_DEFAULT_TX_HIGH_WATER_MARK),
+	mTxLowWaterMark(BLUEZ5_SPP_DEFAULT_TX_LOW_WATER_MARK),
+	mRxBuffer(BLUEZ5_SPP_DEFAULT_RX_BUFFER_SIZE),
+	mIoWorker(0),
+	mStatsEnabled(false),
+	mStatsLogSource(0)
 {
 	GError *error = nullptr;
 	mConn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
@@ -35,31 +57,61 @@ Bluez5ProfileSpp::Bluez5ProfileSpp(Bluez5Adapter *adapter):
 		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to connect on system bus %s", error->message);
 		g_error_free(error);
 	}
-	initialiseChannelIds();
+
+	mChannelPools[CLIENT] = {BLUEZ5_SPP_CLIENT_FIRST_CHANNEL_ID, BLUEZ5_SPP_CLIENT_LAST_CHANNEL_ID, BLUEZ5_SPP_CLIENT_FIRST_CHANNEL_ID};
+	mChannelPools[SERVER] = {BLUEZ5_SPP_RFCOMM_FIRST_CHANNEL, BLUEZ5_SPP_RFCOMM_LAST_CHANNEL, BLUEZ5_SPP_RFCOMM_FIRST_CHANNEL};
 }
 
 Bluez5ProfileSpp::~Bluez5ProfileSpp()
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	if (mStatsLogSource)
+		g_source_remove(mStatsLogSource);
+
+	delete mIoWorker;
 }
 
-void Bluez5ProfileSpp::initialiseChannelIds()
+static uint32_t histogramBucket(uint64_t value)
 {
-	mChannelIdList = {
-		{22, false},
-		{6 , false},
-	};
+	uint32_t bucket = 0;
+
+	while (value > 1 && bucket < BLUEZ5_SPP_STATS_HISTOGRAM_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+
+	return bucket;
 }
 
-int Bluez5ProfileSpp::registerProfile(spDeviceInfo &deviceInfo, std::string objPath, BluezProfileManager1 *proxy)
+static void recordWrite(Bluez5SppChannelStats &stats, uint64_t size, BluetoothError error, gint64 latency)
+{
+	if (error != BLUETOOTH_ERROR_NONE)
+	{
+		stats.writeErrors++;
+		return;
+	}
+
+	stats.writes++;
+	stats.bytesSent += size;
+	stats.totalWriteLatency += latency;
+	stats.writeLatencyHistogram[histogramBucket(latency)]++;
+
+	if (stats.writes == 1 || latency < stats.minWriteLatency)
+		stats.minWriteLatency = latency;
+
+	if (latency > stats.maxWriteLatency)
+		stats.maxWriteLatency = latency;
+}
+
+GVariant* Bluez5ProfileSpp::buildProfileParameters(SppDeviceInfo *deviceInfo, const std::string &objPath)
 {
-	GVariant *profileVariant;
 	GVariantBuilder profileBuilder;
-	GError *error = nullptr;
 
 	if (!g_variant_is_object_path(objPath.c_str())) {
 		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "ObjectPath validation failed");
-		return BLUETOOTH_ERROR_FAIL;
+		return nullptr;
 	}
 
 	g_variant_builder_init(&profileBuilder, G_VARIANT_TYPE("(osa{sv})"));
@@ -70,10 +122,15 @@ int Bluez5ProfileSpp::registerProfile(spDeviceInfo &deviceInfo, std::string objP
 
 	g_variant_builder_open(&profileBuilder, G_VARIANT_TYPE("a{sv}"));
 
-	g_variant_builder_open(&profileBuilder, G_VARIANT_TYPE("{sv}"));
-	g_variant_builder_add (&profileBuilder, "s", "Channel");
-	g_variant_builder_add (&profileBuilder, "v", g_variant_new_uint16(deviceInfo->mChannelId));
-	g_variant_builder_close(&profileBuilder);
+	// Client ids are only local handles, bluez looks the remote channel
+	// up through SDP when connecting
+	if (deviceInfo->mDeviceRole == SERVER)
+	{
+		g_variant_builder_open(&profileBuilder, G_VARIANT_TYPE("{sv}"));
+		g_variant_builder_add (&profileBuilder, "s", "Channel");
+		g_variant_builder_add (&profileBuilder, "v", g_variant_new_uint16(deviceInfo->mChannelId));
+		g_variant_builder_close(&profileBuilder);
+	}
 
 	g_variant_builder_open(&profileBuilder, G_VARIANT_TYPE("{sv}"));
 	g_variant_builder_add (&profileBuilder, "s", "Service");
@@ -111,7 +168,16 @@ int Bluez5ProfileSpp::registerProfile(spDeviceInfo &deviceInfo, std::string objP
 	g_variant_builder_close(&profileBuilder);
 
 	g_variant_builder_close(&profileBuilder);
-	profileVariant = g_variant_builder_end(&profileBuilder);
+	return g_variant_builder_end(&profileBuilder);
+}
+
+int Bluez5ProfileSpp::registerProfile(spDeviceInfo &deviceInfo, std::string objPath, BluezProfileManager1 *proxy)
+{
+	GError *error = nullptr;
+
+	GVariant *profileVariant = buildProfileParameters(deviceInfo.get(), objPath);
+	if (!profileVariant)
+		return BLUETOOTH_ERROR_FAIL;
 
 	g_dbus_proxy_call_sync (G_DBUS_PROXY(proxy),
 				"RegisterProfile",
@@ -130,6 +196,38 @@ int Bluez5ProfileSpp::registerProfile(spDeviceInfo &deviceInfo, std::string objP
 	return BLUETOOTH_ERROR_NONE;
 }
 
+void Bluez5ProfileSpp::registerProfileAsync(SppDeviceInfo *deviceInfo, const std::string &objPath, BluetoothResultCallback callback)
+{
+	GVariant *profileVariant = buildProfileParameters(deviceInfo, objPath);
+	if (!profileVariant)
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	BluezProfileManager1 *proxy = mAdapter->getProfileManager();
+
+	auto registerCallback = [proxy, callback](GAsyncResult *result)
+	{
+		GError *error = nullptr;
+
+		GVariant *reply = g_dbus_proxy_call_finish(G_DBUS_PROXY(proxy), result, &error);
+		if (error)
+		{
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to register profileManager due to  %s", error->message);
+			g_error_free(error);
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
+		}
+
+		g_variant_unref(reply);
+		callback(BLUETOOTH_ERROR_NONE);
+	};
+
+	g_dbus_proxy_call(G_DBUS_PROXY(proxy), "RegisterProfile", profileVariant, G_DBUS_CALL_FLAGS_NONE,
+	                  -1, NULL, glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(registerCallback));
+}
+
 void Bluez5ProfileSpp::getProperties(const std::string &address, BluetoothPropertiesResultCallback callback)
 {
 	UNUSED(address);
@@ -142,7 +240,7 @@ void Bluez5ProfileSpp::getProperty(const std::string &address, BluetoothProperty
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
 	BluetoothProperty prop(type);
-	Bluez5Device *device = mAdapter->findDevice(address);
+	Bluez5Device *device = mAdapter->routeDevice(address);
 	if (!device)
 	{
 		callback(BLUETOOTH_ERROR_PARAM_INVALID, prop);
@@ -160,7 +258,8 @@ void Bluez5ProfileSpp::getChannelState(const std::string &address, const std::st
 
 	while (deviceIterator != mConnectedDevices.end())
 	{
-		if ((deviceIterator->second->mDeviceAddress == lowerCaseAddress) && (deviceIterator->second->mUuid == uuid))
+		if ((deviceIterator->second->mDeviceAddress == lowerCaseAddress) && (deviceIterator->second->mUuid == uuid) &&
+		    (deviceIterator->second->mSockfd >= 0))
 		{
 			callback(BLUETOOTH_ERROR_NONE, true);
 			return;
@@ -220,7 +319,7 @@ gboolean Bluez5ProfileSpp::handleNewConnection (GDBusMethodInvocation *invocatio
 	message = g_dbus_method_invocation_get_message (invocation);
 	fd_list = g_dbus_message_get_unix_fd_list (message);
 
-	devieInfo->mSockfd = g_unix_fd_list_get (fd_list, 0, &error);
+	gint sockfd = g_unix_fd_list_get (fd_list, 0, &error);
 
 	if (error)
 	{
@@ -229,19 +328,58 @@ gboolean Bluez5ProfileSpp::handleNewConnection (GDBusMethodInvocation *invocatio
 		return FALSE;
 	}
 
+	Bluez5Device *bluezDevice = mAdapter->routeDeviceByObjectPath(device);
+	std::string deviceAddress;
+	if (bluezDevice)
+		deviceAddress = bluezDevice->getAddress();
+
+	// Every peer connecting to a server gets a connection of its own while
+	// the registration keeps waiting for more. Outgoing connections were
+	// set up by connectUuid already.
+	if (devieInfo->mDeviceRole == SERVER)
+		devieInfo = acceptConnection(devieInfo);
+	else
+		devieInfo = findConnection(devieInfo->mChannelId, deviceAddress);
+
+	if (devieInfo && devieInfo->mSockfd >= 0)
+		devieInfo = nullptr;
+
+	if (!devieInfo)
+	{
+		close(sockfd);
+		g_dbus_method_invocation_return_dbus_error(invocation, BLUEZ5_SPP_ERROR_REJECTED, "Connection rejected");
+		return TRUE;
+	}
+
+	devieInfo->mSockfd = sockfd;
+
+	// A slow peer must never block the main loop
+	int flags = fcntl(devieInfo->mSockfd, F_GETFL, 0);
+	if (flags < 0 || fcntl(devieInfo->mSockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to make socket non-blocking: %s", strerror(errno));
+
 	// finished with method call; no reply sent
 	g_dbus_method_invocation_return_value(invocation, NULL);
 
-	Bluez5Device *bluezDevice = mAdapter->findDeviceByObjectPath(device);
-	std::string deviceAddress;
-	if (bluezDevice)
+	devieInfo->mDeviceAddress = deviceAddress;
+
+	if (mStatsEnabled)
 	{
-		deviceAddress = bluezDevice->getAddress();
-		devieInfo->mDeviceAddress = bluezDevice->getAddress();
+		devieInfo->mStats.reset(new Bluez5SppChannelStats());
+		devieInfo->mStats->startTime = g_get_monotonic_time();
 	}
 
 	getSppObserver()->channelStateChanged(deviceAddress, devieInfo->mUuid, devieInfo->mChannelId, true);
 
+	if (mIoWorker && mIoWorker->isRunning())
+	{
+		devieInfo->mIoToken = mIoWorker->addChannel(devieInfo->mChannelId, devieInfo->mSockfd);
+		if (devieInfo->mIoToken)
+			return TRUE;
+
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to hand channel %d to the I/O worker", devieInfo->mChannelId);
+	}
+
 	devieInfo->mChannel = g_io_channel_unix_new (devieInfo->mSockfd);
 
 	g_io_channel_set_encoding(devieInfo->mChannel, NULL, &error);
@@ -251,86 +389,174 @@ gboolean Bluez5ProfileSpp::handleNewConnection (GDBusMethodInvocation *invocatio
 		g_error_free(error);
 	}
 
-	devieInfo->mIoWatchId = g_io_add_watch (devieInfo->mChannel, G_IO_IN, ioCallback, devieInfo);
+	devieInfo->mIoWatchId = g_io_add_watch (devieInfo->mChannel, (GIOCondition) (G_IO_IN | G_IO_HUP | G_IO_ERR),
+	                                        ioCallback, devieInfo);
 
 	DEBUG("devieInfo->mIoWatchId = %d", devieInfo->mIoWatchId);
 	return TRUE;
 }
 
 gboolean Bluez5ProfileSpp::handleRequestDisconnection (BluezProfile1 *interface, GDBusMethodInvocation *invocation, const gchar *device, SppDeviceInfo* devieInfo)
+{
+	UNUSED(interface);
+
+	Bluez5Device *bluezDevice = mAdapter->routeDeviceByObjectPath(device);
+	SppDeviceInfo *connection = bluezDevice ? findConnection(devieInfo->mChannelId, bluezDevice->getAddress()) : nullptr;
+
+	if (connection)
+		closeConnection(connection, true);
+
+	// finished with method call; no reply sent
+	g_dbus_method_invocation_return_value(invocation, NULL);
+
+	return TRUE;
+}
+
+void Bluez5ProfileSpp::closeChannelSocket(SppDeviceInfo *deviceInfo)
 {
 	GError *error = nullptr;
+	gint sockfd = deviceInfo->mSockfd;
 
-	UNUSED(device);
-	UNUSED(interface);
+	// The channel has to look closed before anything is called back
+	deviceInfo->mSockfd = -1;
 
-	getSppObserver()->channelStateChanged(devieInfo->mDeviceAddress, devieInfo->mUuid, devieInfo->mChannelId, false);
+	std::list<BluetoothResultCallback> pending;
+	detachTxQueue(deviceInfo, pending);
+
+	if (deviceInfo->mIoToken)
+	{
+		mIoWorker->removeChannel(deviceInfo->mIoToken);
+		deviceInfo->mIoToken = 0;
+	}
 
-	if (devieInfo->mChannel)
+	if (deviceInfo->mChannel)
 	{
-		if (devieInfo->mIoWatchId)
-			g_source_remove(devieInfo->mIoWatchId);
-		g_io_channel_shutdown(devieInfo->mChannel, TRUE, &error);
-		g_io_channel_unref (devieInfo->mChannel);
+		if (deviceInfo->mIoWatchId)
+		{
+			g_source_remove(deviceInfo->mIoWatchId);
+			deviceInfo->mIoWatchId = 0;
+		}
+		g_io_channel_shutdown(deviceInfo->mChannel, TRUE, &error);
+		g_io_channel_unref (deviceInfo->mChannel);
 		if (error)
 		{
 			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to shutdown channel %s",error->message);
 			g_error_free(error);
 		}
-		devieInfo->mChannel = nullptr;
+		deviceInfo->mChannel = nullptr;
 	}
 
-	if (devieInfo->mSockfd > 0)
+	if (sockfd >= 0)
+		close(sockfd);
+
+	// deviceInfo may be gone after this
+	for (auto &callback : pending)
 	{
-		close(devieInfo->mSockfd);
-		devieInfo->mSockfd = -1;
+		if (callback)
+			callback(BLUETOOTH_ERROR_FAIL);
 	}
+}
 
-	// finished with method call; no reply sent
-	g_dbus_method_invocation_return_value(invocation, NULL);
+void Bluez5ProfileSpp::closeConnection(SppDeviceInfo *connection, bool notify)
+{
+	BluetoothSppChannelId channelId = connection->mChannelId;
+	std::string address = connection->mDeviceAddress;
+	std::string uuid = connection->mUuid;
+	bool wasOpen = connection->mSockfd >= 0;
 
-	if ((devieInfo->mDeviceRole == CLIENT) && devieInfo->mInterface)
+	closeChannelSocket(connection);
+
+	if (notify && wasOpen)
+		getSppObserver()->channelStateChanged(address, uuid, channelId, false);
+
+	// Write callbacks and the observer may have released it already. The
+	// registration itself stays for the next connection.
+	connection = getSppDevice(channelId);
+	if (connection && connection->mRegistrationId)
+		releaseConnection(connection);
+}
+
+Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::acceptConnection(SppDeviceInfo *server)
+{
+	BluetoothSppChannelId channelId = allocateChannelId(CLIENT);
+	if (!channelId)
 	{
-		std::string objPath = BASE_OBJ_PATH + std::to_string(devieInfo->mChannelId);
-		auto unRegisterCallback = [this](GAsyncResult *result) {
-			GError *error = nullptr;
-			gboolean ret;
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Rejecting connection to server channel %d", server->mChannelId);
+		return nullptr;
+	}
 
-			ret = bluez_profile_manager1_call_unregister_profile_finish(mAdapter->getProfileManager(), result, &error);
-			if (error)
-			{
-				g_error_free(error);
-				return;
-			}
-		};
-		bluez_profile_manager1_call_unregister_profile(mAdapter->getProfileManager(), objPath.c_str(), NULL, glibAsyncMethodWrapper, new GlibAsyncFunctionWrapper(unRegisterCallback));
-		g_object_unref(devieInfo->mInterface);
-		removeConnectedDevice(devieInfo->mChannelId);
-		deallocateChannelId(devieInfo->mChannelId);
+	SppDeviceInfo *connection = new (std::nothrow) SppDeviceInfo(this, channelId, SERVER, server->mName, server->mUuid);
+	if (!connection)
+	{
+		deallocateChannelId(channelId);
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to allocate memory for sppDevInfo");
+		return nullptr;
 	}
 
-	return TRUE;
+	connection->mRegistrationId = server->mChannelId;
+	mConnectedDevices[channelId] = spDeviceInfo(connection);
+
+	DEBUG("Server channel %d accepted connection %d", server->mChannelId, channelId);
+
+	return connection;
+}
+
+void Bluez5ProfileSpp::releaseConnection(SppDeviceInfo *deviceInfo)
+{
+	BluetoothSppChannelId channelId = deviceInfo->mChannelId;
+
+	// deviceInfo is gone after this
+	removeConnectedDevice(channelId);
+	deallocateChannelId(channelId);
+}
+
+Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::findConnection(BluetoothSppChannelId serverChannelId, const std::string &address)
+{
+	for (auto &device : mConnectedDevices)
+	{
+		if (device.second->mRegistrationId == serverChannelId && device.second->mDeviceAddress == address)
+			return device.second.get();
+	}
+
+	return nullptr;
+}
+
+bool Bluez5ProfileSpp::hasConnection(const std::string &address) const
+{
+	std::string lowerCaseAddress = convertAddressToLowerCase(address);
+
+	for (auto &device : mConnectedDevices)
+	{
+		if (device.second->mSockfd >= 0 && convertAddressToLowerCase(device.second->mDeviceAddress) == lowerCaseAddress)
+			return true;
+	}
+
+	return false;
+}
+
+void Bluez5ProfileSpp::handlePeerClosed(SppDeviceInfo *deviceInfo)
+{
+	DEBUG("Channel %d closed by peer", deviceInfo->mChannelId);
+
+	closeConnection(deviceInfo, true);
 }
 
 gboolean Bluez5ProfileSpp::handleRelease()
 {
-	auto deviceIterator = mConnectedDevices.begin();
+	// Failed writes are called back while closing, they must not find
+	// the records anymore
+	ConnectedDevice devices;
+	devices.swap(mConnectedDevices);
+	mClientRegistrations.clear();
 
-	while (deviceIterator != mConnectedDevices.end())
+	for (auto &device : devices)
 	{
-		GError *error = nullptr;
-		g_io_channel_shutdown(deviceIterator->second->mChannel, TRUE, &error);
-		if (error)
-		{
-			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to release profile on system bus %s",error->message);
-			g_error_free(error);
-		}
-		g_io_channel_unref (deviceIterator->second->mChannel);
-		g_object_unref(deviceIterator->second->mInterface);
-		++deviceIterator;
+		closeChannelSocket(device.second.get());
+		if (device.second->mInterface)
+			g_object_unref(device.second->mInterface);
+		deallocateChannelId(device.first);
 	}
 
-	mConnectedDevices.clear();
 	return TRUE;
 }
 
@@ -343,165 +569,981 @@ gboolean Bluez5ProfileSpp::ioCallback(GIOChannel * io, GIOCondition condition, g
 
 gboolean Bluez5ProfileSpp::handleRxData(GIOChannel *io, GIOCondition condition, BluetoothSppChannelId channelId)
 {
-	char buf[1024] = { 0 };
-	gsize bytesRead = 0;
-	GError *error = nullptr;
-	UNUSED(condition);
+	UNUSED(io);
 
-	do
+	SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+	if (!deviceInfo || deviceInfo->mSockfd < 0)
+		return FALSE;
+
+	// Drain whatever is pending before looking at hangups so no data the
+	// peer sent right before closing gets lost
+	while (true)
 	{
-		GIOStatus status = g_io_channel_read_chars (io, buf, sizeof(buf), &bytesRead, &error);
+		ssize_t bytesRead = recv(deviceInfo->mSockfd, mRxBuffer.data(), mRxBuffer.size(), 0);
 
-		if (status == G_IO_STATUS_NORMAL && bytesRead > 0)
+		if (bytesRead > 0)
 		{
-			getSppObserver()->dataReceived(channelId, (const uint8_t *)buf, bytesRead);
-			DEBUG("received [%s] bytes_read[%lu]", buf, bytesRead);
+			deliverRxData(deviceInfo, mRxBuffer.data(), bytesRead);
+
+			// The observer may have closed the channel
+			deviceInfo = getSppDevice(channelId);
+			if (!deviceInfo || deviceInfo->mSockfd < 0)
+				return FALSE;
+
+			if ((size_t) bytesRead < mRxBuffer.size())
+				break;
+
+			continue;
 		}
 
-		if (error)
+		if (bytesRead == 0)
 		{
-			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to read data due to %s",error->message);
-			g_error_free(error);
+			deviceInfo->mIoWatchId = 0;
+			handlePeerClosed(deviceInfo);
+			return FALSE;
 		}
 
-	} while (bytesRead > 0);
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to read data from channel %d: %s", channelId, strerror(errno));
+		if (deviceInfo->mStats)
+			deviceInfo->mStats->readErrors++;
+		deviceInfo->mIoWatchId = 0;
+		handlePeerClosed(deviceInfo);
+		return FALSE;
+	}
+
+	if (condition & (G_IO_HUP | G_IO_ERR))
+	{
+		deviceInfo->mIoWatchId = 0;
+		handlePeerClosed(deviceInfo);
+		return FALSE;
+	}
 
 	return TRUE;
 }
 
-
-void Bluez5ProfileSpp::connectUuid(const std::string &address, const std::string &uuid, BluetoothChannelResultCallback callback)
+void Bluez5ProfileSpp::deliverRxData(SppDeviceInfo *deviceInfo, const uint8_t *data, size_t size)
 {
-	Bluez5Device *device = mAdapter->findDevice(address);
-	if (!device)
+	BluetoothSppChannelId channelId = deviceInfo->mChannelId;
+
+	if (deviceInfo->mStats)
 	{
-		DEBUG("Could not find device with address %s while trying to connect", address.c_str());
-		callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
-		return;
+		deviceInfo->mStats->reads++;
+		deviceInfo->mStats->bytesReceived += size;
+		deviceInfo->mStats->readSizeHistogram[histogramBucket(size)]++;
 	}
 
-	BluetoothSppChannelId channelId = allocateChannelId();
-	if (!channelId)
+	if (!deviceInfo->mFramer)
 	{
-		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to allocate Channel Id");
-		callback(BLUETOOTH_ERROR_FAIL, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+		getSppObserver()->dataReceived(channelId, data, size);
 		return;
 	}
 
-	SppDeviceInfo * sppDevInfo = new (std::nothrow) SppDeviceInfo(this, channelId, CLIENT, "SerialPort", uuid);
-	if (!sppDevInfo)
+	std::list<std::vector<uint8_t>> messages;
+	uint64_t droppedBytes = deviceInfo->mFramer->getDroppedBytes();
+	deviceInfo->mFramer->consume(data, size, messages);
+
+	if (deviceInfo->mStats)
+		deviceInfo->mStats->droppedBytes += deviceInfo->mFramer->getDroppedBytes() - droppedBytes;
+
+	for (auto &message : messages)
 	{
-		//Remove ChannelId used
-		deallocateChannelId(channelId);
-		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to allocate memory for sppDevice");
-		callback(BLUETOOTH_ERROR_NOMEM, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
-		return;
+		getSppObserver()->dataReceived(channelId, message.data(), message.size());
+
+		// The observer may have closed the channel
+		if (!getSppDevice(channelId))
+			return;
 	}
+}
 
-	spDeviceInfo channelInfo(sppDevInfo);
-	BluetoothError error = createSkeletonAndExport(uuid, channelInfo);
+BluetoothError Bluez5ProfileSpp::setFraming(BluetoothSppChannelId channelId, const Bluez5SppFraming &framing)
+{
+	SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+	if (!deviceInfo)
+		return BLUETOOTH_ERROR_FAIL;
 
-	if (error != BLUETOOTH_ERROR_NONE)
+	if (framing.mode == Bluez5SppFraming::NONE)
 	{
-		callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
-		return;
+		deviceInfo->mFramer.reset();
+		return BLUETOOTH_ERROR_NONE;
 	}
 
-	BluezProfile1 *mInterface = channelInfo->mInterface;
-	auto ConnectedCallback = [this, callback, channelId, mInterface](BluetoothError error)
-	{
-		if (error == BLUETOOTH_ERROR_NONE)
-		{
-			callback(BLUETOOTH_ERROR_NONE, channelId);
-		}
-		else
-		{
-			std::string objPath = BASE_OBJ_PATH + std::to_string(channelId);
-			bluez_profile_manager1_call_unregister_profile_sync(mAdapter->getProfileManager(), objPath.c_str(), NULL, NULL);
-			if (mInterface)
-				g_object_unref(mInterface);
-			deallocateChannelId(channelId);
-			callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
-		}
-	};
+	if (!Bluez5SppFramer::isValid(framing))
+		return BLUETOOTH_ERROR_PARAM_INVALID;
 
-	this->mConnectedDevices[channelInfo->mChannelId] = std::move(channelInfo);
-	device->connect(uuid, ConnectedCallback);
+	deviceInfo->mFramer.reset(new Bluez5SppFramer(framing));
+
+	return BLUETOOTH_ERROR_NONE;
 }
 
-void Bluez5ProfileSpp::disconnectUuid(const BluetoothSppChannelId channelId, BluetoothResultCallback callback)
+BluetoothResultCallback Bluez5ProfileSpp::trackWrite(SppDeviceInfo *deviceInfo, uint64_t size, BluetoothResultCallback callback)
 {
-	auto deviceIterator = mConnectedDevices.find(channelId);
-	if (deviceIterator == mConnectedDevices.end())
-	{
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
-	}
+	if (!deviceInfo->mStats)
+		return callback;
 
-	SppDeviceInfo *sppConnectionInfo = (deviceIterator->second).get();
+	BluetoothSppChannelId channelId = deviceInfo->mChannelId;
+	gint64 startTime = g_get_monotonic_time();
 
-	if (!sppConnectionInfo)
-	{
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
-	}
+	return [this, channelId, size, startTime, callback](BluetoothError error) {
+		SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+		if (deviceInfo && deviceInfo->mStats)
+			recordWrite(*deviceInfo->mStats, size, error, g_get_monotonic_time() - startTime);
 
-	Bluez5Device *device = mAdapter->findDevice(sppConnectionInfo->mDeviceAddress);
-	if (!device)
-	{
-		DEBUG("Could not find device with address %s while trying to connect", sppConnectionInfo->mDeviceAddress.c_str());
-		callback(BLUETOOTH_ERROR_NOT_READY);
-		return;
-	}
+		if (callback)
+			callback(error);
+	};
+}
 
-	auto disConnectedCallback = [this, callback, channelId, sppConnectionInfo](BluetoothError error)
+BluetoothResultCallback Bluez5ProfileSpp::trackWorkerWrite(uint64_t ioToken, uint64_t size, BluetoothResultCallback callback)
+{
+	gint64 startTime = g_get_monotonic_time();
+
+	// Statistics may have been turned off meanwhile
+	return [this, ioToken, size, startTime, callback](BluetoothError error) {
+		SppDeviceInfo *deviceInfo = findDeviceByIoToken(ioToken);
+		if (deviceInfo && deviceInfo->mStats)
+			recordWrite(*deviceInfo->mStats, size, error, g_get_monotonic_time() - startTime);
+
+		if (callback)
+			callback(error);
+	};
+}
+
+void Bluez5ProfileSpp::setStatsEnabled(bool enabled)
+{
+	mStatsEnabled = enabled;
+
+	if (mIoWorker)
+		mIoWorker->setStatsEnabled(enabled);
+
+	for (auto &device : mConnectedDevices)
 	{
-		if (error == BLUETOOTH_ERROR_NONE)
+		SppDeviceInfo *deviceInfo = device.second.get();
+
+		if (!enabled)
 		{
-			callback(BLUETOOTH_ERROR_NONE);
+			deviceInfo->mStats.reset();
 		}
-		else
+		else if (!deviceInfo->mStats && deviceInfo->mSockfd >= 0)
 		{
-			callback(BLUETOOTH_ERROR_NOT_READY);
+			deviceInfo->mStats.reset(new Bluez5SppChannelStats());
+			deviceInfo->mStats->startTime = g_get_monotonic_time();
 		}
-	};
-
-	device->disconnect(sppConnectionInfo->mUuid, disConnectedCallback);
+	}
 }
 
-void Bluez5ProfileSpp::writeData(const BluetoothSppChannelId channelId, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback)
+void Bluez5ProfileSpp::setStatsLogInterval(uint32_t interval)
 {
-	DEBUG("%s::%s",__FILE__,__FUNCTION__);
-
-	UNUSED(data);
-	UNUSED(size);
-	auto deviceIterator = mConnectedDevices.find(channelId);
-	if (deviceIterator == mConnectedDevices.end())
+	if (mStatsLogSource)
 	{
-		callback(BLUETOOTH_ERROR_FAIL);
-		return;
+		g_source_remove(mStatsLogSource);
+		mStatsLogSource = 0;
 	}
 
-	SppDeviceInfo *sppConnectionInfo = (deviceIterator->second).get();
-	int status = write(sppConnectionInfo->mSockfd, data, size);
+	if (interval)
+		mStatsLogSource = g_timeout_add_seconds(interval, handleStatsLogTimeout, this);
+}
 
-	if (status < 0) {
-		perror("client: write to socket failed!\n");
-	}
+bool Bluez5ProfileSpp::getChannelStats(BluetoothSppChannelId channelId, Bluez5SppChannelStats &stats) const
+{
+	auto deviceIterator = mConnectedDevices.find(channelId);
+	if (deviceIterator == mConnectedDevices.end() || !deviceIterator->second->mStats)
+		return false;
+
+	stats = *deviceIterator->second->mStats;
 
-	callback(BLUETOOTH_ERROR_NONE);
+	return true;
 }
 
-BluetoothError Bluez5ProfileSpp::createChannel(const std::string &name, const std::string &uuid)
+gboolean Bluez5ProfileSpp::handleStatsLogTimeout(gpointer user_data)
 {
-	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+	Bluez5ProfileSpp *profile = static_cast<Bluez5ProfileSpp*>(user_data);
 
-	BluetoothSppChannelId channelId = allocateChannelId();
+	for (auto &device : profile->mConnectedDevices)
+	{
+		if (device.second->mStats)
+			profile->logChannelStats(device.second.get());
+	}
+
+	return TRUE;
+}
+
+void Bluez5ProfileSpp::logChannelStats(SppDeviceInfo *deviceInfo)
+{
+	const Bluez5SppChannelStats &stats = *deviceInfo->mStats;
+	gint64 elapsed = (g_get_monotonic_time() - stats.startTime) / G_USEC_PER_SEC;
+	if (elapsed < 1)
+		elapsed = 1;
+
+	DEBUG("SPP channel %d: sent %llu bytes (%llu B/s) in %llu writes, %llu failed, %llu short, peak queue %zu bytes",
+	      deviceInfo->mChannelId, (unsigned long long) stats.bytesSent, (unsigned long long) (stats.bytesSent / elapsed),
+	      (unsigned long long) stats.writes, (unsigned long long) stats.writeErrors,
+	      (unsigned long long) stats.shortWrites, stats.maxTxQueuedBytes);
+	DEBUG("SPP channel %d: write latency min %lld avg %lld max %lld us",
+	      deviceInfo->mChannelId, (long long) stats.minWriteLatency,
+	      (long long) (stats.writes ? stats.totalWriteLatency / (gint64) stats.writes : 0),
+	      (long long) stats.maxWriteLatency);
+	DEBUG("SPP channel %d: received %llu bytes (%llu B/s) in %llu reads, %llu read errors, %llu bytes dropped",
+	      deviceInfo->mChannelId, (unsigned long long) stats.bytesReceived, (unsigned long long) (stats.bytesReceived / elapsed),
+	      (unsigned long long) stats.reads, (unsigned long long) stats.readErrors,
+	      (unsigned long long) stats.droppedBytes);
+}
+
+void Bluez5ProfileSpp::setRxBufferSize(uint32_t size)
+{
+	if (size)
+		mRxBuffer.resize(size);
+}
+
+
+void Bluez5ProfileSpp::connectUuid(const std::string &address, const std::string &uuid, BluetoothChannelResultCallback callback)
+{
+	Bluez5Device *device = mAdapter->routeDevice(address);
+	if (!device)
+	{
+		DEBUG("Could not find device with address %s while trying to connect", address.c_str());
+		callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+		return;
+	}
+
+	BluetoothSppChannelId channelId = allocateChannelId(CLIENT);
+	if (!channelId)
+	{
+		callback(BLUETOOTH_ERROR_BUSY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+		return;
+	}
+
+	SppDeviceInfo * sppDevInfo = new (std::nothrow) SppDeviceInfo(this, channelId, CLIENT, "SerialPort", uuid);
+	if (!sppDevInfo)
+	{
+		//Remove ChannelId used
+		deallocateChannelId(channelId);
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to allocate memory for sppDevice");
+		callback(BLUETOOTH_ERROR_NOMEM, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+		return;
+	}
+
+	// The NewConnection call of bluez is matched to the connection through
+	// the address
+	sppDevInfo->mDeviceAddress = device->getAddress();
+	mConnectedDevices[channelId] = spDeviceInfo(sppDevInfo);
+
+	std::string deviceAddress = device->getAddress();
+
+	auto ConnectedCallback = [this, callback, channelId](BluetoothError error)
+	{
+		if (error == BLUETOOTH_ERROR_NONE)
+		{
+			callback(BLUETOOTH_ERROR_NONE, channelId);
+			return;
+		}
+
+		SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+		if (deviceInfo)
+			closeConnection(deviceInfo, false);
+
+		callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+	};
+
+	auto registeredCallback = [this, callback, deviceAddress, uuid, channelId, ConnectedCallback](BluetoothError error)
+	{
+		SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+		if (!deviceInfo)
+			return;
+
+		Bluez5Device *device = mAdapter->routeDevice(deviceAddress);
+		if (error != BLUETOOTH_ERROR_NONE || !device)
+		{
+			// Without a registration closeConnection would keep the record
+			// and its channel id
+			releaseConnection(deviceInfo);
+			callback(BLUETOOTH_ERROR_NOT_READY, BLUETOOTH_SPP_CHANNEL_ID_INVALID);
+			return;
+		}
+
+		deviceInfo->mRegistrationId = mClientRegistrations[uuid].channelId;
+		device->getAdapter()->getConnectionManager()->connectProfile(device, uuid, ConnectedCallback);
+	};
+
+	acquireClientRegistration(uuid, registeredCallback);
+}
+
+void Bluez5ProfileSpp::acquireClientRegistration(const std::string &uuid, BluetoothResultCallback callback)
+{
+	auto registrationIter = mClientRegistrations.find(uuid);
+	if (registrationIter != mClientRegistrations.end())
+	{
+		if (registrationIter->second.registered)
+			callback(BLUETOOTH_ERROR_NONE);
+		else
+			registrationIter->second.pendingCallbacks.push_back(callback);
+		return;
+	}
+
+	BluetoothSppChannelId channelId = allocateChannelId(CLIENT);
 	if (!channelId)
 	{
-		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to get channelId");
+		callback(BLUETOOTH_ERROR_BUSY);
+		return;
+	}
+
+	SppDeviceInfo * sppDevInfo = new (std::nothrow) SppDeviceInfo(this, channelId, CLIENT, "SerialPort", uuid);
+	if (!sppDevInfo)
+	{
+		deallocateChannelId(channelId);
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to allocate memory for sppDevice");
+		callback(BLUETOOTH_ERROR_NOMEM);
+		return;
+	}
+
+	spDeviceInfo channelInfo(sppDevInfo);
+	std::string objPath = BASE_OBJ_PATH + std::to_string(channelId);
+
+	if (exportSkeleton(channelInfo, objPath) != BLUETOOTH_ERROR_NONE)
+	{
+		deallocateChannelId(channelId);
+		callback(BLUETOOTH_ERROR_NOT_READY);
+		return;
+	}
+
+	mConnectedDevices[channelId] = std::move(channelInfo);
+
+	ClientRegistration &registration = mClientRegistrations[uuid];
+	registration.channelId = channelId;
+	registration.registered = false;
+	registration.pendingCallbacks.push_back(callback);
+
+	auto registerCallback = [this, uuid, channelId](BluetoothError error)
+	{
+		auto registrationIter = mClientRegistrations.find(uuid);
+		if (registrationIter == mClientRegistrations.end() || registrationIter->second.channelId != channelId)
+			return;
+
+		std::list<BluetoothResultCallback> callbacks;
+		callbacks.swap(registrationIter->second.pendingCallbacks);
+
+		if (error == BLUETOOTH_ERROR_NONE)
+		{
+			registrationIter->second.registered = true;
+		}
+		else
+		{
+			// Dropped so the next connect tries again
+			mClientRegistrations.erase(registrationIter);
+
+			SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+			if (deviceInfo && deviceInfo->mInterface)
+			{
+				g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(deviceInfo->mInterface));
+				g_object_unref(deviceInfo->mInterface);
+			}
+
+			removeConnectedDevice(channelId);
+			deallocateChannelId(channelId);
+		}
+
+		for (auto &callback : callbacks)
+			callback(error);
+	};
+
+	registerProfileAsync(mConnectedDevices[channelId].get(), objPath, registerCallback);
+}
+
+void Bluez5ProfileSpp::disconnectUuid(const BluetoothSppChannelId channelId, BluetoothResultCallback callback)
+{
+	auto deviceIterator = mConnectedDevices.find(channelId);
+	if (deviceIterator == mConnectedDevices.end())
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	SppDeviceInfo *sppConnectionInfo = (deviceIterator->second).get();
+
+	if (!sppConnectionInfo)
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	Bluez5Device *device = mAdapter->routeDevice(sppConnectionInfo->mDeviceAddress);
+	if (!device)
+	{
+		DEBUG("Could not find device with address %s while trying to connect", sppConnectionInfo->mDeviceAddress.c_str());
+		callback(BLUETOOTH_ERROR_NOT_READY);
+		return;
+	}
+
+	auto disConnectedCallback = [this, callback, channelId, sppConnectionInfo](BluetoothError error)
+	{
+		if (error == BLUETOOTH_ERROR_NONE)
+		{
+			callback(BLUETOOTH_ERROR_NONE);
+		}
+		else
+		{
+			callback(BLUETOOTH_ERROR_NOT_READY);
+		}
+	};
+
+	device->disconnect(sppConnectionInfo->mUuid, disConnectedCallback);
+}
+
+void Bluez5ProfileSpp::writeData(const BluetoothSppChannelId channelId, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback)
+{
+	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	auto deviceIterator = mConnectedDevices.find(channelId);
+	if (deviceIterator == mConnectedDevices.end())
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	SppDeviceInfo *sppConnectionInfo = (deviceIterator->second).get();
+	if (sppConnectionInfo->mSockfd < 0)
+	{
+		callback(BLUETOOTH_ERROR_NOT_READY);
+		return;
+	}
+
+	// Above the high water mark writes are refused until the queue drained
+	if (sppConnectionInfo->mTxCongested)
+	{
+		callback(BLUETOOTH_ERROR_BUSY);
+		return;
+	}
+
+	// The worker coalesces the writes of its channels itself
+	if (sppConnectionInfo->mIoToken)
+	{
+		BluetoothError error = writeWorkerData(sppConnectionInfo->mIoToken, data, size, callback);
+		if (error != BLUETOOTH_ERROR_NONE)
+			callback(error);
+		return;
+	}
+
+	callback = trackWrite(sppConnectionInfo, size, callback);
+
+	if (sppConnectionInfo->mCoalesceDelay)
+	{
+		if (size < sppConnectionInfo->mCoalesceMaxSize)
+		{
+			coalesceData(sppConnectionInfo, data, size, callback);
+			return;
+		}
+
+		// Anything held back has to go out first
+		flushCoalescedData(sppConnectionInfo);
+
+		// which may fail and tear the channel down
+		sppConnectionInfo = getSppDevice(channelId);
+		if (!sppConnectionInfo || sppConnectionInfo->mSockfd < 0)
+		{
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
+		}
+	}
+
+	submitData(sppConnectionInfo, data, size, callback);
+}
+
+uint64_t Bluez5ProfileSpp::getIoToken(BluetoothSppChannelId channelId)
+{
+	SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+
+	return deviceInfo ? deviceInfo->mIoToken : 0;
+}
+
+BluetoothError Bluez5ProfileSpp::writeWorkerData(uint64_t ioToken, const uint8_t *data, uint32_t size, BluetoothResultCallback callback)
+{
+	// Once created the worker stays as long as the profile, a stopped one
+	// just fails the write
+	Bluez5SppIoWorker *worker = mIoWorker;
+	if (!worker || !ioToken)
+		return BLUETOOTH_ERROR_FAIL;
+
+	if (worker->getStatsEnabled())
+		callback = trackWorkerWrite(ioToken, size, callback);
+
+	return worker->write(ioToken, data, size, callback);
+}
+
+void Bluez5ProfileSpp::submitData(SppDeviceInfo *sppConnectionInfo, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback)
+{
+	if (!size)
+	{
+		callback(BLUETOOTH_ERROR_NONE);
+		return;
+	}
+
+	SppDeviceInfo::TxBuffer buffer;
+	buffer.data.assign(data, data + size);
+	buffer.offset = 0;
+	buffer.callback = callback;
+
+	sppConnectionInfo->mTxQueue.push_back(buffer);
+	sppConnectionInfo->mTxQueuedBytes += size;
+
+	if (sppConnectionInfo->mStats && sppConnectionInfo->mTxQueuedBytes > sppConnectionInfo->mStats->maxTxQueuedBytes)
+		sppConnectionInfo->mStats->maxTxQueuedBytes = sppConnectionInfo->mTxQueuedBytes;
+
+	// With a watch pending the socket is full and the data has to wait
+	if (sppConnectionInfo->mTxWatchId)
+	{
+		updateTxCongestion(sppConnectionInfo);
+		return;
+	}
+
+	processTxQueue(sppConnectionInfo);
+}
+
+BluetoothError Bluez5ProfileSpp::setWriteCoalescing(BluetoothSppChannelId channelId, uint32_t maxDelay, uint32_t maxBatchSize)
+{
+	SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+	if (!deviceInfo)
+		return BLUETOOTH_ERROR_FAIL;
+
+	if (maxDelay && maxBatchSize < 2)
+		return BLUETOOTH_ERROR_PARAM_INVALID;
+
+	if (deviceInfo->mIoToken)
+	{
+		mIoWorker->setWriteCoalescing(deviceInfo->mIoToken, maxDelay, maxBatchSize);
+		return BLUETOOTH_ERROR_NONE;
+	}
+
+	flushCoalescedData(deviceInfo);
+
+	deviceInfo = getSppDevice(channelId);
+	if (!deviceInfo)
+		return BLUETOOTH_ERROR_FAIL;
+
+	deviceInfo->mCoalesceDelay = maxDelay;
+	deviceInfo->mCoalesceMaxSize = maxBatchSize;
+
+	return BLUETOOTH_ERROR_NONE;
+}
+
+BluetoothError Bluez5ProfileSpp::flush(BluetoothSppChannelId channelId)
+{
+	SppDeviceInfo *deviceInfo = getSppDevice(channelId);
+	if (!deviceInfo)
 		return BLUETOOTH_ERROR_FAIL;
+
+	if (deviceInfo->mIoToken)
+		mIoWorker->flush(deviceInfo->mIoToken);
+	else
+		flushCoalescedData(deviceInfo);
+
+	return BLUETOOTH_ERROR_NONE;
+}
+
+void Bluez5ProfileSpp::coalesceData(SppDeviceInfo *deviceInfo, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback)
+{
+	// A write which doesn't fit anymore starts the next batch
+	if (deviceInfo->mCoalesceBuffer.size() + size > deviceInfo->mCoalesceMaxSize)
+	{
+		BluetoothSppChannelId channelId = deviceInfo->mChannelId;
+
+		flushCoalescedData(deviceInfo);
+
+		// which may fail and tear the channel down
+		deviceInfo = getSppDevice(channelId);
+		if (!deviceInfo || deviceInfo->mSockfd < 0)
+		{
+			callback(BLUETOOTH_ERROR_FAIL);
+			return;
+		}
+	}
+
+	deviceInfo->mCoalesceBuffer.insert(deviceInfo->mCoalesceBuffer.end(), data, data + size);
+	deviceInfo->mCoalesceCallbacks.push_back(callback);
+
+	if (deviceInfo->mCoalesceBuffer.size() >= deviceInfo->mCoalesceMaxSize)
+	{
+		flushCoalescedData(deviceInfo);
+		return;
+	}
+
+	if (!deviceInfo->mCoalesceTimeoutId)
+		deviceInfo->mCoalesceTimeoutId = g_timeout_add(deviceInfo->mCoalesceDelay, handleCoalesceTimeout, deviceInfo);
+}
+
+void Bluez5ProfileSpp::flushCoalescedData(SppDeviceInfo *deviceInfo)
+{
+	if (deviceInfo->mCoalesceTimeoutId)
+	{
+		g_source_remove(deviceInfo->mCoalesceTimeoutId);
+		deviceInfo->mCoalesceTimeoutId = 0;
+	}
+
+	if (deviceInfo->mCoalesceBuffer.empty())
+		return;
+
+	std::vector<uint8_t> data;
+	data.swap(deviceInfo->mCoalesceBuffer);
+	std::list<BluetoothResultCallback> callbacks;
+	callbacks.swap(deviceInfo->mCoalesceCallbacks);
+
+	// Every write merged into the batch gets the result of the batch
+	auto batchCallback = [callbacks](BluetoothError error) {
+		for (auto &callback : callbacks)
+		{
+			if (callback)
+				callback(error);
+		}
+	};
+
+	submitData(deviceInfo, data.data(), data.size(), batchCallback);
+}
+
+gboolean Bluez5ProfileSpp::handleCoalesceTimeout(gpointer user_data)
+{
+	SppDeviceInfo *deviceInfo = static_cast<SppDeviceInfo*>(user_data);
+
+	deviceInfo->mCoalesceTimeoutId = 0;
+	deviceInfo->mSppProfile->flushCoalescedData(deviceInfo);
+
+	return FALSE;
+}
+
+void Bluez5ProfileSpp::sendFile(const BluetoothSppChannelId channelId, const std::string &path, uint64_t offset, uint64_t length,
+                                Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback)
+{
+	// Opening a FIFO or device must not block the main loop, anything but
+	// a regular file is refused right after
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+	{
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to open %s: %s", path.c_str(), strerror(errno));
+		callback(BLUETOOTH_ERROR_PARAM_INVALID);
+		return;
+	}
+
+	sendFileDescriptor(channelId, fd, offset, length, progress, callback);
+}
+
+void Bluez5ProfileSpp::sendFile(const BluetoothSppChannelId channelId, int fd, uint64_t offset, uint64_t length,
+                                Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback)
+{
+	int transferFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (transferFd < 0)
+	{
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to duplicate file descriptor: %s", strerror(errno));
+		callback(BLUETOOTH_ERROR_PARAM_INVALID);
+		return;
+	}
+
+	sendFileDescriptor(channelId, transferFd, offset, length, progress, callback);
+}
+
+void Bluez5ProfileSpp::sendFileDescriptor(const BluetoothSppChannelId channelId, int fd, uint64_t offset, uint64_t length,
+                                          Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback)
+{
+	// Only regular files have a size to go by and can't stall the sender
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) < 0 || !S_ISREG(fileStat.st_mode) || offset > (uint64_t) fileStat.st_size)
+	{
+		close(fd);
+		callback(BLUETOOTH_ERROR_PARAM_INVALID);
+		return;
+	}
+
+	// Zero sends everything from offset to the end of the file
+	if (!length || length > fileStat.st_size - offset)
+		length = fileStat.st_size - offset;
+
+	std::shared_ptr<Bluez5SppFileTransfer> file = std::make_shared<Bluez5SppFileTransfer>(fd, offset, length);
+
+	SppDeviceInfo *sppConnectionInfo = getSppDevice(channelId);
+	if (!sppConnectionInfo || sppConnectionInfo->mSockfd < 0)
+	{
+		callback(sppConnectionInfo ? BLUETOOTH_ERROR_NOT_READY : BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	if (sppConnectionInfo->mTxCongested)
+	{
+		callback(BLUETOOTH_ERROR_BUSY);
+		return;
+	}
+
+	flushCoalescedData(sppConnectionInfo);
+
+	// Flushing may fail and tear the channel down
+	sppConnectionInfo = getSppDevice(channelId);
+	if (!sppConnectionInfo || sppConnectionInfo->mSockfd < 0)
+	{
+		callback(BLUETOOTH_ERROR_FAIL);
+		return;
+	}
+
+	callback = trackWrite(sppConnectionInfo, length, callback);
+
+	if (sppConnectionInfo->mIoToken)
+	{
+		// The worker sends whatever it holds back first
+		BluetoothError error = mIoWorker->sendFile(sppConnectionInfo->mIoToken, file, progress, callback);
+		if (error != BLUETOOTH_ERROR_NONE)
+			callback(error);
+		return;
+	}
+
+	SppDeviceInfo::TxBuffer buffer;
+	buffer.offset = 0;
+	buffer.callback = callback;
+	buffer.file = file;
+	buffer.progress = progress;
+
+	// File data stays in the page cache and doesn't count towards the
+	// queued bytes
+	sppConnectionInfo->mTxQueue.push_back(buffer);
+
+	if (!sppConnectionInfo->mTxWatchId)
+		processTxQueue(sppConnectionInfo);
+}
+
+void Bluez5ProfileSpp::setTxWaterMarks(uint32_t highWaterMark, uint32_t lowWaterMark)
+{
+	mTxHighWaterMark = highWaterMark;
+	mTxLowWaterMark = lowWaterMark < highWaterMark ? lowWaterMark : highWaterMark;
+
+	if (mIoWorker)
+		mIoWorker->setTxWaterMarks(mTxHighWaterMark, mTxLowWaterMark);
+}
+
+bool Bluez5ProfileSpp::setIoWorkerEnabled(bool enabled)
+{
+	if (enabled)
+	{
+		if (!mIoWorker)
+		{
+			mIoWorker = new Bluez5SppIoWorker(std::bind(&Bluez5ProfileSpp::handleIoEvent, this, std::placeholders::_1),
+			                                  mRxBuffer.size());
+			mIoWorker->setTxWaterMarks(mTxHighWaterMark, mTxLowWaterMark);
+			mIoWorker->setStatsEnabled(mStatsEnabled);
+		}
+
+		return mIoWorker->start();
+	}
+
+	if (!mIoWorker || !mIoWorker->isRunning())
+		return true;
+
+	for (auto &device : mConnectedDevices)
+	{
+		if (device.second->mIoToken)
+			return false;
+	}
+
+	// Other threads may still be about to write through the worker so it
+	// is only stopped, never deleted before the profile
+	mIoWorker->stop();
+
+	return true;
+}
+
+void Bluez5ProfileSpp::handleIoEvent(const Bluez5SppIoEvent &event)
+{
+	if (event.type == Bluez5SppIoEvent::WRITE_DONE)
+	{
+		if (event.callback)
+			event.callback(event.error);
+		return;
+	}
+
+	// Drop whatever belongs to a connection which is gone already
+	SppDeviceInfo *deviceInfo = getSppDevice(event.channelId);
+	if (!deviceInfo || deviceInfo->mIoToken != event.token)
+		return;
+
+	if (event.type == Bluez5SppIoEvent::PROGRESS)
+	{
+		if (event.progress)
+			event.progress(event.bytesSent, event.totalBytes);
+		return;
+	}
+
+	switch (event.type)
+	{
+	case Bluez5SppIoEvent::DATA:
+		deliverRxData(deviceInfo, event.data.data(), event.data.size());
+		break;
+	case Bluez5SppIoEvent::CLOSED:
+		handlePeerClosed(deviceInfo);
+		break;
+	case Bluez5SppIoEvent::CONGESTION:
+		deviceInfo->mTxCongested = event.congested;
+
+		if (mFlowControlCallback)
+			mFlowControlCallback(event.channelId, event.congested);
+		break;
+	case Bluez5SppIoEvent::STATS:
+		if (deviceInfo->mStats)
+		{
+			deviceInfo->mStats->shortWrites += event.shortWrites;
+			deviceInfo->mStats->readErrors += event.readErrors;
+			if (event.maxTxQueuedBytes > deviceInfo->mStats->maxTxQueuedBytes)
+				deviceInfo->mStats->maxTxQueuedBytes = event.maxTxQueuedBytes;
+		}
+		break;
+	default:
+		break;
 	}
+}
+
+gboolean Bluez5ProfileSpp::txCallback(GIOChannel *io, GIOCondition condition, gpointer data)
+{
+	SppDeviceInfo* sppDevice = static_cast<SppDeviceInfo*>(data);
+
+	UNUSED(io);
+	UNUSED(condition);
+
+	// processTxQueue adds a new watch if the socket fills up again
+	sppDevice->mTxWatchId = 0;
+	sppDevice->mSppProfile->processTxQueue(sppDevice);
+
+	return FALSE;
+}
+
+void Bluez5ProfileSpp::processTxQueue(SppDeviceInfo *deviceInfo)
+{
+	std::list<std::function<void()>> completed;
+	std::list<SppDeviceInfo::TxBuffer> failed;
+
+	while (!deviceInfo->mTxQueue.empty())
+	{
+		SppDeviceInfo::TxBuffer &buffer = deviceInfo->mTxQueue.front();
+
+		if (buffer.file)
+		{
+			uint64_t sent = buffer.file->getBytesSent();
+			if (!buffer.file->send(deviceInfo->mSockfd))
+			{
+				ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to send file to channel %d: %s",
+				      deviceInfo->mChannelId, strerror(errno));
+				failed.swap(deviceInfo->mTxQueue);
+				deviceInfo->mTxQueuedBytes = 0;
+				break;
+			}
+
+			if (buffer.progress && buffer.file->getBytesSent() != sent)
+				completed.push_back(std::bind(buffer.progress, buffer.file->getBytesSent(), buffer.file->getLength()));
+
+			if (!buffer.file->isComplete())
+				break;
+		}
+		else
+		{
+			ssize_t written = send(deviceInfo->mSockfd, buffer.data.data() + buffer.offset,
+			                       buffer.data.size() - buffer.offset, MSG_NOSIGNAL);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+
+				ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to write to channel %d: %s",
+				      deviceInfo->mChannelId, strerror(errno));
+				failed.swap(deviceInfo->mTxQueue);
+				deviceInfo->mTxQueuedBytes = 0;
+				break;
+			}
+
+			buffer.offset += written;
+			deviceInfo->mTxQueuedBytes -= written;
+
+			if (buffer.offset < buffer.data.size())
+			{
+				if (deviceInfo->mStats)
+					deviceInfo->mStats->shortWrites++;
+				continue;
+			}
+		}
+
+		if (buffer.callback)
+			completed.push_back(std::bind(buffer.callback, BLUETOOTH_ERROR_NONE));
+		deviceInfo->mTxQueue.pop_front();
+	}
+
+	if (!deviceInfo->mTxQueue.empty() && !deviceInfo->mTxWatchId && deviceInfo->mChannel)
+		deviceInfo->mTxWatchId = g_io_add_watch(deviceInfo->mChannel, G_IO_OUT, txCallback, deviceInfo);
+
+	updateTxCongestion(deviceInfo);
+
+	// Called last as a callback may well tear the channel down
+	for (auto &callback : completed)
+		callback();
+
+	for (auto &buffer : failed)
+	{
+		if (buffer.callback)
+			buffer.callback(BLUETOOTH_ERROR_FAIL);
+	}
+}
+
+void Bluez5ProfileSpp::detachTxQueue(SppDeviceInfo *deviceInfo, std::list<BluetoothResultCallback> &callbacks)
+{
+	for (auto &buffer : deviceInfo->mTxQueue)
+		callbacks.push_back(buffer.callback);
+
+	callbacks.splice(callbacks.end(), deviceInfo->mCoalesceCallbacks);
+
+	deviceInfo->mTxQueue.clear();
+	deviceInfo->mTxQueuedBytes = 0;
+	deviceInfo->mCoalesceBuffer.clear();
+
+	if (deviceInfo->mCoalesceTimeoutId)
+	{
+		g_source_remove(deviceInfo->mCoalesceTimeoutId);
+		deviceInfo->mCoalesceTimeoutId = 0;
+	}
+
+	if (deviceInfo->mTxWatchId)
+	{
+		g_source_remove(deviceInfo->mTxWatchId);
+		deviceInfo->mTxWatchId = 0;
+	}
+
+	// Nobody is left to tell about the queue draining
+	deviceInfo->mTxCongested = false;
+}
+
+void Bluez5ProfileSpp::updateTxCongestion(SppDeviceInfo *deviceInfo)
+{
+	bool congested = deviceInfo->mTxCongested;
+
+	if (!congested && deviceInfo->mTxQueuedBytes >= mTxHighWaterMark)
+		congested = true;
+	else if (congested && deviceInfo->mTxQueuedBytes <= mTxLowWaterMark)
+		congested = false;
+
+	if (congested == deviceInfo->mTxCongested)
+		return;
+
+	DEBUG("Channel %d %s", deviceInfo->mChannelId, congested ? "congested" : "drained");
+
+	deviceInfo->mTxCongested = congested;
+
+	if (mFlowControlCallback)
+		mFlowControlCallback(deviceInfo->mChannelId, congested);
+}
+
+BluetoothError Bluez5ProfileSpp::createChannel(const std::string &name, const std::string &uuid)
+{
+	DEBUG("%s::%s",__FILE__,__FUNCTION__);
+
+	BluetoothSppChannelId channelId = allocateChannelId(SERVER);
+	if (!channelId)
+		return BLUETOOTH_ERROR_BUSY;
 
 	SppDeviceInfo * sppDevInfo = new (std::nothrow) SppDeviceInfo(this, channelId, SERVER, name, uuid);
 
@@ -529,46 +1571,108 @@ BluetoothError Bluez5ProfileSpp::removeChannel(const std::string &uuid)
 {
 	DEBUG("%s::%s",__FILE__,__FUNCTION__);
 
-	SppDeviceInfo *sppConnectionInfo = getSppDevice(uuid);
+	SppDeviceInfo *sppConnectionInfo = getSppServer(uuid);
 
 	if (!sppConnectionInfo)
 	{
 		return BLUETOOTH_ERROR_FAIL;
 	}
 
-	if (sppConnectionInfo->mInterface)
+	BluetoothSppChannelId serverChannelId = sppConnectionInfo->mChannelId;
+	std::string objPath = BASE_OBJ_PATH + std::to_string(serverChannelId);
+	bluez_profile_manager1_call_unregister_profile_sync(mAdapter->getProfileManager(), objPath.c_str(), NULL, NULL);
+	g_object_unref(sppConnectionInfo->mInterface);
+	removeConnectedDevice(serverChannelId);
+	deallocateChannelId(serverChannelId);
+
+	// Take down every connection the server accepted
+	std::vector<BluetoothSppChannelId> connections;
+	for (auto &device : mConnectedDevices)
 	{
-		std::string objPath = BASE_OBJ_PATH + std::to_string(sppConnectionInfo->mChannelId);
-		bluez_profile_manager1_call_unregister_profile_sync(mAdapter->getProfileManager(), objPath.c_str(), NULL, NULL);
-		g_object_unref(sppConnectionInfo->mInterface);
-		getSppObserver()->channelStateChanged(sppConnectionInfo->mDeviceAddress, uuid, sppConnectionInfo->mChannelId, false);
-		removeConnectedDevice(sppConnectionInfo->mChannelId);
-		deallocateChannelId(sppConnectionInfo->mChannelId);
+		if (device.second->mRegistrationId == serverChannelId)
+			connections.push_back(device.first);
+	}
+
+	for (auto channelId : connections)
+	{
+		// An observer may have taken the connection down meanwhile
+		SppDeviceInfo *connection = getSppDevice(channelId);
+		if (!connection)
+			continue;
+
+		closeConnection(connection, true);
 	}
 
 	return BLUETOOTH_ERROR_NONE;
 }
 
-BluetoothSppChannelId Bluez5ProfileSpp::allocateChannelId()
+bool Bluez5ProfileSpp::setChannelPool(DeviceRole role, BluetoothSppChannelId first, BluetoothSppChannelId last)
 {
-	BluetoothSppChannelId retChId = 0;
-	for (auto& ids : mChannelIdList)
+	if (!first || first > last || last == BLUETOOTH_SPP_CHANNEL_ID_INVALID)
+		return false;
+
+	if (role == SERVER && last > BLUEZ5_SPP_RFCOMM_LAST_CHANNEL)
+	{
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Server channel pool %d-%d exceeds the RFCOMM channel range", first, last);
+		return false;
+	}
+
+	// Ids have to stay unique across both roles
+	const ChannelPool &other = mChannelPools[role == SERVER ? CLIENT : SERVER];
+	if (first <= other.last && other.first <= last)
 	{
-		if (!ids.second)
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Channel pool %d-%d overlaps with pool %d-%d", first, last, other.first, other.last);
+		return false;
+	}
+
+	// Ids still in use outside of the new range are released as usual
+	mChannelPools[role] = {first, last, first};
+
+	return true;
+}
+
+uint32_t Bluez5ProfileSpp::getFreeChannelCount(DeviceRole role) const
+{
+	const ChannelPool &pool = mChannelPools[role];
+	uint32_t count = 0;
+
+	for (uint32_t id = pool.first; id <= pool.last; id++)
+	{
+		if (!mChannelsInUse.test(id))
+			count++;
+	}
+
+	return count;
+}
+
+BluetoothSppChannelId Bluez5ProfileSpp::allocateChannelId(DeviceRole role)
+{
+	ChannelPool &pool = mChannelPools[role];
+	uint32_t size = pool.last - pool.first + 1;
+	uint32_t id = pool.next;
+
+	for (uint32_t n = 0; n < size; n++, id++)
+	{
+		if (id < pool.first || id > pool.last)
+			id = pool.first;
+
+		if (!mChannelsInUse.test(id))
 		{
-			retChId = ids.first;
-			ids.second = true;
-			break;
+			mChannelsInUse.set(id);
+			pool.next = (id == pool.last) ? pool.first : id + 1;
+			return id;
 		}
 	}
 
-	return retChId;
+	ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "All %u %s channel ids (%d-%d) are in use", size,
+	      role == SERVER ? "server" : "client", pool.first, pool.last);
+
+	return 0;
 }
 
 void Bluez5ProfileSpp::deallocateChannelId(BluetoothSppChannelId channelId)
 {
-	 if(mChannelIdList[channelId])
-		mChannelIdList[channelId] = false;
+	mChannelsInUse.reset(channelId);
 }
 
 bool Bluez5ProfileSpp::removeConnectedDevice(BluetoothSppChannelId channelId)
@@ -587,13 +1691,25 @@ Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::getSppDevice(const BluetoothS
 	return deviceInfo;
 }
 
-Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::getSppDevice(const std::string& uuid)
+Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::findDeviceByIoToken(uint64_t ioToken)
+{
+	for (auto &device : mConnectedDevices)
+	{
+		if (device.second->mIoToken == ioToken)
+			return device.second.get();
+	}
+
+	return nullptr;
+}
+
+Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::getSppServer(const std::string& uuid)
 {
 	SppDeviceInfo* deviceInfo = nullptr;
 
 	auto matchUuid = [&uuid](std::pair<const unsigned char, std::unique_ptr<Bluez5ProfileSpp::SppDeviceInfo>>& device)
 	{
-		if((device.second)->mUuid == uuid)
+		if ((device.second)->mUuid == uuid && (device.second)->mDeviceRole == SERVER &&
+		    !(device.second)->mRegistrationId)
 			return true;
 
 		return false;
@@ -609,7 +1725,6 @@ Bluez5ProfileSpp::SppDeviceInfo* Bluez5ProfileSpp::getSppDevice(const std::strin
 
 BluetoothError Bluez5ProfileSpp::createSkeletonAndExport(std::string uuid, spDeviceInfo &channelInfo)
 {
-	GError *error = nullptr;
 	UNUSED(uuid);
 	std::string objPath = BASE_OBJ_PATH + std::to_string(channelInfo->mChannelId);
 
@@ -620,6 +1735,17 @@ BluetoothError Bluez5ProfileSpp::createSkeletonAndExport(std::string uuid, spDev
 		return BLUETOOTH_ERROR_NOT_READY;
 	}
 
+	BluetoothError error = exportSkeleton(channelInfo, objPath);
+	if (error != BLUETOOTH_ERROR_NONE)
+		deallocateChannelId(channelInfo->mChannelId);
+
+	return error;
+}
+
+BluetoothError Bluez5ProfileSpp::exportSkeleton(spDeviceInfo &channelInfo, const std::string &objPath)
+{
+	GError *error = nullptr;
+
 	channelInfo->mInterface = bluez_profile1_skeleton_new();
 
 	g_signal_connect(channelInfo->mInterface,
@@ -643,13 +1769,14 @@ BluetoothError Bluez5ProfileSpp::createSkeletonAndExport(std::string uuid, spDev
 						objPath.c_str(),
 						&error))
 	{
-		deallocateChannelId(channelInfo->mChannelId);
 		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to export profile on system bus");
 		if (error)
 		{
 			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Error message %s", error->message);
 			g_error_free(error);
 		}
+		g_object_unref(channelInfo->mInterface);
+		channelInfo->mInterface = nullptr;
 		return BLUETOOTH_ERROR_NOT_READY;
 	}
 
@@ -22,10 +22,17 @@
 
 #include <fcntl.h>
 #include <memory>
+#include <list>
+#include <vector>
+#include <functional>
+#include <bitset>
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 #include <sys/socket.h>
 
+#include "bluez5sppfiletransfer.h"
+#include "bluez5sppframer.h"
+
 extern "C" {
 #include "freedesktop-interface.h"
 #include "bluez-interface.h"
@@ -33,6 +40,35 @@ extern "C" {
 
 class Bluez5Adapter;
 class Bluez5ProfileSpp;
+class Bluez5SppIoWorker;
+struct Bluez5SppIoEvent;
+
+#define BLUEZ5_SPP_STATS_HISTOGRAM_BUCKETS    20
+
+struct Bluez5SppChannelStats
+{
+	// when the channel connected or statistics were enabled
+	gint64 startTime;
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint64_t writes;
+	uint64_t writeErrors;
+	// sends the socket took only part of the data of
+	uint64_t shortWrites;
+	uint64_t reads;
+	uint64_t readErrors;
+	// received data the framing couldn't make sense of
+	uint64_t droppedBytes;
+	size_t maxTxQueuedBytes;
+	// time from writeData or sendFile until the callback in microseconds
+	gint64 minWriteLatency;
+	gint64 maxWriteLatency;
+	gint64 totalWriteLatency;
+	// Bucket n counts values from 2^n up to 2^(n+1) - 1, bucket 0 includes
+	// zero and the last bucket everything larger
+	uint64_t writeLatencyHistogram[BLUEZ5_SPP_STATS_HISTOGRAM_BUCKETS];
+	uint64_t readSizeHistogram[BLUEZ5_SPP_STATS_HISTOGRAM_BUCKETS];
+};
 
 class Bluez5ProfileSpp : public Bluez5ProfileBase,
 						 public BluetoothSppProfile
@@ -45,6 +81,8 @@ public:
 		SERVER
 	};
 
+	typedef std::function<void(BluetoothSppChannelId channelId, bool congested)> SppFlowControlCallback;
+
 	Bluez5ProfileSpp(Bluez5Adapter *adapter);
 	~Bluez5ProfileSpp();
 	void getProperties(const std::string &address, BluetoothPropertiesResultCallback  callback);
@@ -54,6 +92,65 @@ public:
 	void connectUuid(const std::string &address, const std::string &uuid, BluetoothChannelResultCallback callback);
 	void disconnectUuid(const BluetoothSppChannelId channelId, BluetoothResultCallback callback);
 	void writeData(const BluetoothSppChannelId channelId, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback);
+	// Data which can't be written right away is queued per channel. Once
+	// more than highWaterMark bytes are queued the channel is reported as
+	// congested and further writes fail with BLUETOOTH_ERROR_BUSY until
+	// the queue drained below lowWaterMark again.
+	void setTxWaterMarks(uint32_t highWaterMark, uint32_t lowWaterMark);
+	// Streams length bytes of a file starting at offset, a length of zero
+	// sends up to the end of the file. The kernel moves the data straight
+	// into the socket where it can. The transfer is queued like writeData
+	// and the callback is called once all of it is written. A passed file
+	// descriptor is duplicated, the caller keeps ownership of it. Only
+	// regular files are accepted.
+	void sendFile(const BluetoothSppChannelId channelId, const std::string &path, uint64_t offset, uint64_t length,
+	              Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback);
+	void sendFile(const BluetoothSppChannelId channelId, int fd, uint64_t offset, uint64_t length,
+	              Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback);
+	// Writes smaller than maxBatchSize are held back for up to maxDelay
+	// milliseconds and sent together with the writes following them. A
+	// delay of zero sends every write right away again. flush() sends
+	// whatever is held back now.
+	BluetoothError setWriteCoalescing(BluetoothSppChannelId channelId, uint32_t maxDelay, uint32_t maxBatchSize);
+	BluetoothError flush(BluetoothSppChannelId channelId);
+	void setFlowControlCallback(SppFlowControlCallback callback) { mFlowControlCallback = callback; }
+
+	bool hasConnection(const std::string &address) const;
+
+	// Received data of a channel is normally passed on as read. With
+	// framing set only whole messages are delivered, several of them per
+	// callback if the framing asks for batching. Changing the framing
+	// drops any partially received message.
+	BluetoothError setFraming(BluetoothSppChannelId channelId, const Bluez5SppFraming &framing);
+	// Statistics are only collected while enabled, a disabled channel
+	// costs one pointer check per read and write, one flag check for
+	// channels served by the worker. With a log interval set
+	// the statistics of all channels are logged every interval seconds.
+	void setStatsEnabled(bool enabled);
+	void setStatsLogInterval(uint32_t interval);
+	bool getChannelStats(BluetoothSppChannelId channelId, Bluez5SppChannelStats &stats) const;
+	// Size of the buffer received data is read into, one buffer is shared
+	// by all channels
+	void setRxBufferSize(uint32_t size);
+	// Moves the socket I/O of channels connected from now on to a worker
+	// thread. Can only be disabled again once no channel uses the worker,
+	// which stops the thread but keeps the worker until the profile goes.
+	bool setIoWorkerEnabled(bool enabled);
+	// Token of the connection on a channel served by the worker, 0 for
+	// any other channel
+	uint64_t getIoToken(BluetoothSppChannelId channelId);
+	// Safe to call from any thread. The connection is identified by its
+	// token so the data never ends up on a later connection reusing the
+	// channel id. The data goes to the worker without passing the main
+	// loop, coalescing and statistics apply just as for writeData. The
+	// callback is called in the main context unless an error is returned.
+	BluetoothError writeWorkerData(uint64_t ioToken, const uint8_t *data, uint32_t size, BluetoothResultCallback callback);
+	// Channel ids of server registrations and of connections, outgoing ones
+	// as well as those accepted by a server, come from separate pools. The
+	// server pool has to stay within the RFCOMM channel range 1-30 as its
+	// ids are registered as RFCOMM channels with bluez.
+	bool setChannelPool(DeviceRole role, BluetoothSppChannelId first, BluetoothSppChannelId last);
+	uint32_t getFreeChannelCount(DeviceRole role) const;
 	BluetoothError createChannel(const std::string &name, const std::string &uuid);
 	BluetoothError removeChannel(const std::string &uuid);
 	gboolean handleNewConnection (GDBusMethodInvocation *invocation, const gchar *device, const GVariant *fd,
@@ -65,6 +162,7 @@ public:
 	static gboolean onHandleNewConnection (BluezProfile1 *interface, GDBusMethodInvocation *invocation, const gchar *device, const GVariant *fd,
 										   const GVariant *fd_props, gpointer user_data);
 	static gboolean ioCallback(GIOChannel * io, GIOCondition condition, gpointer data);
+	static gboolean txCallback(GIOChannel * io, GIOCondition condition, gpointer data);
 	static gboolean onHandleRequestDisconnection (BluezProfile1 *interface, GDBusMethodInvocation *invocation, const gchar *device, gpointer user_data);
 	static gboolean onHandleRelease (BluezProfile1 *interface, GDBusMethodInvocation *invocation, gpointer user_data);
 
@@ -77,13 +175,32 @@ private:
 			, mUuid (uuid)
 			, mChannelId(connectedChannelID)
 			, mDeviceRole(deviceRole)
+			, mInterface(nullptr)
 			, mSppProfile(sppProfile)
 			, mSockfd(-1)
 			, mChannel(nullptr)
 			, mIoWatchId(0)
+			, mTxQueuedBytes(0)
+			, mTxWatchId(0)
+			, mTxCongested(false)
+			, mIoToken(0)
+			, mRegistrationId(0)
+			, mCoalesceDelay(0)
+			, mCoalesceMaxSize(0)
+			, mCoalesceTimeoutId(0)
 		{
 		}
 
+		struct TxBuffer
+		{
+			std::vector<uint8_t> data;
+			size_t offset;
+			BluetoothResultCallback callback;
+			// set instead of data for file transfers
+			std::shared_ptr<Bluez5SppFileTransfer> file;
+			Bluez5SppFileProgressCallback progress;
+		};
+
 		std::string mDeviceAddress;
 		std::string mName;
 		std::string mUuid;
@@ -95,23 +212,103 @@ private:
 		GIOChannel *mChannel;
 		guint mIoWatchId;
 		Bluez5ProfileSpp *mSppProfile;
+		std::list<TxBuffer> mTxQueue;
+		size_t mTxQueuedBytes;
+		guint mTxWatchId;
+		bool mTxCongested;
+		// non-zero while the socket is served by the I/O worker
+		uint64_t mIoToken;
+		// channel id of the Profile1 registration the connection belongs
+		// to, 0 for the registrations themselves
+		BluetoothSppChannelId mRegistrationId;
+		std::unique_ptr<Bluez5SppFramer> mFramer;
+		// write coalescing is off while the delay is zero
+		uint32_t mCoalesceDelay;
+		uint32_t mCoalesceMaxSize;
+		std::vector<uint8_t> mCoalesceBuffer;
+		std::list<BluetoothResultCallback> mCoalesceCallbacks;
+		guint mCoalesceTimeoutId;
+		// only set while statistics are enabled
+		std::unique_ptr<Bluez5SppChannelStats> mStats;
 	};
 	typedef std::unique_ptr<SppDeviceInfo> spDeviceInfo;
 	typedef std::unordered_map<BluetoothSppChannelId, spDeviceInfo> ConnectedDevice;
 
-	BluetoothSppChannelId allocateChannelId();
+	struct ChannelPool
+	{
+		BluetoothSppChannelId first;
+		BluetoothSppChannelId last;
+		// where the next search starts so a freed id isn't handed out
+		// again right away
+		BluetoothSppChannelId next;
+	};
+
+	BluetoothSppChannelId allocateChannelId(DeviceRole role);
 	void deallocateChannelId(BluetoothSppChannelId channelId);
-	void initialiseChannelIds();
 	bool removeConnectedDevice(BluetoothSppChannelId channelId);
 
+	// Pending writes fail only after the socket is marked closed, so their
+	// callbacks may release the record
+	void closeChannelSocket(SppDeviceInfo *deviceInfo);
+	// Closes the socket, tells the observer if asked to and releases the
+	// connection unless a callback did so already
+	void closeConnection(SppDeviceInfo *connection, bool notify);
+	SppDeviceInfo* acceptConnection(SppDeviceInfo *server);
+	void releaseConnection(SppDeviceInfo *deviceInfo);
+	SppDeviceInfo* findConnection(BluetoothSppChannelId registrationId, const std::string &address);
+
+	// Outgoing connections share one Profile1 registration per UUID which
+	// is kept once registered
+	struct ClientRegistration
+	{
+		BluetoothSppChannelId channelId;
+		bool registered;
+		std::list<BluetoothResultCallback> pendingCallbacks;
+	};
+
+	void acquireClientRegistration(const std::string &uuid, BluetoothResultCallback callback);
+	GVariant* buildProfileParameters(SppDeviceInfo *deviceInfo, const std::string &objPath);
+	void registerProfileAsync(SppDeviceInfo *deviceInfo, const std::string &objPath, BluetoothResultCallback callback);
+	BluetoothError exportSkeleton(spDeviceInfo &channelInfo, const std::string &objPath);
+	void handlePeerClosed(SppDeviceInfo *deviceInfo);
+
+	void handleIoEvent(const Bluez5SppIoEvent &event);
+	void deliverRxData(SppDeviceInfo *deviceInfo, const uint8_t *data, size_t size);
+	BluetoothResultCallback trackWrite(SppDeviceInfo *deviceInfo, uint64_t size, BluetoothResultCallback callback);
+	BluetoothResultCallback trackWorkerWrite(uint64_t ioToken, uint64_t size, BluetoothResultCallback callback);
+	SppDeviceInfo* findDeviceByIoToken(uint64_t ioToken);
+	void logChannelStats(SppDeviceInfo *deviceInfo);
+	static gboolean handleStatsLogTimeout(gpointer user_data);
+
+	void sendFileDescriptor(const BluetoothSppChannelId channelId, int fd, uint64_t offset, uint64_t length,
+	                        Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback);
+	void submitData(SppDeviceInfo *deviceInfo, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback);
+	void coalesceData(SppDeviceInfo *deviceInfo, const uint8_t *data, const uint32_t size, BluetoothResultCallback callback);
+	void flushCoalescedData(SppDeviceInfo *deviceInfo);
+	static gboolean handleCoalesceTimeout(gpointer user_data);
+	void processTxQueue(SppDeviceInfo *deviceInfo);
+	// Empties the queue without calling anyone back, the callbacks of all
+	// queued and held back writes are handed out instead
+	void detachTxQueue(SppDeviceInfo *deviceInfo, std::list<BluetoothResultCallback> &callbacks);
+	void updateTxCongestion(SppDeviceInfo *deviceInfo);
+
 	SppDeviceInfo* getSppDevice(const BluetoothSppChannelId channelId);
-	SppDeviceInfo* getSppDevice(const std::string &uuid);
+	SppDeviceInfo* getSppServer(const std::string &uuid);
 
 	Bluez5Adapter *mAdapter;
 	GDBusConnection *mConn;
 
 	ConnectedDevice mConnectedDevices;
-	std::unordered_map<BluetoothSppChannelId, bool> mChannelIdList;
+	std::unordered_map<std::string, ClientRegistration> mClientRegistrations;
+	ChannelPool mChannelPools[2];
+	std::bitset<256> mChannelsInUse;
+	uint32_t mTxHighWaterMark;
+	uint32_t mTxLowWaterMark;
+	SppFlowControlCallback mFlowControlCallback;
+	std::vector<uint8_t> mRxBuffer;
+	Bluez5SppIoWorker *mIoWorker;
+	bool mStatsEnabled;
+	guint mStatsLogSource;
 
 public:
 	int registerProfile(spDeviceInfo &deviceInfo, std::string objPath, BluezProfileManager1 *proxy);
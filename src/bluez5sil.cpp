@@ -41,7 +41,8 @@ Bluez5SIL::Bluez5SIL(BluetoothPairingIOCapability capability) :
 	mAgent(0),
 	mBleAdvertise(0),
 	mCapability(capability),
-	mGattManager(0)
+	mGattManager(0),
+	mPairingPolicy(0)
 {
 }
 
@@ -75,16 +76,24 @@ void Bluez5SIL::handleBluezServiceStarted(GDBusConnection *conn, const gchar *na
 
 	g_signal_connect(sil->mObjectManager, "object-added", G_CALLBACK(handleObjectAdded), sil);
 	g_signal_connect(sil->mObjectManager, "object-removed", G_CALLBACK(handleObjectRemoved), sil);
+	g_signal_connect(sil->mObjectManager, "interface-proxy-properties-changed",
+	                 G_CALLBACK(handleInterfacePropertiesChanged), sil);
 
 	GList *objects = g_dbus_object_manager_get_objects(sil->mObjectManager);
 
 	/*Objects may come in any order, first device object then adapter so
 	 better to traverse all objects to adapter then other interfaces*/
 
-	GDBusObject* adapterObject = findInterface(objects, "org.bluez.Adapter1");
-	if (adapterObject)
+	for (int n = 0; n < g_list_length(objects); n++)
 	{
-		sil->createAdapter(std::string(g_dbus_object_get_object_path(adapterObject)));
+		auto object = static_cast<GDBusObject*>(g_list_nth(objects, n)->data);
+
+		auto adapterInterface = g_dbus_object_get_interface(object, "org.bluez.Adapter1");
+		if (adapterInterface)
+		{
+			sil->createAdapter(std::string(g_dbus_object_get_object_path(object)));
+			g_object_unref(adapterInterface);
+		}
 	}
 
 	GDBusObject* agentManagerObject = findInterface(objects, "org.bluez.AgentManager1");
@@ -187,6 +196,22 @@ void Bluez5SIL::handleObjectAdded(GDBusObjectManager *objectManager, GDBusObject
 	}
 }
 
+void Bluez5SIL::handleInterfacePropertiesChanged(GDBusObjectManagerClient *objectManager, GDBusObjectProxy *objectProxy,
+                                                 GDBusProxy *interfaceProxy, GVariant *changedProperties,
+                                                 const gchar *const *invalidatedProperties, void *user_data)
+{
+	Bluez5SIL *sil = static_cast<Bluez5SIL*>(user_data);
+
+	if (g_strcmp0(g_dbus_proxy_get_interface_name(interfaceProxy), "org.bluez.Device1") != 0)
+		return;
+
+	// A device evicted without removing it from bluez is never announced
+	// again, so it comes back with the first update bluez sends for it
+	std::string objectPath = g_dbus_object_get_object_path(G_DBUS_OBJECT(objectProxy));
+	if (!sil->findDeviceByObjectPath(objectPath))
+		sil->createDevice(objectPath);
+}
+
 void Bluez5SIL::handleObjectRemoved(GDBusObjectManager *objectManager, GDBusObject *object, void *user_data)
 {
 	Bluez5SIL *sil = static_cast<Bluez5SIL*>(user_data);
@@ -241,7 +266,7 @@ void Bluez5SIL::createAdapter(const std::string &objectPath)
 {
 	DEBUG("New adapter on path %s", objectPath.c_str());
 
-	Bluez5Adapter *adapter = new Bluez5Adapter(std::string(objectPath));
+	Bluez5Adapter *adapter = new Bluez5Adapter(std::string(objectPath), this);
 	mAdapters.push_back(adapter);
 
 	assignNewDefaultAdapter();
@@ -274,6 +299,11 @@ void Bluez5SIL::removeAdapter(const std::string &objectPath)
 				mDefaultAdapter = 0;
 
 			mAdapters.remove(adapter);
+
+			// LE scans may have been placed across adapters
+			for (auto other : mAdapters)
+				other->dropLeScansForAdapter(adapter);
+
 			delete adapter;
 
 			break;
@@ -298,6 +328,118 @@ Bluez5Adapter* Bluez5SIL::findAdapterForObjectPath(const std::string &objectPath
 	return 0;
 }
 
+Bluez5Adapter* Bluez5SIL::selectAdapter()
+{
+	Bluez5Adapter *selected = 0;
+
+	for (auto adapter : mAdapters)
+	{
+		if (!adapter->getPowered())
+			continue;
+
+		if (!selected || adapter->getLoad() < selected->getLoad())
+			selected = adapter;
+	}
+
+	return selected ? selected : mDefaultAdapter;
+}
+
+Bluez5Adapter* Bluez5SIL::findAdapterForDevice(const std::string &address)
+{
+	for (auto adapter : mAdapters)
+	{
+		Bluez5Device *device = adapter->findDevice(address);
+		if (device && device->getConnected())
+			return adapter;
+	}
+
+	return 0;
+}
+
+static bool isBonded(Bluez5Device *device)
+{
+	return device->getPaired() || device->getTrusted();
+}
+
+Bluez5Device* Bluez5SIL::routeDevice(const std::string &address, Bluez5Adapter *preferred)
+{
+	Bluez5Adapter *owner = findAdapterForDevice(address);
+	if (owner)
+		return owner->findDevice(address);
+
+	Bluez5Device *known = preferred ? preferred->findDevice(address) : 0;
+
+	// The keys of a bond live on one controller only, so a bonded device
+	// has to go through the adapter it was paired with
+	if (known && isBonded(known))
+		return known;
+
+	for (auto adapter : mAdapters)
+	{
+		Bluez5Device *device = adapter->findDevice(address);
+		if (device && isBonded(device))
+			return device;
+	}
+
+	// Only unbonded LE devices are spread over the adapters, anything else
+	// stays with the adapter it was asked for
+	if (known && known->getType() != BLUETOOTH_DEVICE_TYPE_BLE)
+		return known;
+
+	// Pick the least loaded powered adapter which has seen the device. On
+	// equal load we stay with the preferred one.
+	Bluez5Device *selected = 0;
+	uint32_t selectedLoad = 0;
+
+	if (known && preferred->getPowered())
+	{
+		selected = known;
+		selectedLoad = preferred->getLoad();
+	}
+
+	for (auto adapter : mAdapters)
+	{
+		if (adapter == preferred || !adapter->getPowered())
+			continue;
+
+		Bluez5Device *device = adapter->findDevice(address);
+		if (!device || device->getType() != BLUETOOTH_DEVICE_TYPE_BLE)
+			continue;
+
+		uint32_t load = adapter->getLoad();
+		if (!selected || load < selectedLoad)
+		{
+			selected = device;
+			selectedLoad = load;
+		}
+	}
+
+	if (selected)
+		return selected;
+
+	if (known)
+		return known;
+
+	// Not seen by the preferred adapter at all, take whichever has
+	for (auto adapter : mAdapters)
+	{
+		Bluez5Device *device = adapter->findDevice(address);
+		if (device)
+			return device;
+	}
+
+	return 0;
+}
+
+Bluez5Device* Bluez5SIL::findDeviceByObjectPath(const std::string &objectPath)
+{
+	auto adapter = findAdapterForObjectPath(objectPath);
+	if (!adapter)
+		return 0;
+
+	return adapter->findDeviceByObjectPath(objectPath);
+}
+
 void Bluez5SIL::createDevice(const std::string &objectPath)
 {
 	DEBUG("New device on path %s", objectPath.c_str());
@@ -336,6 +478,7 @@ void Bluez5SIL::createAgentManager(const std::string &objectPath)
 	}
 
 	mAgent = new Bluez5Agent(mAgentManager, this);
+	mAgent->setPairingPolicy(mPairingPolicy);
 
 	for (auto adapter : mAdapters)
 		adapter->assignAgent(mAgent);
@@ -466,6 +609,14 @@ void Bluez5SIL::connectWithBluez()
 					 handleBluezServiceStarted, handleBluezServiceStopped, this, NULL);
 }
 
+void Bluez5SIL::setPairingPolicy(Bluez5PairingPolicy *policy)
+{
+	mPairingPolicy = policy;
+
+	if (mAgent)
+		mAgent->setPairingPolicy(policy);
+}
+
 BluetoothAdapter* Bluez5SIL::getDefaultAdapter()
 {
 	return mDefaultAdapter;
@@ -29,8 +29,10 @@ extern "C" {
 }
 
 class Bluez5Adapter;
+class Bluez5Device;
 class Bluez5Agent;
 class Bluez5Advertise;
+class Bluez5PairingPolicy;
 
 class Bluez5SIL : public BluetoothSIL
 {
@@ -41,8 +43,21 @@ public:
 	BluetoothAdapter* getDefaultAdapter();
 	std::vector<BluetoothAdapter*> getAdapters();
 	Bluez5Adapter* getDefaultBluez5Adapter() { return mDefaultAdapter; }
+
+	// Adapter pool. New connections and LE scans are spread over all powered
+	// adapters by their current load while a connected device stays with
+	// the adapter it is connected through. Bonded devices always use the
+	// adapter holding the bond and only unbonded LE devices are balanced.
+	Bluez5Adapter* selectAdapter();
+	Bluez5Adapter* findAdapterForDevice(const std::string &address);
+	Bluez5Device* routeDevice(const std::string &address, Bluez5Adapter *preferred);
+	Bluez5Device* findDeviceByObjectPath(const std::string &objectPath);
 	BluetoothPairingIOCapability getCapability() { return mCapability; }
 
+	// Lets the agent answer pairing requests without asking the observer.
+	// Pass 0 to go back to asking for every request.
+	void setPairingPolicy(Bluez5PairingPolicy *policy);
+
 	static void handleBluezServiceStarted(GDBusConnection *conn, const gchar *name,
 										  const gchar *nameOwner, gpointer user_data);
 	static void handleBluezServiceStopped(GDBusConnection *conn, const gchar *name,
@@ -50,6 +65,9 @@ public:
 
 	static void handleObjectAdded(GDBusObjectManager *objectManager, GDBusObject *object, void *user_data);
 	static void handleObjectRemoved(GDBusObjectManager *objectManager, GDBusObject *object, void *user_data);
+	static void handleInterfacePropertiesChanged(GDBusObjectManagerClient *objectManager, GDBusObjectProxy *objectProxy,
+	                                             GDBusProxy *interfaceProxy, GVariant *changedProperties,
+	                                             const gchar *const *invalidatedProperties, void *user_data);
 
 	static GDBusObject* findInterface(GList* objects, const gchar *interface);
 
@@ -83,6 +101,7 @@ private:
 	Bluez5Agent *mAgent;
 	Bluez5Advertise *mBleAdvertise;
 	BluetoothPairingIOCapability mCapability;
+	Bluez5PairingPolicy *mPairingPolicy;
 };
 
 
@@ -0,0 +1,182 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "bluez5sppfiletransfer.h"
+#include "logging.h"
+
+#define BLUEZ5_SPP_FILE_CHUNK_SIZE    (64 * 1024)
+
+Bluez5SppFileTransfer::Bluez5SppFileTransfer(int fd, uint64_t offset, uint64_t length) :
+	mFd(fd),
+	mOffset(offset),
+	mLength(length),
+	mSent(0),
+	mUseSendfile(true),
+	mBufferOffset(0),
+	mBufferLength(0)
+{
+}
+
+// Unlike send() sendfile() has no MSG_NOSIGNAL, so SIGPIPE is blocked
+// for the calling thread and a signal the call raised is consumed before
+// it could be delivered and kill the process.
+class SigpipeBlocker
+{
+public:
+	SigpipeBlocker() :
+		mWasPending(false)
+	{
+		sigemptyset(&mSigpipe);
+		sigaddset(&mSigpipe, SIGPIPE);
+
+		sigset_t pending;
+		sigemptyset(&pending);
+		if (sigpending(&pending) == 0)
+			mWasPending = sigismember(&pending, SIGPIPE) == 1;
+
+		pthread_sigmask(SIG_BLOCK, &mSigpipe, &mOldMask);
+	}
+
+	~SigpipeBlocker()
+	{
+		int savedErrno = errno;
+
+		// Only a signal raised by us is ours to take
+		if (!mWasPending)
+		{
+			struct timespec timeout = { 0, 0 };
+			while (sigtimedwait(&mSigpipe, NULL, &timeout) < 0 && errno == EINTR)
+				;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &mOldMask, NULL);
+
+		errno = savedErrno;
+	}
+
+private:
+	sigset_t mSigpipe;
+	sigset_t mOldMask;
+	bool mWasPending;
+};
+
+Bluez5SppFileTransfer::~Bluez5SppFileTransfer()
+{
+	if (mFd >= 0)
+		close(mFd);
+}
+
+bool Bluez5SppFileTransfer::send(int sockfd)
+{
+	while (mUseSendfile && !isComplete())
+	{
+		off_t position = mOffset + mSent;
+		uint64_t remaining = mLength - mSent;
+		size_t count = remaining < BLUEZ5_SPP_FILE_CHUNK_SIZE ? remaining : BLUEZ5_SPP_FILE_CHUNK_SIZE;
+
+		ssize_t written;
+		{
+			SigpipeBlocker blocker;
+			written = sendfile(sockfd, mFd, &position, count);
+		}
+
+		if (written > 0)
+		{
+			mSent += written;
+			continue;
+		}
+
+		if (written == 0)
+		{
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "File ended %llu bytes early", (unsigned long long) remaining);
+			errno = EIO;
+			return false;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return true;
+
+		if (errno != EINVAL && errno != ENOSYS)
+			return false;
+
+		DEBUG("sendfile not supported, copying file data");
+		mUseSendfile = false;
+	}
+
+	if (isComplete())
+		return true;
+
+	return sendCopy(sockfd);
+}
+
+bool Bluez5SppFileTransfer::sendCopy(int sockfd)
+{
+	if (mBuffer.empty())
+		mBuffer.resize(BLUEZ5_SPP_FILE_CHUNK_SIZE);
+
+	while (!isComplete())
+	{
+		if (mBufferOffset == mBufferLength)
+		{
+			uint64_t remaining = mLength - mSent;
+			size_t count = remaining < mBuffer.size() ? remaining : mBuffer.size();
+
+			ssize_t bytesRead = pread(mFd, mBuffer.data(), count, mOffset + mSent);
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+
+			if (bytesRead < 0)
+				return false;
+
+			if (bytesRead == 0)
+			{
+				ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "File ended %llu bytes early", (unsigned long long) remaining);
+				errno = EIO;
+				return false;
+			}
+
+			mBufferOffset = 0;
+			mBufferLength = bytesRead;
+		}
+
+		ssize_t written = ::send(sockfd, mBuffer.data() + mBufferOffset, mBufferLength - mBufferOffset, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			return false;
+		}
+
+		mBufferOffset += written;
+		mSent += written;
+	}
+
+	return true;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BLUEZ5SPPFILETRANSFER_H
+#define BLUEZ5SPPFILETRANSFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+#include <functional>
+
+typedef std::function<void(uint64_t bytesSent, uint64_t totalBytes)> Bluez5SppFileProgressCallback;
+
+// Streams a range of a file into a non-blocking socket. The data is moved
+// by the kernel with sendfile where possible and only read into a buffer
+// if the file or socket don't support that.
+class Bluez5SppFileTransfer
+{
+public:
+	// Takes ownership of fd
+	Bluez5SppFileTransfer(int fd, uint64_t offset, uint64_t length);
+	~Bluez5SppFileTransfer();
+
+	// Writes until the socket is full or everything is sent. Returns false
+	// with errno set if the transfer failed, a closed peer gives EPIPE
+	// without raising SIGPIPE.
+	bool send(int sockfd);
+
+	bool isComplete() const { return mSent == mLength; }
+	uint64_t getBytesSent() const { return mSent; }
+	uint64_t getLength() const { return mLength; }
+
+private:
+	bool sendCopy(int sockfd);
+
+	int mFd;
+	uint64_t mOffset;
+	uint64_t mLength;
+	uint64_t mSent;
+	bool mUseSendfile;
+	// read from the file but not yet accepted by the socket
+	std::vector<uint8_t> mBuffer;
+	size_t mBufferOffset;
+	size_t mBufferLength;
+};
+
+#endif // BLUEZ5SPPFILETRANSFER_H
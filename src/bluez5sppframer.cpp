@@ -0,0 +1,238 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <string.h>
+
+#include "bluez5sppframer.h"
+#include "logging.h"
+
+#define BLUEZ5_SPP_FRAMER_MAX_MESSAGE_SIZE    (64 * 1024)
+
+Bluez5SppFramer::Bluez5SppFramer(const Bluez5SppFraming &framing) :
+	mFraming(framing),
+	// Whatever is left after extracting is shorter than a message, so
+	// with room for two there is always space for at least one more
+	mRing(2 * (size_t) framing.maxMessageSize),
+	mHead(0),
+	mLength(0),
+	mScanned(0),
+	mDiscarding(false),
+	mDroppedBytes(0)
+{
+}
+
+bool Bluez5SppFramer::isValid(const Bluez5SppFraming &framing)
+{
+	if (!framing.maxMessageSize || framing.maxMessageSize > BLUEZ5_SPP_FRAMER_MAX_MESSAGE_SIZE)
+		return false;
+
+	switch (framing.mode)
+	{
+	case Bluez5SppFraming::LENGTH_PREFIXED:
+		return (framing.lengthFieldSize == 1 || framing.lengthFieldSize == 2 || framing.lengthFieldSize == 4) &&
+		       framing.lengthFieldSize < framing.maxMessageSize;
+	case Bluez5SppFraming::DELIMITER:
+		return !framing.delimiter.empty() && framing.delimiter.size() <= framing.maxMessageSize;
+	case Bluez5SppFraming::FIXED_SIZE:
+		return framing.messageSize && framing.messageSize <= framing.maxMessageSize;
+	default:
+		return false;
+	}
+}
+
+void Bluez5SppFramer::consume(const uint8_t *data, size_t size, std::list<std::vector<uint8_t>> &messages)
+{
+	while (size)
+	{
+		size_t count = mRing.size() - mLength;
+		if (count > size)
+			count = size;
+
+		append(data, count);
+		data += count;
+		size -= count;
+
+		extract(messages);
+	}
+}
+
+void Bluez5SppFramer::reset()
+{
+	mHead = 0;
+	mLength = 0;
+	mScanned = 0;
+	mDiscarding = false;
+}
+
+void Bluez5SppFramer::append(const uint8_t *data, size_t size)
+{
+	size_t tail = (mHead + mLength) % mRing.size();
+	size_t first = mRing.size() - tail;
+	if (first > size)
+		first = size;
+
+	memcpy(mRing.data() + tail, data, first);
+	memcpy(mRing.data(), data + first, size - first);
+
+	mLength += size;
+}
+
+void Bluez5SppFramer::extract(std::list<std::vector<uint8_t>> &messages)
+{
+	std::vector<uint8_t> batch;
+
+	while (true)
+	{
+		ssize_t messageSize = nextMessageSize();
+		if (messageSize == 0)
+			break;
+
+		if (messageSize < 0)
+		{
+			size_t dropSize = discardSize();
+
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Dropping %zu bytes which can't be framed", dropSize);
+			drop(dropSize);
+			continue;
+		}
+
+		if (mFraming.batch)
+		{
+			take(messageSize, batch);
+		}
+		else
+		{
+			messages.push_back(std::vector<uint8_t>());
+			take(messageSize, messages.back());
+		}
+	}
+
+	if (!batch.empty())
+	{
+		messages.push_back(std::vector<uint8_t>());
+		messages.back().swap(batch);
+	}
+}
+
+ssize_t Bluez5SppFramer::nextMessageSize()
+{
+	size_t messageSize = 0;
+
+	switch (mFraming.mode)
+	{
+	case Bluez5SppFraming::LENGTH_PREFIXED:
+	{
+		if (mLength < mFraming.lengthFieldSize)
+			return 0;
+
+		size_t payloadSize = 0;
+		for (size_t n = 0; n < mFraming.lengthFieldSize; n++)
+		{
+			size_t index = mFraming.littleEndian ? mFraming.lengthFieldSize - 1 - n : n;
+			payloadSize = (payloadSize << 8) | at(index);
+		}
+
+		// Checked before adding up as a 4 byte length may wrap a 32 bit
+		// size_t. isValid keeps the length field below the maximum.
+		if (payloadSize > mFraming.maxMessageSize - mFraming.lengthFieldSize)
+			return -1;
+
+		messageSize = mFraming.lengthFieldSize + payloadSize;
+
+		return mLength < messageSize ? 0 : messageSize;
+	}
+	case Bluez5SppFraming::DELIMITER:
+	{
+		messageSize = findDelimiter();
+
+		// Whatever is left of an oversized message goes as soon as
+		// there is something to drop
+		if (mDiscarding)
+			return messageSize || mLength >= mFraming.delimiter.size() ? -1 : 0;
+
+		if (messageSize)
+			return messageSize > mFraming.maxMessageSize ? -1 : messageSize;
+
+		return mLength >= mFraming.maxMessageSize ? -1 : 0;
+	}
+	case Bluez5SppFraming::FIXED_SIZE:
+		return mLength < mFraming.messageSize ? 0 : mFraming.messageSize;
+	default:
+		return -1;
+	}
+}
+
+size_t Bluez5SppFramer::findDelimiter()
+{
+	const std::vector<uint8_t> &delimiter = mFraming.delimiter;
+
+	for (size_t start = mScanned; start + delimiter.size() <= mLength; start++)
+	{
+		size_t n = 0;
+		while (n < delimiter.size() && at(start + n) == delimiter[n])
+			n++;
+
+		if (n == delimiter.size())
+			return start + delimiter.size();
+	}
+
+	if (mLength >= delimiter.size())
+		mScanned = mLength - delimiter.size() + 1;
+
+	return 0;
+}
+
+size_t Bluez5SppFramer::discardSize()
+{
+	// Past a bad length field nothing can be trusted anymore
+	if (mFraming.mode != Bluez5SppFraming::DELIMITER)
+		return mLength;
+
+	// With a delimiter framing picks up again right after the next one
+	size_t end = findDelimiter();
+	if (end)
+	{
+		mDiscarding = false;
+		return end;
+	}
+
+	// The oversized message continues, keep what may be the start of
+	// its delimiter
+	mDiscarding = true;
+	return mLength - (mFraming.delimiter.size() - 1);
+}
+
+void Bluez5SppFramer::take(size_t size, std::vector<uint8_t> &out)
+{
+	size_t first = mRing.size() - mHead;
+	if (first > size)
+		first = size;
+
+	out.insert(out.end(), mRing.begin() + mHead, mRing.begin() + mHead + first);
+	out.insert(out.end(), mRing.begin(), mRing.begin() + (size - first));
+
+	mHead = (mHead + size) % mRing.size();
+	mLength -= size;
+	mScanned = 0;
+}
+
+void Bluez5SppFramer::drop(size_t size)
+{
+	mHead = (mHead + size) % mRing.size();
+	mLength -= size;
+	mScanned = 0;
+	mDroppedBytes += size;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BLUEZ5SPPFRAMER_H
+#define BLUEZ5SPPFRAMER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <list>
+#include <vector>
+
+struct Bluez5SppFraming
+{
+	enum Mode
+	{
+		NONE,
+		// a big or little endian length field of 1, 2 or 4 bytes
+		// followed by that many bytes of payload
+		LENGTH_PREFIXED,
+		// everything up to and including the delimiter
+		DELIMITER,
+		FIXED_SIZE
+	};
+
+	Bluez5SppFraming() :
+		mode(NONE),
+		lengthFieldSize(2),
+		littleEndian(false),
+		messageSize(0),
+		maxMessageSize(4096),
+		batch(true)
+	{
+	}
+
+	Mode mode;
+	uint8_t lengthFieldSize;
+	bool littleEndian;
+	std::vector<uint8_t> delimiter;
+	uint32_t messageSize;
+	// larger messages are treated as a framing error, at most 64KiB
+	uint32_t maxMessageSize;
+	// deliver all messages completed by one read with a single callback
+	bool batch;
+};
+
+// Reassembles received data into whole messages. Messages are handed out
+// as they were received, length field or delimiter included, so batches
+// of several messages can still be split by the receiver.
+class Bluez5SppFramer
+{
+public:
+	Bluez5SppFramer(const Bluez5SppFraming &framing);
+
+	static bool isValid(const Bluez5SppFraming &framing);
+
+	// Appends received data and moves everything which completed a
+	// message to messages
+	void consume(const uint8_t *data, size_t size, std::list<std::vector<uint8_t>> &messages);
+	void reset();
+
+	size_t getBufferedBytes() const { return mLength; }
+	uint64_t getDroppedBytes() const { return mDroppedBytes; }
+
+private:
+	void append(const uint8_t *data, size_t size);
+	void extract(std::list<std::vector<uint8_t>> &messages);
+	// Size of the first buffered message, 0 if it isn't complete yet and
+	// -1 if the data can't be framed
+	ssize_t nextMessageSize();
+	// Offset right behind the first buffered delimiter, 0 if there is none
+	size_t findDelimiter();
+	size_t discardSize();
+	void take(size_t size, std::vector<uint8_t> &out);
+	void drop(size_t size);
+	uint8_t at(size_t index) const { return mRing[(mHead + index) % mRing.size()]; }
+
+	Bluez5SppFraming mFraming;
+	std::vector<uint8_t> mRing;
+	size_t mHead;
+	size_t mLength;
+	// bytes already searched for the delimiter
+	size_t mScanned;
+	// the rest of an oversized message is still being received
+	bool mDiscarding;
+	uint64_t mDroppedBytes;
+};
+
+#endif // BLUEZ5SPPFRAMER_H
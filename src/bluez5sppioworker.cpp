@@ -0,0 +1,906 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "bluez5sppioworker.h"
+#include "logging.h"
+
+#define BLUEZ5_SPP_IO_MAX_EVENTS    16
+#define BLUEZ5_SPP_IO_WAKE_KEY      0
+
+Bluez5SppIoWorker::Bluez5SppIoWorker(EventHandler handler, uint32_t rxBufferSize) :
+	mHandler(handler),
+	mContext(g_main_context_ref_thread_default()),
+	mEpollFd(-1),
+	mWakeFd(-1),
+	mRunning(false),
+	mTxHighWaterMark(G_MAXUINT32),
+	mTxLowWaterMark(G_MAXUINT32),
+	mStatsEnabled(false),
+	mRxBuffer(rxBufferSize),
+	mAccepting(false),
+	mStopping(false),
+	mThreadExited(false),
+	mNextToken(1),
+	mCommandSeq(0),
+	mCommandsDoneSeq(0),
+	mEventHead(new EventNode),
+	mEventTail(mEventHead),
+	mDispatchPending(false),
+	mDispatchSource(0)
+{
+	mEventHead->next = nullptr;
+}
+
+Bluez5SppIoWorker::~Bluez5SppIoWorker()
+{
+	stop();
+
+	if (mDispatchPending)
+	{
+		GSource *source = g_main_context_find_source_by_id(mContext, mDispatchSource);
+		if (source)
+			g_source_destroy(source);
+		mDispatchPending = false;
+	}
+
+	// Nobody may be left waiting for a write to complete
+	Bluez5SppIoEvent event;
+	while (takeEvent(event))
+	{
+		if (event.type == Bluez5SppIoEvent::WRITE_DONE)
+			mHandler(event);
+	}
+
+	delete mEventHead;
+
+	g_main_context_unref(mContext);
+}
+
+bool Bluez5SppIoWorker::start()
+{
+	if (mRunning)
+		return true;
+
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	mWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (mEpollFd < 0 || mWakeFd < 0)
+	{
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to set up SPP I/O worker: %s", strerror(errno));
+		stop();
+		return false;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u64 = BLUEZ5_SPP_IO_WAKE_KEY;
+	epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &event);
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		mAccepting = true;
+		mStopping = false;
+		mThreadExited = false;
+	}
+
+	mThread = std::thread(&Bluez5SppIoWorker::run, this);
+	mRunning = true;
+
+	return true;
+}
+
+void Bluez5SppIoWorker::stop()
+{
+	if (mRunning)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mCommandMutex);
+			mAccepting = false;
+			mStopping = true;
+			wake();
+		}
+
+		mThread.join();
+		mRunning = false;
+	}
+
+	// The I/O thread is gone, whatever it left behind is ours now
+	failCommands();
+
+	std::list<uint64_t> tokens;
+	for (auto &channel : mChannels)
+		tokens.push_back(channel.first);
+
+	for (auto token : tokens)
+		closeChannel(token, false);
+
+	// Writers wake the thread with the lock held so none of them can be
+	// left with a closed descriptor
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		mTokens.clear();
+
+		if (mWakeFd >= 0)
+		{
+			close(mWakeFd);
+			mWakeFd = -1;
+		}
+	}
+
+	if (mEpollFd >= 0)
+	{
+		close(mEpollFd);
+		mEpollFd = -1;
+	}
+}
+
+uint64_t Bluez5SppIoWorker::addChannel(BluetoothSppChannelId channelId, int fd)
+{
+	Command command;
+	command.type = Command::ADD;
+	command.channelId = channelId;
+	command.fd = fd;
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+
+		if (!mAccepting)
+			return 0;
+
+		command.token = mNextToken++;
+		mTokens[command.token] = false;
+		mCommands.push_back(command);
+		mCommandSeq++;
+		wake();
+	}
+
+	return command.token;
+}
+
+void Bluez5SppIoWorker::removeChannel(uint64_t token)
+{
+	Command command;
+	command.type = Command::REMOVE;
+	command.token = token;
+
+	uint64_t seq = submitCommand(command);
+	if (!seq)
+		return;
+
+	// The socket is the caller's again once the I/O thread got to the
+	// command
+	std::unique_lock<std::mutex> lock(mCommandMutex);
+	while (mCommandsDoneSeq < seq && !mThreadExited)
+		mCommandsDone.wait(lock);
+}
+
+BluetoothError Bluez5SppIoWorker::write(uint64_t token, const uint8_t *data, uint32_t size,
+                                        BluetoothResultCallback callback)
+{
+	Command command;
+	command.type = Command::WRITE;
+	command.token = token;
+	command.buffer.data.assign(data, data + size);
+	command.buffer.offset = 0;
+	command.buffer.callback = callback;
+
+	return submitWrite(command);
+}
+
+BluetoothError Bluez5SppIoWorker::sendFile(uint64_t token, std::shared_ptr<Bluez5SppFileTransfer> file,
+                                           Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback)
+{
+	Command command;
+	command.type = Command::WRITE;
+	command.token = token;
+	command.buffer.offset = 0;
+	command.buffer.callback = callback;
+	command.buffer.file = file;
+	command.buffer.progress = progress;
+
+	return submitWrite(command);
+}
+
+void Bluez5SppIoWorker::setWriteCoalescing(uint64_t token, uint32_t maxDelay, uint32_t maxBatchSize)
+{
+	Command command;
+	command.type = Command::COALESCE;
+	command.token = token;
+	command.coalesceDelay = maxDelay;
+	command.coalesceMaxSize = maxBatchSize;
+
+	submitCommand(command);
+}
+
+void Bluez5SppIoWorker::flush(uint64_t token)
+{
+	Command command;
+	command.type = Command::FLUSH;
+	command.token = token;
+
+	submitCommand(command);
+}
+
+void Bluez5SppIoWorker::setTxWaterMarks(uint32_t highWaterMark, uint32_t lowWaterMark)
+{
+	mTxHighWaterMark = highWaterMark;
+	mTxLowWaterMark = lowWaterMark;
+}
+
+uint64_t Bluez5SppIoWorker::submitCommand(Command &command)
+{
+	uint64_t seq;
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+
+		if (!mAccepting || mTokens.find(command.token) == mTokens.end())
+			return 0;
+
+		// Writes fail right away from now on
+		if (command.type == Command::REMOVE)
+			mTokens.erase(command.token);
+
+		mCommands.push_back(command);
+		seq = ++mCommandSeq;
+		wake();
+	}
+
+	return seq;
+}
+
+BluetoothError Bluez5SppIoWorker::submitWrite(Command &command)
+{
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+
+		auto tokenIter = mTokens.find(command.token);
+		if (!mAccepting || tokenIter == mTokens.end())
+			return BLUETOOTH_ERROR_FAIL;
+
+		if (tokenIter->second)
+			return BLUETOOTH_ERROR_BUSY;
+
+		mCommands.push_back(std::move(command));
+		mCommandSeq++;
+		wake();
+	}
+
+	return BLUETOOTH_ERROR_NONE;
+}
+
+void Bluez5SppIoWorker::wake()
+{
+	uint64_t value = 1;
+	if (::write(mWakeFd, &value, sizeof(value)) < 0)
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to wake SPP I/O worker: %s", strerror(errno));
+}
+
+void Bluez5SppIoWorker::run()
+{
+	struct epoll_event events[BLUEZ5_SPP_IO_MAX_EVENTS];
+
+	while (true)
+	{
+		int count = epoll_wait(mEpollFd, events, BLUEZ5_SPP_IO_MAX_EVENTS, nextCoalesceTimeout());
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "SPP I/O worker failed to wait for events: %s", strerror(errno));
+			break;
+		}
+
+		bool woken = false;
+		for (int n = 0; n < count; n++)
+		{
+			if (events[n].data.u64 != BLUEZ5_SPP_IO_WAKE_KEY)
+				continue;
+
+			uint64_t value;
+			if (read(mWakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+				ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to read wakeup: %s", strerror(errno));
+			woken = true;
+		}
+
+		// Commands go first so no I/O is done for removed channels
+		if (woken && !processCommands())
+			break;
+
+		for (int n = 0; n < count; n++)
+		{
+			if (events[n].data.u64 != BLUEZ5_SPP_IO_WAKE_KEY)
+				handleChannelEvents(events[n].data.u64, events[n].events);
+		}
+
+		handleCoalesceTimeouts();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		mThreadExited = true;
+	}
+
+	mCommandsDone.notify_all();
+}
+
+bool Bluez5SppIoWorker::processCommands()
+{
+	std::list<Command> commands;
+	uint64_t seq;
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+
+		// Left to stop() to fail
+		if (mStopping)
+			return false;
+
+		commands.swap(mCommands);
+		seq = mCommandSeq;
+	}
+
+	for (auto &command : commands)
+	{
+		if (command.type == Command::ADD)
+		{
+			watchChannel(command);
+			continue;
+		}
+
+		// The channel may have been closed meanwhile
+		auto channelIter = mChannels.find(command.token);
+		if (channelIter == mChannels.end())
+		{
+			if (command.type == Command::WRITE)
+				completeWrite(command.token, 0, command.buffer.callback, BLUETOOTH_ERROR_FAIL);
+			continue;
+		}
+
+		Channel &channel = channelIter->second;
+
+		switch (command.type)
+		{
+		case Command::REMOVE:
+			closeChannel(command.token, false);
+			break;
+		case Command::WRITE:
+			queueTxBuffer(command.token, channel, command.buffer);
+			break;
+		case Command::COALESCE:
+			flushCoalesced(channel);
+			channel.coalesceDelay = command.coalesceDelay;
+			channel.coalesceMaxSize = command.coalesceMaxSize;
+			startTx(command.token, channel);
+			break;
+		case Command::FLUSH:
+			flushCoalesced(channel);
+			startTx(command.token, channel);
+			break;
+		default:
+			break;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		mCommandsDoneSeq = seq;
+	}
+
+	mCommandsDone.notify_all();
+
+	return true;
+}
+
+void Bluez5SppIoWorker::failCommands()
+{
+	std::list<Command> commands;
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+		commands.swap(mCommands);
+	}
+
+	for (auto &command : commands)
+	{
+		if (command.type == Command::WRITE)
+			completeWrite(command.token, 0, command.buffer.callback, BLUETOOTH_ERROR_FAIL);
+	}
+}
+
+void Bluez5SppIoWorker::watchChannel(const Command &command)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.u64 = command.token;
+
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, command.fd, &event) < 0)
+	{
+		ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to watch channel %d: %s", command.channelId, strerror(errno));
+
+		{
+			std::lock_guard<std::mutex> lock(mCommandMutex);
+			mTokens.erase(command.token);
+		}
+
+		Bluez5SppIoEvent closed;
+		closed.type = Bluez5SppIoEvent::CLOSED;
+		closed.channelId = command.channelId;
+		closed.token = command.token;
+		post(closed);
+		return;
+	}
+
+	Channel &channel = mChannels[command.token];
+	channel.channelId = command.channelId;
+	channel.fd = command.fd;
+	channel.txQueuedBytes = 0;
+	channel.congested = false;
+	channel.pollOut = false;
+	channel.coalesceDelay = 0;
+	channel.coalesceMaxSize = 0;
+	channel.coalesceDeadline = 0;
+	channel.shortWrites = 0;
+	channel.readErrors = 0;
+	channel.maxTxQueuedBytes = 0;
+	channel.statsChanged = false;
+}
+
+void Bluez5SppIoWorker::queueTxBuffer(uint64_t token, Channel &channel, TxBuffer &buffer)
+{
+	if (!buffer.file && channel.coalesceDelay && buffer.data.size() < channel.coalesceMaxSize)
+	{
+		coalesceWrite(channel, buffer);
+
+		if (channel.coalesceBuffer.size() >= channel.coalesceMaxSize)
+			flushCoalesced(channel);
+	}
+	else
+	{
+		// Anything held back has to go out first
+		flushCoalesced(channel);
+
+		// File data stays in the page cache and doesn't count towards
+		// the queued bytes
+		channel.txQueuedBytes += buffer.data.size();
+		channel.txQueue.push_back(std::move(buffer));
+	}
+
+	startTx(token, channel);
+}
+
+void Bluez5SppIoWorker::coalesceWrite(Channel &channel, TxBuffer &buffer)
+{
+	// A write which doesn't fit anymore starts the next batch
+	if (channel.coalesceBuffer.size() + buffer.data.size() > channel.coalesceMaxSize)
+		flushCoalesced(channel);
+
+	if (channel.coalesceBuffer.empty())
+		channel.coalesceDeadline = g_get_monotonic_time() + (gint64) channel.coalesceDelay * 1000;
+
+	channel.coalesceBuffer.insert(channel.coalesceBuffer.end(), buffer.data.begin(), buffer.data.end());
+	channel.coalesceCallbacks.push_back(buffer.callback);
+}
+
+void Bluez5SppIoWorker::flushCoalesced(Channel &channel)
+{
+	if (channel.coalesceBuffer.empty())
+		return;
+
+	std::list<BluetoothResultCallback> callbacks;
+	callbacks.swap(channel.coalesceCallbacks);
+
+	TxBuffer batch;
+	batch.data.swap(channel.coalesceBuffer);
+	batch.offset = 0;
+
+	// Every write merged into the batch gets the result of the batch
+	batch.callback = [callbacks](BluetoothError error) {
+		for (auto &callback : callbacks)
+		{
+			if (callback)
+				callback(error);
+		}
+	};
+
+	channel.txQueuedBytes += batch.data.size();
+	channel.txQueue.push_back(std::move(batch));
+}
+
+void Bluez5SppIoWorker::startTx(uint64_t token, Channel &channel)
+{
+	if (channel.txQueuedBytes > channel.maxTxQueuedBytes)
+	{
+		channel.maxTxQueuedBytes = channel.txQueuedBytes;
+		channel.statsChanged = true;
+	}
+
+	// With EPOLLOUT armed the socket is full and the data is picked up
+	// once it drained
+	if (channel.pollOut)
+	{
+		updateCongestion(token, channel);
+		postStats(token, channel);
+	}
+	else
+	{
+		flushChannel(token, channel);
+	}
+}
+
+int Bluez5SppIoWorker::nextCoalesceTimeout()
+{
+	gint64 deadline = 0;
+
+	for (auto &channel : mChannels)
+	{
+		if (channel.second.coalesceBuffer.empty())
+			continue;
+
+		if (!deadline || channel.second.coalesceDeadline < deadline)
+			deadline = channel.second.coalesceDeadline;
+	}
+
+	if (!deadline)
+		return -1;
+
+	gint64 remaining = deadline - g_get_monotonic_time();
+	if (remaining <= 0)
+		return 0;
+
+	return (remaining + 999) / 1000;
+}
+
+void Bluez5SppIoWorker::handleCoalesceTimeouts()
+{
+	gint64 now = g_get_monotonic_time();
+	std::list<uint64_t> expired;
+
+	for (auto &channel : mChannels)
+	{
+		if (!channel.second.coalesceBuffer.empty() && channel.second.coalesceDeadline <= now)
+			expired.push_back(channel.first);
+	}
+
+	// Sending may close channels, look each one up again
+	for (auto token : expired)
+	{
+		auto channelIter = mChannels.find(token);
+		if (channelIter == mChannels.end())
+			continue;
+
+		flushCoalesced(channelIter->second);
+		startTx(token, channelIter->second);
+	}
+}
+
+void Bluez5SppIoWorker::handleChannelEvents(uint64_t token, uint32_t events)
+{
+	// The channel may have been removed while we were waiting
+	auto channelIter = mChannels.find(token);
+	if (channelIter == mChannels.end())
+		return;
+
+	Channel &channel = channelIter->second;
+
+	if ((events & EPOLLOUT) && !flushChannel(token, channel))
+		return;
+
+	if ((events & EPOLLIN) && !readChannel(token, channel))
+		return;
+
+	if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+		closeChannel(token, true);
+}
+
+bool Bluez5SppIoWorker::readChannel(uint64_t token, Channel &channel)
+{
+	while (true)
+	{
+		ssize_t bytesRead = recv(channel.fd, mRxBuffer.data(), mRxBuffer.size(), 0);
+
+		if (bytesRead > 0)
+		{
+			Bluez5SppIoEvent event;
+			event.type = Bluez5SppIoEvent::DATA;
+			event.channelId = channel.channelId;
+			event.token = token;
+			event.data.assign(mRxBuffer.begin(), mRxBuffer.begin() + bytesRead);
+			post(event);
+
+			if ((size_t) bytesRead < mRxBuffer.size())
+				return true;
+
+			continue;
+		}
+
+		if (bytesRead < 0 && errno == EINTR)
+			continue;
+
+		if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+
+		if (bytesRead < 0)
+		{
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to read data from channel %d: %s", channel.channelId, strerror(errno));
+			channel.readErrors++;
+			channel.statsChanged = true;
+		}
+
+		closeChannel(token, true);
+		return false;
+	}
+}
+
+bool Bluez5SppIoWorker::flushChannel(uint64_t token, Channel &channel)
+{
+	while (!channel.txQueue.empty())
+	{
+		TxBuffer &buffer = channel.txQueue.front();
+
+		if (!sendBuffer(token, channel, buffer))
+		{
+			ERROR(MSGID_PROFILE_MANAGER_ERROR, 0, "Failed to write to channel %d: %s", channel.channelId, strerror(errno));
+			closeChannel(token, true);
+			return false;
+		}
+
+		bool complete = buffer.file ? buffer.file->isComplete() : buffer.offset == buffer.data.size();
+		if (!complete)
+			break;
+
+		completeWrite(token, channel.channelId, buffer.callback, BLUETOOTH_ERROR_NONE);
+
+		channel.txQueue.pop_front();
+	}
+
+	setPollOut(token, channel, !channel.txQueue.empty());
+	updateCongestion(token, channel);
+	postStats(token, channel);
+
+	return true;
+}
+
+bool Bluez5SppIoWorker::sendBuffer(uint64_t token, Channel &channel, TxBuffer &buffer)
+{
+	if (buffer.file)
+	{
+		uint64_t sent = buffer.file->getBytesSent();
+
+		if (!buffer.file->send(channel.fd))
+			return false;
+
+		if (buffer.progress && buffer.file->getBytesSent() != sent)
+		{
+			Bluez5SppIoEvent event;
+			event.type = Bluez5SppIoEvent::PROGRESS;
+			event.channelId = channel.channelId;
+			event.token = token;
+			event.progress = buffer.progress;
+			event.bytesSent = buffer.file->getBytesSent();
+			event.totalBytes = buffer.file->getLength();
+			post(event);
+		}
+
+		return true;
+	}
+
+	while (buffer.offset < buffer.data.size())
+	{
+		ssize_t written = send(channel.fd, buffer.data.data() + buffer.offset,
+		                       buffer.data.size() - buffer.offset, MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		buffer.offset += written;
+		channel.txQueuedBytes -= written;
+
+		if (buffer.offset < buffer.data.size())
+		{
+			channel.shortWrites++;
+			channel.statsChanged = true;
+		}
+	}
+
+	return true;
+}
+
+void Bluez5SppIoWorker::completeWrite(uint64_t token, BluetoothSppChannelId channelId,
+                                      BluetoothResultCallback callback, BluetoothError error)
+{
+	Bluez5SppIoEvent event;
+	event.type = Bluez5SppIoEvent::WRITE_DONE;
+	event.channelId = channelId;
+	event.token = token;
+	event.callback = callback;
+	event.error = error;
+	post(event);
+}
+
+void Bluez5SppIoWorker::closeChannel(uint64_t token, bool notify)
+{
+	auto channelIter = mChannels.find(token);
+	if (channelIter == mChannels.end())
+		return;
+
+	Channel &channel = channelIter->second;
+
+	if (mEpollFd >= 0)
+		epoll_ctl(mEpollFd, EPOLL_CTL_DEL, channel.fd, NULL);
+
+	for (auto &buffer : channel.txQueue)
+		completeWrite(token, channel.channelId, buffer.callback, BLUETOOTH_ERROR_FAIL);
+
+	for (auto &callback : channel.coalesceCallbacks)
+		completeWrite(token, channel.channelId, callback, BLUETOOTH_ERROR_FAIL);
+
+	if (notify)
+	{
+		// Whatever led to the close is still accounted for
+		postStats(token, channel);
+
+		Bluez5SppIoEvent event;
+		event.type = Bluez5SppIoEvent::CLOSED;
+		event.channelId = channel.channelId;
+		event.token = token;
+		post(event);
+	}
+
+	mChannels.erase(channelIter);
+
+	std::lock_guard<std::mutex> lock(mCommandMutex);
+	mTokens.erase(token);
+}
+
+void Bluez5SppIoWorker::setPollOut(uint64_t token, Channel &channel, bool pollOut)
+{
+	if (channel.pollOut == pollOut)
+		return;
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | (pollOut ? EPOLLOUT : 0);
+	event.data.u64 = token;
+
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, channel.fd, &event) == 0)
+		channel.pollOut = pollOut;
+}
+
+void Bluez5SppIoWorker::updateCongestion(uint64_t token, Channel &channel)
+{
+	bool congested = channel.congested;
+
+	if (!congested && channel.txQueuedBytes >= mTxHighWaterMark)
+		congested = true;
+	else if (congested && channel.txQueuedBytes <= mTxLowWaterMark)
+		congested = false;
+
+	if (congested == channel.congested)
+		return;
+
+	channel.congested = congested;
+
+	{
+		std::lock_guard<std::mutex> lock(mCommandMutex);
+
+		auto tokenIter = mTokens.find(token);
+		if (tokenIter != mTokens.end())
+			tokenIter->second = congested;
+	}
+
+	Bluez5SppIoEvent event;
+	event.type = Bluez5SppIoEvent::CONGESTION;
+	event.channelId = channel.channelId;
+	event.token = token;
+	event.congested = congested;
+	post(event);
+}
+
+void Bluez5SppIoWorker::postStats(uint64_t token, Channel &channel)
+{
+	if (!channel.statsChanged)
+		return;
+
+	// Counted all the same as that is cheaper than checking every time
+	if (!mStatsEnabled)
+	{
+		channel.shortWrites = 0;
+		channel.readErrors = 0;
+		channel.maxTxQueuedBytes = 0;
+		channel.statsChanged = false;
+		return;
+	}
+
+	Bluez5SppIoEvent event;
+	event.type = Bluez5SppIoEvent::STATS;
+	event.channelId = channel.channelId;
+	event.token = token;
+	event.shortWrites = channel.shortWrites;
+	event.readErrors = channel.readErrors;
+	event.maxTxQueuedBytes = channel.maxTxQueuedBytes;
+	post(event);
+
+	channel.shortWrites = 0;
+	channel.readErrors = 0;
+	channel.statsChanged = false;
+}
+
+void Bluez5SppIoWorker::post(const Bluez5SppIoEvent &event)
+{
+	EventNode *node = new EventNode;
+	node->event = event;
+	node->next.store(nullptr, std::memory_order_relaxed);
+
+	mEventTail->next.store(node, std::memory_order_release);
+	mEventTail = node;
+
+	// One dispatch per batch of events, however many arrive until it runs
+	if (mDispatchPending.exchange(true))
+		return;
+
+	GSource *source = g_idle_source_new();
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	g_source_set_callback(source, dispatchEvents, this, NULL);
+	mDispatchSource = g_source_attach(source, mContext);
+	g_source_unref(source);
+}
+
+bool Bluez5SppIoWorker::takeEvent(Bluez5SppIoEvent &event)
+{
+	EventNode *next = mEventHead->next.load(std::memory_order_acquire);
+	if (!next)
+		return false;
+
+	event = std::move(next->event);
+
+	delete mEventHead;
+	mEventHead = next;
+
+	return true;
+}
+
+gboolean Bluez5SppIoWorker::dispatchEvents(gpointer user_data)
+{
+	Bluez5SppIoWorker *worker = static_cast<Bluez5SppIoWorker*>(user_data);
+
+	// Cleared before taking the events so anything posted from now on
+	// schedules another dispatch
+	worker->mDispatchPending.exchange(false);
+
+	// The handler may delete the worker
+	std::list<Bluez5SppIoEvent> events;
+	Bluez5SppIoEvent event;
+	while (worker->takeEvent(event))
+		events.push_back(event);
+
+	EventHandler handler = worker->mHandler;
+
+	for (auto &event : events)
+		handler(event);
+
+	return FALSE;
+}
@@ -0,0 +1,249 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef BLUEZ5SPPIOWORKER_H
+#define BLUEZ5SPPIOWORKER_H
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <glib.h>
+
+#include <bluetooth-sil-api.h>
+
+#include "bluez5sppfiletransfer.h"
+
+struct Bluez5SppIoEvent
+{
+	enum Type
+	{
+		DATA,
+		CLOSED,
+		WRITE_DONE,
+		CONGESTION,
+		PROGRESS,
+		STATS
+	};
+
+	Type type;
+	BluetoothSppChannelId channelId;
+	// identifies the connection the event belongs to as channel ids are
+	// reused for later connections
+	uint64_t token;
+	std::vector<uint8_t> data;
+	BluetoothResultCallback callback;
+	BluetoothError error;
+	bool congested;
+	Bluez5SppFileProgressCallback progress;
+	uint64_t bytesSent;
+	uint64_t totalBytes;
+	// counted since the previous STATS event of the connection
+	uint64_t shortWrites;
+	uint64_t readErrors;
+	size_t maxTxQueuedBytes;
+};
+
+// Runs the socket I/O of SPP channels on a thread of its own with epoll so
+// the data path doesn't compete with everything else on the main loop.
+// Callers only queue commands and wake the thread through an eventfd, the
+// sockets are touched by the thread alone. Received data, hangups and
+// write completions are handed to the event handler in the main context
+// the worker was created in. Connections are identified by the token
+// addChannel hands out as channel ids are reused for later connections.
+class Bluez5SppIoWorker
+{
+public:
+	typedef std::function<void(const Bluez5SppIoEvent &event)> EventHandler;
+
+	Bluez5SppIoWorker(EventHandler handler, uint32_t rxBufferSize);
+	// Write callbacks still pending are called with a failure before the
+	// worker goes away, all other events are dropped
+	~Bluez5SppIoWorker();
+
+	// A stopped worker can be started again. Writes racing with stop()
+	// simply fail.
+	bool start();
+	void stop();
+	bool isRunning() const { return mRunning; }
+
+	// Returns the token of the connection or 0 if the worker isn't
+	// running. The worker never closes the socket, that is left to the
+	// owner once the channel has been removed.
+	uint64_t addChannel(BluetoothSppChannelId channelId, int fd);
+	// Once this returns the worker doesn't touch the socket anymore.
+	// Writes still queued fail.
+	void removeChannel(uint64_t token);
+
+	// All of the following are safe to call from any thread. Writes fail
+	// right away with BLUETOOTH_ERROR_FAIL if the connection is gone and
+	// with BLUETOOTH_ERROR_BUSY while it is congested, otherwise the
+	// callback is called in the main context once all bytes are written
+	// or the connection went away.
+	BluetoothError write(uint64_t token, const uint8_t *data, uint32_t size, BluetoothResultCallback callback);
+	// Same for streaming a file, progress is reported after every batch
+	// of data the socket took
+	BluetoothError sendFile(uint64_t token, std::shared_ptr<Bluez5SppFileTransfer> file,
+	                        Bluez5SppFileProgressCallback progress, BluetoothResultCallback callback);
+	// Writes smaller than maxBatchSize are held back for up to maxDelay
+	// milliseconds and sent together with the ones following them
+	void setWriteCoalescing(uint64_t token, uint32_t maxDelay, uint32_t maxBatchSize);
+	void flush(uint64_t token);
+
+	void setTxWaterMarks(uint32_t highWaterMark, uint32_t lowWaterMark);
+	// STATS events are only posted while enabled
+	void setStatsEnabled(bool enabled) { mStatsEnabled = enabled; }
+	bool getStatsEnabled() const { return mStatsEnabled; }
+
+private:
+	struct TxBuffer
+	{
+		std::vector<uint8_t> data;
+		size_t offset;
+		BluetoothResultCallback callback;
+		// set instead of data for file transfers
+		std::shared_ptr<Bluez5SppFileTransfer> file;
+		Bluez5SppFileProgressCallback progress;
+	};
+
+	struct Command
+	{
+		enum Type
+		{
+			ADD,
+			REMOVE,
+			WRITE,
+			COALESCE,
+			FLUSH
+		};
+
+		Type type;
+		uint64_t token;
+		BluetoothSppChannelId channelId;
+		int fd;
+		TxBuffer buffer;
+		uint32_t coalesceDelay;
+		uint32_t coalesceMaxSize;
+	};
+
+	struct Channel
+	{
+		BluetoothSppChannelId channelId;
+		int fd;
+		std::list<TxBuffer> txQueue;
+		size_t txQueuedBytes;
+		bool congested;
+		bool pollOut;
+		// write coalescing is off while the delay is zero
+		uint32_t coalesceDelay;
+		uint32_t coalesceMaxSize;
+		std::vector<uint8_t> coalesceBuffer;
+		std::list<BluetoothResultCallback> coalesceCallbacks;
+		gint64 coalesceDeadline;
+		// statistics not reported yet
+		uint64_t shortWrites;
+		uint64_t readErrors;
+		size_t maxTxQueuedBytes;
+		bool statsChanged;
+	};
+
+	// Events travel from the I/O thread to the main context through a
+	// single producer single consumer list, the producer being stop() once
+	// the thread ended. The producer only ever moves mEventTail, the
+	// consumer only mEventHead which always points to a node whose event
+	// has been taken already.
+	struct EventNode
+	{
+		Bluez5SppIoEvent event;
+		std::atomic<EventNode*> next;
+	};
+
+	// Return 0 or an error if the connection is gone
+	uint64_t submitCommand(Command &command);
+	BluetoothError submitWrite(Command &command);
+	// Called with mCommandMutex held
+	void wake();
+
+	// Everything from here on runs on the I/O thread or, once it ended, in
+	// stop()
+	void run();
+	bool processCommands();
+	void failCommands();
+	void watchChannel(const Command &command);
+	void queueTxBuffer(uint64_t token, Channel &channel, TxBuffer &buffer);
+	void coalesceWrite(Channel &channel, TxBuffer &buffer);
+	void flushCoalesced(Channel &channel);
+	void startTx(uint64_t token, Channel &channel);
+	int nextCoalesceTimeout();
+	void handleCoalesceTimeouts();
+	void handleChannelEvents(uint64_t token, uint32_t events);
+	bool readChannel(uint64_t token, Channel &channel);
+	bool flushChannel(uint64_t token, Channel &channel);
+	bool sendBuffer(uint64_t token, Channel &channel, TxBuffer &buffer);
+	void completeWrite(uint64_t token, BluetoothSppChannelId channelId, BluetoothResultCallback callback,
+	                   BluetoothError error);
+	void closeChannel(uint64_t token, bool notify);
+	void setPollOut(uint64_t token, Channel &channel, bool pollOut);
+	void updateCongestion(uint64_t token, Channel &channel);
+	void postStats(uint64_t token, Channel &channel);
+
+	void post(const Bluez5SppIoEvent &event);
+	bool takeEvent(Bluez5SppIoEvent &event);
+	static gboolean dispatchEvents(gpointer user_data);
+
+	EventHandler mHandler;
+	GMainContext *mContext;
+	int mEpollFd;
+	int mWakeFd;
+	std::thread mThread;
+	bool mRunning;
+	std::atomic<uint32_t> mTxHighWaterMark;
+	std::atomic<uint32_t> mTxLowWaterMark;
+	std::atomic<bool> mStatsEnabled;
+	std::vector<uint8_t> mRxBuffer;
+
+	// Owned by the I/O thread while it runs
+	std::unordered_map<uint64_t, Channel> mChannels;
+
+	// Any thread may queue commands, so unlike the events they go through
+	// a plain locked list. The lock is never held during socket I/O.
+	std::mutex mCommandMutex;
+	std::condition_variable mCommandsDone;
+	std::list<Command> mCommands;
+	bool mAccepting;
+	bool mStopping;
+	bool mThreadExited;
+	uint64_t mNextToken;
+	uint64_t mCommandSeq;
+	uint64_t mCommandsDoneSeq;
+	// token -> congested for every live connection, lets writes fail
+	// right away without asking the I/O thread
+	std::unordered_map<uint64_t, bool> mTokens;
+
+	EventNode *mEventHead;
+	EventNode *mEventTail;
+	std::atomic<bool> mDispatchPending;
+	std::atomic<guint> mDispatchSource;
+};
+
+#endif // BLUEZ5SPPIOWORKER_H
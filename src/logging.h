@@ -58,5 +58,6 @@ extern PmLogContext bluez5LogContext;
 #define MSGID_PROFILE_MANAGER_ERROR                    "PROFILE_MANAGER_ERROR"
 #define MSGID_GATT_PROFILE_ERROR                       "GATT_PROFILE_ERROR"
 #define MSGID_BLE_ADVERTIMENT_ERROR                     "BLE_ADVERTIMENT_ERROR"
+#define MSGID_DISCOVERY_ERROR                          "DISCOVERY_ERROR"
 
 #endif // LOGGING_H
@@ -0,0 +1,76 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef PROPERTYDECODER_H
+#define PROPERTYDECODER_H
+
+#include <unordered_map>
+
+#include <glib.h>
+
+// Dispatches D-Bus properties to typed setters. Property names are
+// interned as GQuarks once when the table is built; decoding a name we
+// never registered is a single hash lookup and doesn't intern anything.
+// Dictionaries are walked with borrowed keys so no string is copied for
+// any entry of a PropertiesChanged signal.
+template <typename T, typename... Args>
+class PropertyDecoder
+{
+public:
+	typedef bool (*Setter)(T *object, GVariant *value, Args... args);
+
+	void add(const char *name, Setter setter)
+	{
+		mSetters[g_quark_from_static_string(name)] = setter;
+	}
+
+	bool decode(T *object, const gchar *name, GVariant *value, Args... args) const
+	{
+		GQuark quark = g_quark_try_string(name);
+		if (!quark)
+			return false;
+
+		auto iter = mSetters.find(quark);
+		if (iter == mSetters.end())
+			return false;
+
+		return iter->second(object, value, args...);
+	}
+
+	// Decodes every entry of an a{sv} dictionary and returns whether any
+	// of the setters reported a change.
+	bool decodeAll(T *object, GVariant *properties, Args... args) const
+	{
+		GVariantIter iter;
+		const gchar *name;
+		GVariant *value;
+		bool changed = false;
+
+		g_variant_iter_init(&iter, properties);
+		while (g_variant_iter_next(&iter, "{&sv}", &name, &value))
+		{
+			changed |= decode(object, name, value, args...);
+			g_variant_unref(value);
+		}
+
+		return changed;
+	}
+
+private:
+	std::unordered_map<GQuark, Setter> mSetters;
+};
+
+#endif // PROPERTYDECODER_H